@@ -43,7 +43,6 @@
 #include <asterisk/callerid.h>
 #endif
 #ifdef CC_AST_HAS_VERSION_13_0
-#include "asterisk/smoother.h"
 #include "asterisk/pickup.h"
 #include "asterisk/features_config.h"
 #endif
@@ -78,6 +77,12 @@ struct _diva_streaming_vector* vind;
 #define  CAPI_APPLID_UNUSED 0xffffffff
 unsigned capi_ApplID = CAPI_APPLID_UNUSED;
 
+/* B3 window and max. block size registered at CAPI */
+unsigned capi_b3_window = CAPI_MAX_B3_BLOCKS;
+unsigned capi_b3_maxblocksize = CAPI_MAX_B3_BLOCK_SIZE;
+/* max. data length of a DATA_B3_REQ, RTP header included */
+unsigned capi_b3_regblocksize = CAPI_MAX_B3_BLOCK_SIZE;
+
 #define CAPI_PLCI_VAR_NAME     "CAPIPLCI"
 #define CAPI_ECT_PLCI_VAR_NAME "CAPIECTPLCI"
 #define CAPI_DETECTED_TONE_NAME "CAPIDETECTEDTONE"
@@ -169,6 +174,7 @@ struct ast_module *myself;
  * 4. cc_mutex_lock(&messagenumber_lock);
  * 5. cc_mutex_lock(&usecnt_lock);
  * 6. cc_mutex_lock(&capi_put_lock);
+ * 7. cc_mutex_lock(&ifindex_lock);
  *
  *
  *  ** the PBX will call the callback functions with 
@@ -191,19 +197,78 @@ static struct cc_capi_controller *capi_controllers[CAPI_MAX_CONTROLLERS + 1];
 static int capi_num_controllers = 0;
 static unsigned int capi_counter = 0;
 
-static struct ast_channel *chan_for_task;
-static int channel_task;
 #define CAPI_CHANNEL_TASK_NONE             0
 #define CAPI_CHANNEL_TASK_HANGUP           1
 #define CAPI_CHANNEL_TASK_SOFTHANGUP       2
 #define CAPI_CHANNEL_TASK_PICKUP           3
 #define CAPI_CHANNEL_TASK_GOTOFAX          4
 
-static struct capi_pvt *interface_for_task;
-static int interface_task;
 #define CAPI_INTERFACE_TASK_NONE           0
 #define CAPI_INTERFACE_TASK_NULLIFREMOVE   1
 
+/*
+ * tasks which need to be done out of lock, after the
+ * capi message was handled. Each thread handling capi
+ * messages has its own list. Tasks are pushed lock-free
+ * by any thread and taken all at once by the owner.
+ */
+struct capi_task {
+	struct capi_task *next;
+	struct ast_channel *c;
+	struct capi_pvt *i;
+	int task;
+};
+
+struct capi_task_list {
+	struct capi_task *volatile head; /* newest first */
+};
+
+/*
+ * task nodes come from a static pool, so a deferred hangup is not lost
+ * when memory is short. Only when the pool is exhausted they are allocated.
+ */
+#define CAPI_TASK_POOL_SIZE                256
+
+static struct capi_task capi_task_pool[CAPI_TASK_POOL_SIZE];
+static struct capi_task *capi_task_free;
+static int capi_task_pool_used;
+AST_MUTEX_DEFINE_STATIC(capi_task_lock);
+
+static struct capi_task_list capi_main_tasks;
+static __thread struct capi_task_list *capi_thread_tasks; /* list of a worker */
+static volatile int capi_task_depth;
+static volatile int capi_task_highwater;
+
+/*
+ * optional dispatch workers, the device thread only reads the
+ * messages and hands them to the worker of the controller.
+ * So all messages of one PLCI are handled in order.
+ */
+#define CAPI_MAX_DISPATCH_WORKERS          16
+
+struct capi_dispatch_worker {
+	pthread_t thread;
+	cc_mutex_t lock;
+	ast_cond_t event;
+	int stop;
+	struct capi_rawmsg *first;
+	struct capi_rawmsg *last;
+	struct capi_task_list tasks;
+};
+
+static struct capi_dispatch_worker capi_dispatch_workers[CAPI_MAX_DISPATCH_WORKERS];
+static int capi_dispatch_nworkers = 0;
+static int capi_dispatch_running = 0;
+
+static int capi_rx_zerocopy = 0;
+
+/* defaults of 'b3blocks' and 'b3blocksize' from the general section */
+static int capi_default_b3blocks = CAPI_MAX_B3_BLOCKS;
+static int capi_default_b3blocksize = CAPI_MAX_B3_BLOCK_SIZE;
+
+/* free null-interfaces kept per controller */
+static int capi_nullif_pool_size = 0;
+
 static char capi_national_prefix[AST_MAX_EXTENSION];
 static char capi_international_prefix[AST_MAX_EXTENSION];
 static char capi_subscriber_prefix[AST_MAX_EXTENSION];
@@ -239,6 +304,7 @@ static char global_mohinterpret[MAX_MUSICCLASS] = "default";
 static struct ast_channel* capidev_acquire_locks_from_thread_context(struct capi_pvt *i);
 static int pbx_capi_hold(struct ast_channel *c, char *param);
 static int pbx_capi_retrieve(struct ast_channel *c, char *param);
+static void capi_disconnect(struct capi_pvt *i);
 #ifdef CC_AST_HAS_INDICATE_DATA
 static int pbx_capi_indicate(struct ast_channel *c, int condition, const void *data, size_t datalen);
 #else
@@ -303,7 +369,7 @@ static struct {
 static _cstruct capi_set_global_configuration(struct capi_pvt *i)
 {
 	unsigned short dtedce = 0;
-	unsigned char *buf = i->tmpbuf;
+	unsigned char *buf = i->globalconfiguration;
 
 	buf[0] = 2; /* len */
 
@@ -526,27 +592,182 @@ static char *transfercapability2str(int transfercapability)
 	}
 }
 
+/*
+ * get the task list of the thread handling capi messages
+ */
+static struct capi_task_list *capi_current_task_list(void)
+{
+	struct capi_task_list *list = capi_thread_tasks;
+
+	return (list != NULL) ? list : &capi_main_tasks;
+}
+
+/*
+ * get a task node from the pool
+ */
+static struct capi_task *capi_task_alloc(void)
+{
+	struct capi_task *t;
+
+	cc_mutex_lock(&capi_task_lock);
+	if ((t = capi_task_free) != NULL) {
+		capi_task_free = t->next;
+	} else if (capi_task_pool_used < CAPI_TASK_POOL_SIZE) {
+		t = &capi_task_pool[capi_task_pool_used++];
+	}
+	cc_mutex_unlock(&capi_task_lock);
+
+	if (t == NULL) {
+		t = ast_malloc(sizeof(*t));
+	}
+	return t;
+}
+
+/*
+ * give a task node back
+ */
+static void capi_task_release(struct capi_task *t)
+{
+	if ((t < capi_task_pool) || (t >= &capi_task_pool[CAPI_TASK_POOL_SIZE])) {
+		ast_free(t);
+		return;
+	}
+	cc_mutex_lock(&capi_task_lock);
+	t->next = capi_task_free;
+	capi_task_free = t;
+	cc_mutex_unlock(&capi_task_lock);
+}
+
+/*
+ * queue a task to the list of the current thread
+ */
+static void capi_add_task(struct ast_channel *c, struct capi_pvt *i, int task)
+{
+	struct capi_task_list *list = capi_current_task_list();
+	struct capi_task *t;
+	int depth, highwater;
+
+	t = capi_task_alloc();
+	if (t == NULL) {
+		cc_log(LOG_ERROR, "Unable to allocate task %d\n", task);
+		return;
+	}
+	t->c = c;
+	t->i = i;
+	t->task = task;
+
+	do {
+		t->next = list->head;
+	} while (!__sync_bool_compare_and_swap(&list->head, t->next, t));
+
+	depth = __sync_add_and_fetch(&capi_task_depth, 1);
+	while ((highwater = capi_task_highwater) < depth) {
+		if (__sync_bool_compare_and_swap(&capi_task_highwater, highwater, depth))
+			break;
+	}
+}
+
+/*
+ * get number of queued tasks and the maximum ever queued
+ */
+void pbx_capi_get_task_stats(int *depth, int *highwater)
+{
+	*depth = capi_task_depth;
+	*highwater = capi_task_highwater;
+}
+
 /*
  * set task for an interface which need to be done out of lock
  * ( after the capi thread loop )
  */
 static void capi_interface_task(struct capi_pvt *i, int task)
 {
-	interface_for_task = i;
-	interface_task = task;
+	capi_add_task(NULL, i, task);
 
 	cc_verbose(4, 1, VERBOSE_PREFIX_4 "%s: set interface task to %d\n",
 		i->name, task);
 }
 
+/*
+ * arm the timer of an interface for its earliest deferred task
+ */
+static void capi_interface_timer_update(struct capi_pvt *i)
+{
+	unsigned long long next = 0;
+	unsigned long long now;
+
+	if ((i->whentohangup) && ((next == 0) || (i->whentohangup < next)))
+		next = i->whentohangup;
+	if ((i->whentoqueuehangup) && ((next == 0) || (i->whentoqueuehangup < next)))
+		next = i->whentoqueuehangup;
+	if ((i->whentoretrieve) && ((next == 0) || (i->whentoretrieve < next)))
+		next = i->whentoretrieve;
+
+	if (next == 0) {
+		capi_timer_stop(&i->timer);
+		return;
+	}
+
+	now = capi_timer_now();
+	capi_timer_start(&i->timer, (next > now) ? (unsigned int)(next - now) : 0);
+}
+
+/*
+ * deferred tasks of an interface are due
+ */
+static void capi_interface_timeout(void *data)
+{
+	struct capi_pvt *i = data;
+	unsigned long long now = capi_timer_now();
+
+	cc_mutex_lock(&iflock);
+	if (i->used == NULL) {
+		cc_mutex_unlock(&iflock);
+		return;
+	}
+	if ((i->whentohangup) && (i->whentohangup <= now)) {
+		cc_verbose(3, 1, VERBOSE_PREFIX_2 "%s: stay-online timeout, hanging up.\n",
+			i->vname);
+		i->whentohangup = 0;
+		capi_disconnect(i);
+	}
+	if ((i->whentoqueuehangup) && (i->whentoqueuehangup <= now)) {
+		cc_verbose(3, 1, VERBOSE_PREFIX_2 "%s: stay-online queue-hangup.\n",
+			i->vname);
+		capi_queue_cause_control(i, 1);
+		i->whentoqueuehangup = 0;
+	}
+	if ((i->whentoretrieve) && (i->whentoretrieve <= now)) {
+		cc_verbose(3, 1, VERBOSE_PREFIX_2 "%s: deferred retrieve.\n",
+			i->vname);
+		i->whentoretrieve = 0;
+		if (i->owner) {
+			pbx_capi_retrieve(i->owner, NULL);
+		}
+	}
+	capi_interface_timer_update(i);
+	cc_mutex_unlock(&iflock);
+}
+
+/*
+ * set a deferred task of an interface to be done in ms milliseconds
+ */
+static void capi_interface_set_timeout(struct capi_pvt *i, unsigned long long *when, unsigned int ms)
+{
+	if (i->timer.func == NULL) {
+		capi_timer_init(&i->timer, capi_interface_timeout, i);
+	}
+	*when = capi_timer_now() + ms;
+	capi_interface_timer_update(i);
+}
+
 /*
  * set task for a channel which need to be done out of lock
  * ( after the capi thread loop )
  */
 static void capi_channel_task(struct ast_channel *c, int task)
 {
-	chan_for_task = c;
-	channel_task = task;
+	capi_add_task(c, NULL, task);
 
 #ifdef CC_AST_HAS_VERSION_11_0
 	const char *cur_name = ast_channel_name(c);
@@ -688,7 +909,7 @@ static int capi_check_diva_tone_function_allowed(struct capi_pvt *i, int useLine
 	if ((i->channeltype == CAPI_CHANNELTYPE_NULL) && (useLinePLCI != 0)) {
 		if ((i->line_plci->isdnstate & CAPI_ISDN_STATE_DISCONNECT))
 			return -1;
-		if (capi_verify_resource_plci(i->line_plci) != 0)
+		if (capi_verify_resource_plci(i->line_plci, i->line_plci_generation) != 0)
 			return -1;
 	}
 
@@ -858,12 +1079,12 @@ static int capi_detect_dtmf(struct capi_pvt *i, int flag)
 	cc_verbose(3, 0, VERBOSE_PREFIX_2 "%s: Setting up DTMF detector (PLCI=%#x, flag=%d)\n",
 		i->vname, i->PLCI, flag);
 
-	error = capi_sendf(i, 0, CAPI_FACILITY_REQ, i->PLCI, get_capi_MessageNumber(),
-		"w(www()())",
+	error = capi_send_dtmf_req(i->PLCI, get_capi_MessageNumber(),
 		((i->channeltype != CAPI_CHANNELTYPE_NULL) || (i->line_plci != 0)) ?  FACILITYSELECTOR_DTMF : PRIV_SELECTOR_DTMF_ONDATA,
 		(flag == 1) ? 1:2,  /* start/stop DTMF listen */
 		CAPI_DTMF_MIN_TONE_DURATION,
-		CAPI_DTMF_MIN_GAP_DURATION
+		CAPI_DTMF_MIN_GAP_DURATION,
+		-1
 	);
 
 	if (error != 0) {
@@ -882,9 +1103,6 @@ static int capi_detect_dtmf(struct capi_pvt *i, int flag)
  */
 static int local_queue_frame(struct capi_pvt *i, struct ast_frame *f)
 {
-	unsigned char *wbuf;
-	int wbuflen;
-
 	if (!(i->isdnstate & CAPI_ISDN_STATE_PBX)) {
 		/* if there is no PBX running yet,
 		   we don't need any frames sent */
@@ -919,17 +1137,8 @@ static int local_queue_frame(struct capi_pvt *i, struct ast_frame *f)
 	if (f->frametype != AST_FRAME_VOICE)
 		f->datalen = 0;
 
-	wbuflen = sizeof(struct ast_frame) + f->datalen;
-	wbuf = alloca(wbuflen);
-	memcpy(wbuf, f, sizeof(struct ast_frame));
-	if (f->datalen) {
-		memcpy(wbuf + sizeof(struct ast_frame), f->FRAME_DATA_PTR, f->datalen);
-	}
+	capi_write_pipeframe(i, f);
 
-	if (write(i->writerfd, wbuf, wbuflen) != wbuflen) {
-		cc_log(LOG_ERROR, "Could not write to pipe for %s fd:%d errno:%d\n",
-			i->vname, i->writerfd, errno);
-	}
 	return 0;
 }
 
@@ -1022,8 +1231,7 @@ static int capi_send_dtmf_digits(struct capi_pvt *i, char digit)
 		return -1;
 	}
 
-	ret = capi_sendf(i, 0, CAPI_FACILITY_REQ, i->NCCI, get_capi_MessageNumber(),
-		"w(www(b)())",
+	ret = capi_send_dtmf_req(i->NCCI, get_capi_MessageNumber(),
 		FACILITYSELECTOR_DTMF,
 		3,	/* send DTMF digit */
 		CAPI_DTMF_MIN_TONE_DURATION,	/* XXX: duration comes from asterisk in 1.4 */
@@ -1196,14 +1404,7 @@ static void interface_cleanup(struct capi_pvt *i)
 
 	pbx_capi_voicecommand_cleanup(i);
 
-	if (i->readerfd != -1) {
-		close(i->readerfd);
-		i->readerfd = -1;
-	}
-	if (i->writerfd != -1) {
-		close(i->writerfd);
-		i->writerfd = -1;
-	}
+	capi_close_reader_writer_pipe(i);
 
 	i->isdnstate = 0;
 	i->isdnstate2 = 0;
@@ -1213,11 +1414,12 @@ static void interface_cleanup(struct capi_pvt *i)
 	i->whentohangup = 0;
 	i->whentoqueuehangup = 0;
 	i->whentoretrieve = 0;
+	capi_timer_stop(&i->timer);
 
 	i->FaxState &= ~CAPI_FAX_STATE_MASK;
 
-	i->PLCI = 0;
-	i->MessageNumber = 0;
+	capi_interface_set_plci(i, 0);
+	capi_interface_set_msgnum(i, 0);
 	i->NCCI = 0;
 	i->onholdPLCI = 0;
 	i->doEC = i->doEC_global;
@@ -1385,7 +1587,7 @@ void capi_activehangup(struct capi_pvt *i, int state)
 		   like CCBS */
 		cc_verbose(2, 1, VERBOSE_PREFIX_4 "%s: disconnect deferred, stay-online mode PLCI=%#x\n",
 			i->vname, i->PLCI);
-		i->whentohangup = time(NULL) + 18; /* timeout 18 seconds */
+		capi_interface_set_timeout(i, &i->whentohangup, 18000); /* timeout 18 seconds */
 		return;
 	}
 
@@ -1544,7 +1746,7 @@ static void pbx_capi_call_build_calling_party_number(
 #endif /* defined(CC_AST_HAS_VERSION_11_0) || defined(CC_AST_HAS_VERSION_1_8) */
 
 	if (use_defaultcid) {
-		cc_copy_string(callerid, i->defaultcid, sizeof(callerid));
+		cc_copy_string(callerid, i->conf->defaultcid, sizeof(callerid));
 	} else if (ocid) {
 		cc_copy_string(callerid, ocid, sizeof(callerid));
 	}
@@ -1694,7 +1896,7 @@ static int pbx_capi_call(struct ast_channel *c, void *idest, int timeout)
 	i->isdnstate |= CAPI_ISDN_STATE_PBX;
 	i->state = CAPI_STATE_CONNECTPENDING;
 	ast_setstate(c, AST_STATE_DIALING);
-	i->MessageNumber = get_capi_MessageNumber();
+	capi_interface_set_msgnum(i, get_capi_MessageNumber());
 
 	/* if this is a CCBS/CCNR callback call */
 	if (i->ccbsnrhandle) {
@@ -1943,9 +2145,9 @@ static int capi_send_answer(struct ast_channel *c, _cstruct b3conf)
 	}
 
 	if ((i->isdnmode == CAPI_ISDNMODE_DID) &&
-	    ((strlen(i->incomingmsn) < strlen(i->dnid)) && 
-	    (strcmp(i->incomingmsn, "*")))) {
-		dnid = i->dnid + strlen(i->incomingmsn);
+	    ((strlen(i->conf->incomingmsn) < strlen(i->dnid)) && 
+	    (strcmp(i->conf->incomingmsn, "*")))) {
+		dnid = i->dnid + strlen(i->conf->incomingmsn);
 	} else {
 		dnid = i->dnid;
 	}
@@ -2491,7 +2693,7 @@ static struct ast_channel *capi_new(struct capi_pvt *i, int state, const char *l
 #ifdef CC_AST_HAS_EXT_CHAN_ALLOC
 	tmp = ast_channel_alloc(0, state, i->cid, emptyid,
 #ifdef CC_AST_HAS_EXT2_CHAN_ALLOC
-		i->accountcode, i->dnid, i->context, 
+		i->conf->accountcode, i->dnid, i->conf->context, 
 #ifdef CC_AST_HAS_VERSION_13_0
 		NULL, requestor,
 #endif
@@ -2537,9 +2739,8 @@ static struct ast_channel *capi_new(struct capi_pvt *i, int state, const char *l
 	tmp->fds[0] = i->readerfd;
 #endif
 
-	if (i->smoother != NULL) {
-		ast_smoother_reset(i->smoother, CAPI_MAX_B3_BLOCK_SIZE);
-	}
+	capi_b3_tx_reset(i);
+	i->txformat = 0;
 
 	i->state = CAPI_STATE_DISCONNECTED;
 	i->calledPartyIsISDN = 1;
@@ -2548,9 +2749,8 @@ static struct ast_channel *capi_new(struct capi_pvt *i, int state, const char *l
 	i->outgoing = 0;
 	i->onholdPLCI = 0;
 	i->doholdtype = i->holdtype;
-	i->B3q = 0;
-	i->B3count = 0;
-	memset(i->txavg, 0, ECHO_TX_COUNT);
+	memset(i->txavg, 0, sizeof(i->txavg));
+	i->txavgpos = 0;
 
 	i->divaAudioFlags            = 0;
 	i->divaDataStubAudioFlags    = 0;
@@ -2690,23 +2890,23 @@ static struct ast_channel *capi_new(struct capi_pvt *i, int state, const char *l
 		tmp->amaflags = i->amaflags;
 
 #ifdef CC_AST_HAS_VERSION_11_0
-	ast_channel_context_set(tmp, i->context);
+	ast_channel_context_set(tmp, i->conf->context);
 	ast_channel_exten_set(tmp, i->dnid);
 #else /* !defined(CC_AST_HAS_VERSION_11_9) */
-	cc_copy_string(tmp->context, i->context, sizeof(tmp->context));
+	cc_copy_string(tmp->context, i->conf->context, sizeof(tmp->context));
 	cc_copy_string(tmp->exten, i->dnid, sizeof(tmp->exten));
 #endif /* defined(CC_AST_HAS_VERSION_11_0) */
 #ifdef CC_AST_HAS_STRINGFIELD_IN_CHANNEL
 #ifdef CC_AST_HAS_VERSION_11_0
-	ast_channel_accountcode_set(tmp, i->accountcode);
-	ast_channel_language_set(tmp, i->language);
+	ast_channel_accountcode_set(tmp, i->conf->accountcode);
+	ast_channel_language_set(tmp, i->conf->language);
 #else /* !defined(CC_AST_HAS_VERSION_11_9) */
-	ast_string_field_set(tmp, accountcode, i->accountcode);
-	ast_string_field_set(tmp, language, i->language);
+	ast_string_field_set(tmp, accountcode, i->conf->accountcode);
+	ast_string_field_set(tmp, language, i->conf->language);
 #endif /* defined(CC_AST_HAS_VERSION_11_0) */
 #else
-	cc_copy_string(tmp->accountcode, i->accountcode, sizeof(tmp->accountcode));
-	cc_copy_string(tmp->language, i->language, sizeof(tmp->language));
+	cc_copy_string(tmp->accountcode, i->conf->accountcode, sizeof(tmp->accountcode));
+	cc_copy_string(tmp->language, i->conf->language, sizeof(tmp->language));
 #endif
 #endif
 
@@ -2715,7 +2915,7 @@ static struct ast_channel *capi_new(struct capi_pvt *i, int state, const char *l
 
 #ifdef CC_AST_HAS_VERSION_1_4
 	ast_atomic_fetchadd_int(&usecnt, 1);
-	ast_jb_configure(tmp, &i->jbconf);
+	ast_jb_configure(tmp, &i->conf->jbconf);
 	ast_module_ref(myself);
 #else
 	cc_mutex_lock(&usecnt_lock);
@@ -2882,7 +3082,7 @@ found_best_channel:
 			cc_log(LOG_ERROR, "cannot create new " CC_MESSAGE_NAME " channel\n");
 			interface_cleanup(i);
 		}
-		i->PLCI = 0;
+		capi_interface_set_plci(i, 0);
 		i->outgoing = 1;	/* this is an outgoing line */
 		i->ccbsnrhandle = ccbsnrhandle;
 		cc_mutex_unlock(&iflock);
@@ -3882,24 +4082,24 @@ static void capi_handle_dtmf_fax(struct capi_pvt *i)
 #endif /* defined(CC_AST_HAS_VERSION_11_0) */
 
 	faxcontext = cur_context;
-	if (strlen(i->faxcontext) > 0)
-		faxcontext = i->faxcontext;
+	if (strlen(i->conf->faxcontext) > 0)
+		faxcontext = i->conf->faxcontext;
 	
-	if ((!strcmp(cur_exten, i->faxexten)) &&
+	if ((!strcmp(cur_exten, i->conf->faxexten)) &&
 	    (!strcmp(cur_context, faxcontext))) {
 		cc_log(LOG_DEBUG, "Already in fax context/extension, not redirecting\n");
 		return;
 	}
 
-	if (!ast_exists_extension(c, faxcontext, i->faxexten, i->faxpriority, i->cid)) {
+	if (!ast_exists_extension(c, faxcontext, i->conf->faxexten, i->conf->faxpriority, i->cid)) {
 		cc_verbose(3, 0, VERBOSE_PREFIX_3
 			"Fax tone detected, but no extension '%s' for %s in context '%s'\n",
-			i->faxexten, cur_name, faxcontext);
+			i->conf->faxexten, cur_name, faxcontext);
 		return;
 	}
 
 	cc_verbose(2, 0, VERBOSE_PREFIX_3 "%s: Redirecting %s for fax to %s,%s,%d\n",
-		i->vname, cur_name, faxcontext, i->faxexten, i->faxpriority);
+		i->vname, cur_name, faxcontext, i->conf->faxexten, i->conf->faxpriority);
 			
 	capi_channel_task(c, CAPI_CHANNEL_TASK_GOTOFAX);
 
@@ -3934,7 +4134,7 @@ static int search_did(struct ast_channel *c)
 		cc_verbose(3, 1, VERBOSE_PREFIX_3 "%s: %s: %s matches in context %s for immediate\n",
 			i->vname, cur_name, exten, cur_context);
 	} else {
-		if (strlen(i->dnid) < strlen(i->incomingmsn))
+		if (strlen(i->dnid) < strlen(i->conf->incomingmsn))
 			return 0;
 		exten = i->dnid;
 	}
@@ -4228,7 +4428,7 @@ static void capidev_handle_info_disconnect(_cmsg *CMSG, unsigned int PLCI, unsig
 			if ((i->fsetting & CAPI_FSETTING_STAYONLINE)) {
 				cc_verbose(3, 1, VERBOSE_PREFIX_2 "%s: stay-online hangup frame queued.\n",
 					i->vname);
-				i->whentoqueuehangup = time(NULL) + 1;
+				capi_interface_set_timeout(i, &i->whentoqueuehangup, 1000);
 			} else {
 				capi_queue_cause_control(i, 1);
 			}
@@ -4893,6 +5093,57 @@ static int pbx_capi_get_samples(struct capi_pvt *i, int length)
 	return (length);
 }
 
+/*
+ * queue a voice frame, whose data is still in the receive buffer of
+ * the DATA_B3_IND. Returns -1 if the caller must answer the DATA_B3_IND.
+ */
+static int local_queue_frame_held(struct capi_pvt *i, struct ast_frame *f,
+	_cdword ncci, _cword msgnum, _cword datahandle)
+{
+	if ((i->isdnstate & CAPI_ISDN_STATE_PBX) &&
+	    (i->state != CAPI_STATE_DISCONNECTING) &&
+	    (!(i->isdnstate & CAPI_ISDN_STATE_HANGUP)) &&
+	    (i->writerfd != -1) &&
+	    (capi_write_pipeframe_held(i, f, ncci, msgnum, datahandle) == 0)) {
+		return 0;
+	}
+
+	/* fallback, the frame is copied */
+	local_queue_frame(i, f);
+	return -1;
+}
+
+#ifdef DIVA_STREAMING
+/*
+ * read the voice data of a Diva stream indication and convert it in the
+ * same pass from the stream segments into dst, energy gets the sum of the
+ * echo squelch. Returns the length.
+ */
+static int capidev_read_vector_voice(struct capi_pvt *i, unsigned char *dst,
+	const struct _diva_streaming_vector *v, int nr_v, int *energy)
+{
+	const unsigned char *src;
+	int n, seglen, len = 0;
+	int es = ((i->doES == 1) && (!capi_tcap_is_digital(i->transfercapability)));
+
+	*energy = 0;
+	for (n = 0; (n < nr_v) && (len < capi_b3_maxblocksize); n++) {
+		src = v[n].data;
+		seglen = MIN((int)v[n].length, capi_b3_maxblocksize - len);
+		if (es) {
+			*energy += capi_es_rx(dst + len, src, seglen, capi_line_magnitude);
+		} else if ((i->rxgain == 1.0) || (capi_tcap_is_digital(i->transfercapability))) {
+			capi_reverse_bits(dst + len, src, seglen);
+		} else {
+			capi_xform_bytes(dst + len, src, seglen, i->g.rx_xform);
+		}
+		len += seglen;
+	}
+
+	return len;
+}
+#endif
+
 /*
  * CAPI DATA_B3_IND
  */
@@ -4911,26 +5162,61 @@ static void capidev_handle_data_b3_indication(
 	int rxavg = 0;
 	int txavg = 0;
 	int rtpoffset = 0;
+	int held = 0;
+	int converted = 0;
+	int inring = 0;
 
 	if (i != NULL) {
 		if ((i->isdnstate & CAPI_ISDN_STATE_RTP)) rtpoffset = RTP_HEADER_SIZE;
 		b3buf = &(i->rec_buffer[AST_FRIENDLY_OFFSET - rtpoffset]);
 		if (CMSG != 0) {
 			b3len = DATA_B3_IND_DATALENGTH(CMSG);
-			memcpy(b3buf, (char *)DATA_B3_IND_DATA(CMSG), b3len);
+			if ((capi_rx_zerocopy) && (!capi_dispatch_running) &&
+			    (i->virtualBridgePeer == 0) && (i->fFax == NULL) &&
+			    (!(i->isdnstate & (CAPI_ISDN_STATE_RTP | CAPI_ISDN_STATE_B3_CHANGE |
+			    CAPI_ISDN_STATE_LI | CAPI_ISDN_STATE_HANGUP))) &&
+			    (i->state != CAPI_STATE_DISCONNECTING)) {
+				/* voice frame is converted in place and stays in the
+				   receive buffer until the PBX has read it */
+				b3buf = (unsigned char *)DATA_B3_IND_DATA(CMSG);
+				held = 1;
+			} else {
+				memcpy(b3buf, (char *)DATA_B3_IND_DATA(CMSG), b3len);
+			}
 		} else {
 #ifdef DIVA_STREAMING
-			dword i = 0, k = 0;
-			b3len = (int)diva_streaming_read_vector_data(vind,
-				vind_nr, &i, &k, b3buf, CAPI_MAX_B3_BLOCK_SIZE);
+			if ((i->bproto != CC_BPROTO_VOCODER) && (i->virtualBridgePeer == 0) &&
+			    (i->fFax == NULL) && (!(i->isdnstate & CAPI_ISDN_STATE_RTP))) {
+				unsigned char *slot = NULL;
+
+				if ((i->isdnstate & CAPI_ISDN_STATE_PBX) && (i->writerfd != -1) &&
+				    (!(i->isdnstate & (CAPI_ISDN_STATE_B3_CHANGE | CAPI_ISDN_STATE_LI |
+				    CAPI_ISDN_STATE_HANGUP))) && (i->state != CAPI_STATE_DISCONNECTING)) {
+					/* the frame will be queued, use the next slot of the
+					   frame ring as buffer, it is published below */
+					slot = capi_write_pipeframe_reserve(i, capi_b3_maxblocksize);
+				}
+				if (slot != NULL) {
+					b3buf = slot;
+					inring = 1;
+				}
+				/* voice is converted straight out of the stream segments */
+				b3len = capidev_read_vector_voice(i, b3buf, vind, vind_nr, &rxavg);
+				converted = 1;
+			} else {
+				dword i = 0, k = 0;
+				b3len = (int)diva_streaming_read_vector_data(vind,
+					vind_nr, &i, &k, b3buf, capi_b3_maxblocksize);
+			}
 #endif
 		}
 	}
 	
 
-	if (CMSG != 0) { /* send a DATA_B3_RESP very quickly to free the buffer in capi */
-		capi_sendf(NULL, 0, CAPI_DATA_B3_RESP, NCCI, HEADER_MSGNUM(CMSG),
-			"w", DATA_B3_IND_DATAHANDLE(CMSG));
+	if ((CMSG != 0) && (!capi_dispatch_running) && (!held)) {
+		/* send a DATA_B3_RESP very quickly to free the buffer in capi,
+		   with dispatch workers this was done by the device thread */
+		capi_send_data_b3_resp(NCCI, HEADER_MSGNUM(CMSG), DATA_B3_IND_DATAHANDLE(CMSG));
 	}
 
 	return_on_no_interface("DATA_B3_IND");
@@ -4942,10 +5228,20 @@ static void capidev_handle_data_b3_indication(
 				&& (i->bridgePeer->diva_stream_entry == 0)
 #endif
 				) {
-			if (i->bridgePeer->NCCI != 0) {
-				i->bridgePeer->send_buffer_handle++;
-				capi_sendf(NULL, 0, CAPI_DATA_B3_REQ, i->bridgePeer->NCCI, get_capi_MessageNumber(),
-					"dwww", b3buf, b3len, i->bridgePeer->send_buffer_handle, 0);
+			struct capi_pvt *peer = i->bridgePeer;
+
+			/* the peer forwards to us with its lock held, waiting
+			   for it here could deadlock, the block is dropped then */
+			if ((b3len <= peer->txslotsize) && (cc_mutex_trylock(&peer->lock) == 0)) {
+				if (peer->NCCI != 0) {
+					/* queued on the B3 window of the peer like its own blocks */
+					memcpy(capi_b3_tx_slot(peer), b3buf, b3len);
+					capi_b3_tx_commit(peer, b3len);
+				}
+				cc_mutex_unlock(&peer->lock);
+			} else {
+				cc_verbose(4, 1, VERBOSE_PREFIX_4 "%s: bridge block for %s dropped (len = %d).\n",
+					i->vname, peer->vname, b3len);
 			}
 		}
 		return;
@@ -4983,26 +5279,21 @@ static void capidev_handle_data_b3_indication(
 		return;
 	}
 
-	if (i->B3q < (((CAPI_MAX_B3_BLOCKS - 1) * CAPI_MAX_B3_BLOCK_SIZE) + 1)) {
-		i->B3q += b3len;
-	}
-
 	if (i->bproto != CC_BPROTO_VOCODER) {
 		if ((i->doES == 1) && (!capi_tcap_is_digital(i->transfercapability))) {
-			for (j = 0; j < b3len; j++) {
-				*(b3buf + j) = capi_reversebits[*(b3buf + j)]; 
-				if (capi_capability == CC_FORMAT_ULAW) {
-					rxavg += abs(capiULAW2INT[ capi_reversebits[*(b3buf + j)]]);
-				} else {
-					rxavg += abs(capiALAW2INT[ capi_reversebits[*(b3buf + j)]]);
-				}
+			if (converted) {
+				/* energy summed while reading */
+			} else {
+				rxavg = capi_es_rx(b3buf, b3buf, b3len, capi_line_magnitude);
 			}
-			rxavg = rxavg / j;
+			if (b3len > 0)
+				rxavg = rxavg / b3len;
+			/* oldest entries of the tx history, the write position is the oldest */
 			for (j = 0; j < ECHO_EFFECTIVE_TX_COUNT; j++) {
-				txavg += i->txavg[j];
+				txavg += i->txavg[(i->txavgpos + j) % ECHO_TX_COUNT];
 			}
 			txavg = txavg / j;
-				    
+
 			if ( (txavg / ECHO_TXRX_RATIO) > rxavg) {
 				if (capi_capability == CC_FORMAT_ULAW) {
 					memset(b3buf, 255, b3len);
@@ -5012,15 +5303,11 @@ static void capidev_handle_data_b3_indication(
 				cc_verbose(6, 1, VERBOSE_PREFIX_3 "%s: SUPPRESSING ECHO rx=%d, tx=%d\n",
 						i->vname, rxavg, txavg);
 			}
-		} else {
+		} else if (!converted) {
 			if ((i->rxgain == 1.0) || (capi_tcap_is_digital(i->transfercapability))) {
-				for (j = 0; j < b3len; j++) {
-					*(b3buf + j) = capi_reversebits[*(b3buf + j)];
-				}
+				capi_reverse_bits(b3buf, b3buf, b3len);
 			} else {
-				for (j = 0; j < b3len; j++) {
-					*(b3buf + j) = capi_reversebits[i->g.rxgains[*(b3buf + j)]];
-				}
+				capi_xform_bytes(b3buf, b3buf, b3len, i->g.rx_xform);
 			}
 		}
 		SET_FRAME_SUBCLASS_CODEC(fr.subclass, capi_capability);
@@ -5038,6 +5325,17 @@ static void capidev_handle_data_b3_indication(
 	fr.src = NULL;
 	cc_verbose(8, 1, VERBOSE_PREFIX_3 "%s: DATA_B3_IND (len=%d) fr.datalen=%d fr.subclass=%ld\n",
 		i->vname, b3len, fr.datalen, GET_FRAME_SUBCLASS_CODEC(fr.subclass));
+	if (held) {
+		if (local_queue_frame_held(i, &fr, NCCI, HEADER_MSGNUM(CMSG),
+		    DATA_B3_IND_DATAHANDLE(CMSG)) != 0) {
+			capi_send_data_b3_resp(NCCI, HEADER_MSGNUM(CMSG), DATA_B3_IND_DATAHANDLE(CMSG));
+		}
+		return;
+	}
+	if (inring) {
+		capi_write_pipeframe_publish(i, &fr);
+		return;
+	}
 	local_queue_frame(i, &fr);
 	return;
 }
@@ -5074,8 +5372,8 @@ static void capidev_send_faxdata(struct capi_pvt *i)
 #ifndef CC_AST_HAS_VERSION_1_4
 	struct ast_frame fr = { AST_FRAME_CONTROL, AST_CONTROL_PROGRESS, };
 #endif
-	unsigned char faxdata[CAPI_MAX_B3_BLOCK_SIZE];
 	size_t len;
+	int sent = 0;
 
 	if (i->NCCI == 0) {
 		cc_verbose(3, 0, VERBOSE_PREFIX_3 "%s: send_faxdata on NCCI = 0.\n",
@@ -5089,19 +5387,25 @@ static void capidev_send_faxdata(struct capi_pvt *i)
 		return;
 	}
 
-	if ((i->fFax) && (!(feof(i->fFax)))) {
-		len = fread(faxdata, 1, CAPI_MAX_B3_BLOCK_SIZE, i->fFax);
-		if (len > 0) {
-			i->send_buffer_handle++;
-			capi_sendf(NULL, 0, CAPI_DATA_B3_REQ, i->NCCI, get_capi_MessageNumber(),
-				"dwww", faxdata, len, i->send_buffer_handle, 0);
-			cc_verbose(5, 1, VERBOSE_PREFIX_3 "%s: send %d fax bytes.\n",
-				i->vname, len);
+	/* keep the whole B3 window filled */
+	while ((i->fFax) && (!(feof(i->fFax))) && (i->B3count < i->b3blocks)) {
+		len = fread(capi_b3_tx_slot(i), 1, i->b3blocksize, i->fFax);
+		if (len == 0)
+			break;
+		capi_b3_tx_commit(i, len);
+		cc_verbose(5, 1, VERBOSE_PREFIX_3 "%s: send %d fax bytes.\n",
+			i->vname, len);
+		sent++;
+	}
+	if (sent) {
 #ifndef CC_AST_HAS_VERSION_1_4
-			local_queue_frame(i, &fr);
+		local_queue_frame(i, &fr);
 #endif
-			return;
-		}
+		return;
+	}
+	if (i->B3count > 0) {
+		/* wait for the outstanding blocks */
+		return;
 	}
 	/* finished send fax, so we hangup */
 	cc_verbose(3, 1, VERBOSE_PREFIX_3 "%s: completed faxsend.\n",
@@ -5395,7 +5699,7 @@ static void capidev_handle_connect_active_indication(_cmsg *CMSG, unsigned int P
  */
 static void capidev_handle_connect_b3_active_indication(_cmsg *CMSG, unsigned int PLCI, unsigned int NCCI, struct capi_pvt *i)
 {
-	capi_sendf(NULL, 0, CAPI_CONNECT_B3_ACTIVE_RESP, NCCI, HEADER_MSGNUM(CMSG), "");
+	capi_send_connect_b3_active_resp(NCCI, HEADER_MSGNUM(CMSG));
 
 	return_on_no_interface("CONNECT_ACTIVE_B3_IND");
 
@@ -5414,8 +5718,6 @@ static void capidev_handle_connect_b3_active_indication(_cmsg *CMSG, unsigned in
 		i->isdnstate &= ~CAPI_ISDN_STATE_RTP;
 	}
 
-	i->B3q = (CAPI_MAX_B3_BLOCK_SIZE * 3);
-
 	if ((i->FaxState & CAPI_FAX_STATE_SENDMODE)) {
 		cc_verbose(3, 1, VERBOSE_PREFIX_3 "%s: Start sending fax.\n",
 			i->vname);
@@ -5472,6 +5774,9 @@ static void capidev_handle_connect_b3_active_indication(_cmsg *CMSG, unsigned in
  */
 static void capidev_handle_disconnect_b3_indication(_cmsg *CMSG, unsigned int PLCI, unsigned int NCCI, struct capi_pvt *i)
 {
+	if (i != NULL) {
+		capi_frame_ring_revoke(i, NCCI);
+	}
 	capi_sendf(NULL, 0, CAPI_DISCONNECT_B3_RESP, NCCI, HEADER_MSGNUM(CMSG), "");
 
 	return_on_no_interface("DISCONNECT_B3_IND");
@@ -5542,15 +5847,14 @@ static void capidev_handle_disconnect_b3_indication(_cmsg *CMSG, unsigned int PL
  */
 static void capidev_handle_connect_b3_indication(_cmsg *CMSG, unsigned int PLCI, unsigned int NCCI, struct capi_pvt *i)
 {
-	capi_sendf(NULL, 0, CAPI_CONNECT_B3_RESP, NCCI, HEADER_MSGNUM(CMSG),
-		"ws",
+	capi_send_connect_b3_resp(NCCI, HEADER_MSGNUM(CMSG),
 		0x0000, /* accept */
 		capi_rtp_ncpi(i));
 
 	return_on_no_interface("CONNECT_B3_IND");
 
 	i->NCCI = NCCI;
-	i->B3count = 0;
+	capi_b3_tx_reset(i);
 
 	if (i->channeltype != CAPI_CHANNELTYPE_NULL) {
 		capi_controllers[i->controller]->nfreebchannels--;
@@ -5575,6 +5879,10 @@ static void capidev_handle_disconnect_indication(_cmsg *CMSG, unsigned int PLCI,
 	if (i != 0)
 		capi_DivaStreamingRemove(i);
 #endif
+	if (i != NULL) {
+		/* libcapi20 has orphaned the buffers of the PLCI on receipt */
+		capi_frame_ring_revoke(i, PLCI);
+	}
 
 	capi_sendf(NULL, 0, CAPI_DISCONNECT_RESP, PLCI, HEADER_MSGNUM(CMSG), "");
 	
@@ -5646,7 +5954,7 @@ static void capidev_handle_disconnect_indication(_cmsg *CMSG, unsigned int PLCI,
 	} else {
 		local_queue_frame(i, &fr);
 		/* PLCI is now removed, make sure it doesn't match with new one */
-		i->PLCI = 0xdead0000;
+		capi_interface_set_plci(i, 0xdead0000);
 	}
 	return;
 }
@@ -5742,7 +6050,7 @@ static void capidev_handle_connect_indication(
 			if (bchannelinfo[0] == '0')
 				continue;
 		}
-		cc_copy_string(buffer, i->incomingmsn, sizeof(buffer));
+		cc_copy_string(buffer, i->conf->incomingmsn, sizeof(buffer));
 		for (msn = strtok_r(buffer, ",", &buffer_rp); msn; msn = strtok_r(NULL, ",", &buffer_rp)) {
 			if (!strlen(DNID)) {
 				/* if no DNID, only accept if '*' was specified */
@@ -5767,22 +6075,22 @@ static void capidev_handle_connect_indication(
 			if (CID != NULL) {
 				if ((callernplan & 0x70) == CAPI_ETSI_NPLAN_NATIONAL)
 					snprintf(i->cid, (sizeof(i->cid)-1), "%s%s%s",
-						i->prefix, capi_national_prefix, CID);
+						i->conf->prefix, capi_national_prefix, CID);
 				else if ((callernplan & 0x70) == CAPI_ETSI_NPLAN_INTERNAT)
 					snprintf(i->cid, (sizeof(i->cid)-1), "%s%s%s",
-						i->prefix, capi_international_prefix, CID);
+						i->conf->prefix, capi_international_prefix, CID);
 				else if ((callernplan & 0x70) == CAPI_ETSI_NPLAN_SUBSCRIBER)
 					snprintf(i->cid, (sizeof(i->cid)-1), "%s%s%s",
-						i->prefix, capi_subscriber_prefix, CID);
+						i->conf->prefix, capi_subscriber_prefix, CID);
 				else
 					snprintf(i->cid, (sizeof(i->cid)-1), "%s%s",
-						i->prefix, CID);
+						i->conf->prefix, CID);
 			} else {
 				cc_copy_string(i->cid, emptyid, sizeof(i->cid));
 			}
 			i->cip = CONNECT_IND_CIPVALUE(CMSG);
-			i->PLCI = PLCI;
-			i->MessageNumber = HEADER_MSGNUM(CMSG);
+			capi_interface_set_msgnum(i, HEADER_MSGNUM(CMSG));
+			capi_interface_set_plci(i, PLCI);
 			i->cid_ton = callernplan;
 
 			i->reserved = 1;
@@ -6107,7 +6415,7 @@ void capidev_handle_connection_conf(struct capi_pvt **i, unsigned int PLCI,
 	*interface_owner = capidev_acquire_locks_from_thread_context(ii);
 
 	if (wInfo == 0) {
-		ii->PLCI = PLCI;
+		capi_interface_set_plci(ii, PLCI);
 	} else {
 		/* error in connect, so set correct state and signal busy */
 		ii->state = CAPI_STATE_DISCONNECTED;
@@ -6173,15 +6481,12 @@ static void capidev_handle_msg(_cmsg *CMSG)
 	struct capi_pvt *i = capi_find_interface_by_plci(PLCI);
 	struct ast_channel* owner;
 
-	if ((wCmd == CAPI_P_IND(DATA_B3)) ||
-	    (wCmd == CAPI_P_CONF(DATA_B3))) {
-		cc_verbose(7, 1, "CAPI: ApplId=0x%04x Command=0x%02x SubCommand=0x%02x MsgNum=0x%04x NCCI=0x%08x\n",
-			CMSG->ApplId, CMSG->Command, CMSG->Subcommand, CMSG->Messagenumber, CMSG->adr.adrNCCI);
-		cc_verbose(7, 1, "%s\n", capi_cmsg2str(CMSG));
-	} else {
-		cc_verbose(4, 1, "CAPI: ApplId=0x%04x Command=0x%02x SubCommand=0x%02x MsgNum=0x%04x NCCI=0x%08x\n",
+	if (cc_verbose_check(capi_msg_verbose_level(CMSG->Command), 1) != 0) {
+		char msgstr[CAPI_MSGSTR_SIZE];
+
+		cc_verbose_internal("CAPI: ApplId=0x%04x Command=0x%02x SubCommand=0x%02x MsgNum=0x%04x NCCI=0x%08x\n",
 			CMSG->ApplId, CMSG->Command, CMSG->Subcommand, CMSG->Messagenumber, CMSG->adr.adrNCCI);
-		cc_verbose(4, 1, "%s\n", capi_cmsg2str(CMSG));
+		cc_verbose_internal("%s\n", capi_cmsg2str_buf(CMSG, msgstr, sizeof(msgstr)));
 	}
 
 	owner = capidev_acquire_locks_from_thread_context (i);
@@ -6296,8 +6601,8 @@ static void capidev_handle_msg(_cmsg *CMSG)
 		break;
 	case CAPI_P_CONF(DATA_B3):
 		wInfo = DATA_B3_CONF_INFO(CMSG);
-		if ((i) && (i->B3count > 0)) {
-			i->B3count--;
+		if (i) {
+			capi_b3_tx_confirm(i, DATA_B3_CONF_DATAHANDLE(CMSG));
 		}
 		if ((i) && (i->FaxState & CAPI_FAX_STATE_SENDMODE)) {
 			capidev_send_faxdata(i);
@@ -8106,7 +8411,7 @@ static int pbx_capi_indicate(struct ast_channel *c, int condition)
 		}
 #ifdef CC_AST_HAS_VERSION_1_4
 		else {
-			ast_moh_start(c, data, i->mohinterpret);
+			ast_moh_start(c, data, i->conf->mohinterpret);
 		}
 #endif
 		break;
@@ -8117,7 +8422,7 @@ static int pbx_capi_indicate(struct ast_channel *c, int condition)
 			if (i->transfergroup) {
 				/* we assume bridge transfer, so wait a little bit to see
 				 * if bridge is activated */
-				i->whentoretrieve = time(NULL) + 1; /* timeout 1 second */
+				capi_interface_set_timeout(i, &i->whentoretrieve, 1000); /* timeout 1 second */
 			} else {
 				pbx_capi_retrieve(c, NULL);
 			}
@@ -8136,7 +8441,7 @@ static int pbx_capi_indicate(struct ast_channel *c, int condition)
 			if (i->transfergroup) {
 				/* we assume bridge transfer, so wait a little bit to see
 				 * if bridge is activated */
-				i->whentoretrieve = time(NULL) + 1; /* timeout 1 second */
+				capi_interface_set_timeout(i, &i->whentoretrieve, 1000); /* timeout 1 second */
 			} else {
 				pbx_capi_retrieve(c, NULL);
 			}
@@ -8251,11 +8556,8 @@ static int pbx_capi_devicestate(void *data)
 	return res;
 }
 
-static void capi_do_interface_task(void)
+static void capi_do_interface_task(struct capi_pvt *interface_for_task, int interface_task)
 {
-	if (interface_for_task == NULL)
-		return;
-
 	switch (interface_task) {
 	case CAPI_INTERFACE_TASK_NULLIFREMOVE:
 		/* remove an old null-plci interface */
@@ -8265,18 +8567,12 @@ static void capi_do_interface_task(void)
 		/* nothing to do */
 		break;
 	}
-
-	interface_for_task = NULL;
-	interface_task = CAPI_INTERFACE_TASK_NONE;
 }
 
-static void capi_do_channel_task(void)
+static void capi_do_channel_task(struct ast_channel *chan_for_task, int channel_task)
 {
 	struct capi_pvt *i;
 
-	if (chan_for_task == NULL)
-		return;
-
 	switch (channel_task) {
 	case CAPI_CHANNEL_TASK_HANGUP:
 		/* deferred (out of lock) hangup */
@@ -8299,9 +8595,9 @@ static void capi_do_channel_task(void)
 		pbx_builtin_setvar_helper(chan_for_task, "FAXEXTEN", ast_channel_exten(chan_for_task));
 		i = CC_CHANNEL_PVT(chan_for_task);
 		if (i) {
-			if (ast_async_goto(chan_for_task, i->faxcontext, i->faxexten, i->faxpriority)) {
+			if (ast_async_goto(chan_for_task, i->conf->faxcontext, i->conf->faxexten, i->conf->faxpriority)) {
 				cc_log(LOG_WARNING, "Failed to async goto '%s,%s,%d' for '%s'\n",
-					i->faxcontext, i->faxexten, i->faxpriority, ast_channel_name(chan_for_task));
+					i->conf->faxcontext, i->conf->faxexten, i->conf->faxpriority, ast_channel_name(chan_for_task));
 			}
 		}
 		break;
@@ -8309,45 +8605,165 @@ static void capi_do_channel_task(void)
 		/* nothing to do */
 		break;
 	}
-	chan_for_task = NULL;
-	channel_task = CAPI_CHANNEL_TASK_NONE;
 }
 
 /*
- * check for tasks every second
+ * run all queued tasks of a list
  */
-static void capidev_run_secondly(time_t now)
+static void capi_do_tasks(struct capi_task_list *list)
 {
-	struct capi_pvt *i;
+	struct capi_task *t, *fifo = NULL;
 
-	/* check for channels to hangup (timeout) */
-	cc_mutex_lock(&iflock);
-	for (i = capi_iflist; i; i = i->next) {
-		if (i->used == NULL) {
-			continue;
-		}
-		if ((i->whentohangup) && (i->whentohangup < now)) {
-			cc_verbose(3, 1, VERBOSE_PREFIX_2 "%s: stay-online timeout, hanging up.\n",
-				i->vname);
-			i->whentohangup = 0;
-			capi_disconnect(i);
+	if (list->head == NULL)
+		return;
+
+	t = __sync_lock_test_and_set(&list->head, NULL);
+
+	/* restore the order the tasks were queued */
+	while (t) {
+		struct capi_task *next = t->next;
+
+		t->next = fifo;
+		fifo = t;
+		t = next;
+	}
+
+	t = fifo;
+	while (t) {
+		struct capi_task *next = t->next;
+
+		if (t->c != NULL) {
+			capi_do_channel_task(t->c, t->task);
+		} else if (t->i != NULL) {
+			capi_do_interface_task(t->i, t->task);
 		}
-		if ((i->whentoqueuehangup) && (i->whentoqueuehangup < now)) {
-			cc_verbose(3, 1, VERBOSE_PREFIX_2 "%s: stay-online queue-hangup.\n",
-				i->vname);
-			capi_queue_cause_control(i, 1);
-			i->whentoqueuehangup = 0;
+		capi_task_release(t);
+		__sync_sub_and_fetch(&capi_task_depth, 1);
+		t = next;
+	}
+}
+
+
+/*
+ * dispatch worker, handles the messages of its controllers
+ */
+static void *capidev_dispatch_worker(void *data)
+{
+	struct capi_dispatch_worker *w = data;
+	struct capi_rawmsg *raw;
+	_cmsg CMSG;
+
+	capi_thread_tasks = &w->tasks;
+
+	cc_mutex_lock(&w->lock);
+	while (!w->stop) {
+		if (w->first == NULL) {
+			ast_cond_wait(&w->event, &w->lock);
+			continue;
 		}
-		if ((i->whentoretrieve) && (i->whentoretrieve < now)) {
-			cc_verbose(3, 1, VERBOSE_PREFIX_2 "%s: deferred retrieve.\n",
-				i->vname);
-			i->whentoretrieve = 0;
-			if (i->owner) {
-				pbx_capi_retrieve(i->owner, NULL);
+
+		/* handle all queued messages and send the answers at once */
+		capi_put_batch_begin();
+		while ((raw = w->first) != NULL) {
+			w->first = raw->next;
+			if (w->first == NULL) {
+				w->last = NULL;
 			}
+			cc_mutex_unlock(&w->lock);
+
+			capidev_message2cmsg(&CMSG, raw->msg);
+			capidev_handle_msg(&CMSG);
+			capi_do_tasks(&w->tasks);
+			ast_free(raw);
+
+			cc_mutex_lock(&w->lock);
 		}
+		cc_mutex_unlock(&w->lock);
+		capi_put_batch_end();
+		cc_mutex_lock(&w->lock);
 	}
-	cc_mutex_unlock(&iflock);
+
+	/* drop messages not handled anymore */
+	while ((raw = w->first) != NULL) {
+		w->first = raw->next;
+		ast_free(raw);
+	}
+	w->last = NULL;
+	cc_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/*
+ * hand a message to the worker of its controller
+ */
+static void capidev_dispatch_msg(struct capi_rawmsg *raw)
+{
+	struct capi_dispatch_worker *w;
+	unsigned int controller = raw->msg[8] & 0x7f;
+
+	w = &capi_dispatch_workers[controller % capi_dispatch_running];
+
+	cc_mutex_lock(&w->lock);
+	if (w->last) {
+		w->last->next = raw;
+	} else {
+		w->first = raw;
+	}
+	w->last = raw;
+	ast_cond_signal(&w->event);
+	cc_mutex_unlock(&w->lock);
+}
+
+/*
+ * start the dispatch workers
+ */
+static int capidev_start_dispatch_workers(void)
+{
+	struct capi_dispatch_worker *w;
+	int n;
+
+	for (n = 0; n < capi_dispatch_nworkers; n++) {
+		w = &capi_dispatch_workers[n];
+		memset(w, 0, sizeof(*w));
+		cc_mutex_init(&w->lock);
+		ast_cond_init(&w->event, NULL);
+		if (ast_pthread_create(&w->thread, NULL, capidev_dispatch_worker, w) < 0) {
+			cc_log(LOG_ERROR, "Unable to start CAPI dispatch worker %d!\n", n);
+			ast_cond_destroy(&w->event);
+			cc_mutex_destroy(&w->lock);
+			return -1;
+		}
+		capi_dispatch_running = n + 1;
+	}
+
+	if (capi_dispatch_running) {
+		cc_verbose(2, 0, VERBOSE_PREFIX_2 "Started %d CAPI dispatch workers.\n",
+			capi_dispatch_running);
+	}
+	return 0;
+}
+
+/*
+ * stop the dispatch workers
+ */
+static void capidev_stop_dispatch_workers(void)
+{
+	struct capi_dispatch_worker *w;
+	int n;
+
+	for (n = 0; n < capi_dispatch_running; n++) {
+		w = &capi_dispatch_workers[n];
+		cc_mutex_lock(&w->lock);
+		w->stop = 1;
+		ast_cond_signal(&w->event);
+		cc_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		capi_do_tasks(&w->tasks);
+		ast_cond_destroy(&w->event);
+		cc_mutex_destroy(&w->lock);
+	}
+	capi_dispatch_running = 0;
 }
 
 /*
@@ -8356,18 +8772,40 @@ static void capidev_run_secondly(time_t now)
 static void *capidev_loop(void *data)
 {
 	unsigned int Info;
+	unsigned int count;
 	_cmsg monCMSG;
+	struct capi_rawmsg *raw;
+#ifdef DIVA_STATUS
 	time_t lastcall = 0;
 	time_t newtime;
+#endif
 	
 	cc_log(LOG_NOTICE, "Started CAPI device thread for CAPI Appl-ID %d.\n", capi_ApplID);
 
 	for (/* for ever */;;) {
-		switch(Info = capidev_check_wait_get_cmsg(&monCMSG)) {
+		if (capi_dispatch_running) {
+			Info = capidev_check_wait_get_rawmsg(&raw);
+			if (Info == 0x0000) {
+				capidev_dispatch_msg(raw);
+			}
+		} else {
+			Info = capidev_check_wait_get_cmsg(&monCMSG);
+		}
+		switch(Info) {
 		case 0x0000:
-			capidev_handle_msg(&monCMSG);
-			capi_do_channel_task();
-			capi_do_interface_task();
+			if (capi_dispatch_running) {
+				/* handled by the worker */
+				break;
+			}
+			/* handle all queued messages and send the answers at once */
+			capi_put_batch_begin();
+			count = 0;
+			do {
+				capidev_handle_msg(&monCMSG);
+				capi_do_tasks(&capi_main_tasks);
+			} while ((++count < CAPI_MAX_MSG_BATCH) &&
+				 (capidev_check_get_cmsg(&monCMSG) == 0x0000));
+			capi_put_batch_end();
 			break;
 		case 0x1104:
 			/* CAPI queue is empty */
@@ -8383,14 +8821,15 @@ static void *capidev_loop(void *data)
 			/* something is wrong! */
 			break;
 		} /* switch */
+		capi_do_tasks(&capi_main_tasks);
+		capi_timer_run();
+#ifdef DIVA_STATUS
 		newtime = time(NULL);
 		if (lastcall != newtime) {
 			lastcall = newtime;
-			capidev_run_secondly(newtime);
-#ifdef DIVA_STATUS
 			diva_status_process_events();
-#endif
 		}
+#endif
 #ifdef DIVA_STREAMING
 		divaStreamingWakeup ();
 #endif
@@ -8401,49 +8840,51 @@ static void *capidev_loop(void *data)
 }
 
 /*
- * GAIN
+ * energy of a line byte, as used by the echo suppressor
  */
-void capi_gains(struct cc_capi_gains *g, float rxgain, float txgain)
+unsigned short capi_line_magnitude[256];
+
+/*
+ * GAIN of a line byte
+ */
+static unsigned char capi_gain_line_byte(int c, float gain)
 {
-	int i = 0;
-	int x = 0;
-	
-	if (rxgain != 1.0) {
-		for (i = 0; i < 256; i++) {
-			if (capi_capability == CC_FORMAT_ULAW) {
-				x = (int)(((float)capiULAW2INT[i]) * rxgain);
-			} else {
-				x = (int)(((float)capiALAW2INT[i]) * rxgain);
-			}
-			if (x > 32767)
-				x = 32767;
-			if (x < -32767)
-				x = -32767;
-			if (capi_capability == CC_FORMAT_ULAW) {
-				g->rxgains[i] = capi_int2ulaw(x);
-			} else {
-				g->rxgains[i] = capi_int2alaw(x);
-			}
-		}
+	int x;
+
+	if (capi_capability == CC_FORMAT_ULAW) {
+		x = (int)(((float)capiULAW2INT[c]) * gain);
+	} else {
+		x = (int)(((float)capiALAW2INT[c]) * gain);
 	}
-	
-	if (txgain != 1.0) {
-		for (i = 0; i < 256; i++) {
-			if (capi_capability == CC_FORMAT_ULAW) {
-				x = (int)(((float)capiULAW2INT[i]) * txgain);
-			} else {
-				x = (int)(((float)capiALAW2INT[i]) * txgain);
-			}
-			if (x > 32767)
-				x = 32767;
-			if (x < -32767)
-				x = -32767;
-			if (capi_capability == CC_FORMAT_ULAW) {
-				g->txgains[i] = capi_int2ulaw(x);
-			} else {
-				g->txgains[i] = capi_int2alaw(x);
-			}
+	if (x > 32767)
+		x = 32767;
+	if (x < -32767)
+		x = -32767;
+	if (capi_capability == CC_FORMAT_ULAW) {
+		return capi_int2ulaw(x);
+	}
+	return capi_int2alaw(x);
+}
+
+/*
+ * build the composed bit reversal and gain tables of a channel,
+ * so each voice byte needs one lookup only. Must be called
+ * again if the law changes.
+ */
+void capi_gains(struct cc_capi_gains *g, float rxgain, float txgain)
+{
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		if (capi_capability == CC_FORMAT_ULAW) {
+			capi_line_magnitude[c] = abs(capiULAW2INT[c]);
+		} else {
+			capi_line_magnitude[c] = abs(capiALAW2INT[c]);
 		}
+		g->rx_xform[c] = (rxgain != 1.0) ?
+			capi_reversebits[capi_gain_line_byte(c, rxgain)] : capi_reversebits[c];
+		g->tx_xform[c] = (txgain != 1.0) ?
+			capi_gain_line_byte(capi_reversebits[c], txgain) : capi_reversebits[c];
 	}
 }
 
@@ -8453,16 +8894,37 @@ void capi_gains(struct cc_capi_gains *g, float rxgain, float txgain)
 int mkif(struct cc_capi_conf *conf)
 {
 	struct capi_pvt *tmp;
+	struct cc_capi_ifconf *ifconf;
 	int i = 0;
 	u_int16_t unit;
 	struct cc_capi_controller *mwiController = 0;
 
+	ifconf = ast_malloc(sizeof(struct cc_capi_ifconf));
+	if (!ifconf) {
+		return -1;
+	}
+	memset(ifconf, 0, sizeof(struct cc_capi_ifconf));
+	cc_copy_string(ifconf->context, conf->context, sizeof(ifconf->context));
+	cc_copy_string(ifconf->incomingmsn, conf->incomingmsn, sizeof(ifconf->incomingmsn));
+	cc_copy_string(ifconf->defaultcid, conf->defaultcid, sizeof(ifconf->defaultcid));
+	cc_copy_string(ifconf->prefix, conf->prefix, sizeof(ifconf->prefix));
+	cc_copy_string(ifconf->accountcode, conf->accountcode, sizeof(ifconf->accountcode));
+	cc_copy_string(ifconf->language, conf->language, sizeof(ifconf->language));
+#ifdef CC_AST_HAS_VERSION_1_4
+	cc_copy_string(ifconf->mohinterpret, conf->mohinterpret, sizeof(ifconf->mohinterpret));
+	memcpy(&ifconf->jbconf, &conf->jbconf, sizeof(struct ast_jb_conf));
+#endif
+	cc_copy_string(ifconf->faxcontext, conf->faxcontext, sizeof(ifconf->faxcontext));
+	cc_copy_string(ifconf->faxexten, conf->faxexten, sizeof(ifconf->faxexten));
+	ifconf->faxpriority = conf->faxpriority;
+
 	for (i = 0; i <= conf->devices; i++) {
-		tmp = ast_malloc(sizeof(struct capi_pvt));
+		tmp = capi_pvt_alloc();
 		if (!tmp) {
+			if (ifconf->refs == 0)
+				ast_free(ifconf);
 			return -1;
 		}
-		memset(tmp, 0, sizeof(struct capi_pvt));
 	
 		tmp->readerfd = -1;
 		tmp->writerfd = -1;
@@ -8478,16 +8940,6 @@ int mkif(struct cc_capi_conf *conf)
 			tmp->channeltype = CAPI_CHANNELTYPE_B;
 		}
 		snprintf(tmp->vname, sizeof(tmp->vname) - 1, "%s#%02d", conf->name, i);
-		cc_copy_string(tmp->context, conf->context, sizeof(tmp->context));
-		cc_copy_string(tmp->incomingmsn, conf->incomingmsn, sizeof(tmp->incomingmsn));
-		cc_copy_string(tmp->defaultcid, conf->defaultcid, sizeof(tmp->defaultcid));
-		cc_copy_string(tmp->prefix, conf->prefix, sizeof(tmp->prefix));
-		cc_copy_string(tmp->accountcode, conf->accountcode, sizeof(tmp->accountcode));
-		cc_copy_string(tmp->language, conf->language, sizeof(tmp->language));
-#ifdef CC_AST_HAS_VERSION_1_4
-		cc_copy_string(tmp->mohinterpret, conf->mohinterpret, sizeof(tmp->mohinterpret));
-		memcpy(&tmp->jbconf, &conf->jbconf, sizeof(struct ast_jb_conf));
-#endif
 
 		unit = atoi(conf->controllerstr);
 			/* There is no reason not to
@@ -8510,7 +8962,9 @@ int mkif(struct cc_capi_conf *conf)
 
 		if ((unit > capi_num_controllers) ||
 		    (!(capi_controllers[unit]))) {
-			ast_free(tmp);
+			capi_pvt_free(tmp);
+			if (ifconf->refs == 0)
+				ast_free(ifconf);
 			cc_verbose(2, 0, VERBOSE_PREFIX_3 "controller %d invalid, ignoring interface.\n",
 				unit);
 			return 0;
@@ -8521,6 +8975,10 @@ int mkif(struct cc_capi_conf *conf)
 		capi_controllers[unit]->ecOnTransit = conf->econtransitconn;
 		capi_controllers[unit]->nfreebchannelsHardThr = conf->hlimit;
 		capi_controllers[unit]->nfreebchannelsSoftThr = conf->slimit;
+		if (conf->b3blocks > capi_controllers[unit]->b3blocks)
+			capi_controllers[unit]->b3blocks = conf->b3blocks;
+		if (conf->b3blocksize > capi_controllers[unit]->b3blocksize)
+			capi_controllers[unit]->b3blocksize = conf->b3blocksize;
 		mwiController = capi_controllers[unit];
 
 		tmp->controller = unit;
@@ -8543,11 +9001,9 @@ int mkif(struct cc_capi_conf *conf)
 		tmp->bridge = conf->bridge;
 		tmp->FaxState = conf->faxsetting;
 		tmp->faxdetecttime = conf->faxdetecttime;
-		cc_copy_string(tmp->faxcontext, conf->faxcontext, sizeof(tmp->faxcontext));
-		cc_copy_string(tmp->faxexten, conf->faxexten, sizeof(tmp->faxexten));
-		tmp->faxpriority = conf->faxpriority;
-		
-		tmp->smoother = ast_smoother_new(CAPI_MAX_B3_BLOCK_SIZE);
+
+		tmp->b3blocks = conf->b3blocks;
+		tmp->b3blocksize = conf->b3blocksize;
 
 		tmp->rxgain = conf->rxgain;
 		tmp->txgain = conf->txgain;
@@ -8559,13 +9015,16 @@ int mkif(struct cc_capi_conf *conf)
 		/* Initialize QSIG code */
 		cc_qsig_interface_init(conf, tmp);
 		tmp->divaqsig = conf->divaqsig;
+
+		tmp->conf = ifconf;
+		ifconf->refs++;
 		
 		tmp->next = capi_iflist; /* prepend */
 		capi_iflist = tmp;
 		cc_verbose(2, 0, VERBOSE_PREFIX_3 CC_MESSAGE_NAME
 			" %c %s (%s:%s) contr=%d devs=%d EC=%d,opt=%d,tail=%d\n",
 			(tmp->channeltype == CAPI_CHANNELTYPE_B)? 'B' : 'D',
-			tmp->vname, tmp->incomingmsn, tmp->context, tmp->controller,
+			tmp->vname, ifconf->incomingmsn, ifconf->context, tmp->controller,
 			conf->devices, tmp->doEC, tmp->ecOption, tmp->ecTail);
 	}
 
@@ -8709,19 +9168,19 @@ struct ast_channel_tech capi_tech = {
 /*
  * register at CAPI interface
  */
-static int cc_register_capi(unsigned blocksize, unsigned connections)
+static int cc_register_capi(unsigned blocksize, unsigned blocks, unsigned connections)
 {
 	u_int16_t error = 0;
 	unsigned capi_ApplID_old = capi_ApplID;
 
 	cc_verbose(3, 0, VERBOSE_PREFIX_3 "Registering at CAPI "
-		   "(blocksize=%d maxlogicalchannels=%d)\n", blocksize, connections);
+		   "(blocksize=%d blocks=%d maxlogicalchannels=%d)\n", blocksize, blocks, connections);
 
 #if (CAPI_OS_HINT == 2)
-	error = capi20_register(connections, CAPI_MAX_B3_BLOCKS, 
+	error = capi20_register(connections, blocks, 
 				blocksize, &capi_ApplID, CAPI_STACK_VERSION);
 #else
-	error = capi20_register(connections, CAPI_MAX_B3_BLOCKS, 
+	error = capi20_register(connections, blocks, 
 				blocksize, &capi_ApplID);
 #endif
 	if (capi_ApplID_old != CAPI_APPLID_UNUSED) {
@@ -8755,7 +9214,7 @@ static int cc_init_capi(void)
 		return -1;
 	}
 
-	if (cc_register_capi(CAPI_MAX_B3_BLOCK_SIZE, 2))
+	if (cc_register_capi(CAPI_MAX_B3_BLOCK_SIZE, CAPI_MAX_B3_BLOCKS, 2))
 		return -1;
 
 #if (CAPI_OS_HINT == 1)
@@ -8889,6 +9348,9 @@ static int cc_post_init_capi(void)
 	unsigned error;
 	int rtp_ext_size = 0;
 	unsigned needchannels = 0;
+#ifdef DIVA_STREAMING
+	unsigned streamchannels = 0;
+#endif
 
 	for (i = capi_iflist; i && !rtp_ext_size; i = i->next) {
 		/* if at least one line wants RTP, we need to re-register with
@@ -8902,11 +9364,43 @@ static int cc_post_init_capi(void)
 		if ((capi_controllers[controller] != NULL) &&
 		    (capi_controllers[controller]->used)) {
 			needchannels += (capi_controllers[controller]->nbchannels + 1);
+#ifdef DIVA_STREAMING
+			if (capi_controllers[controller]->divaStreaming)
+				streamchannels += capi_controllers[controller]->nbchannels;
+#endif
+		}
+	}
+
+	/* the application window and block size must fit all interfaces,
+	   null-interfaces use the defaults of the general section */
+	capi_b3_window = capi_default_b3blocks;
+	capi_b3_maxblocksize = capi_default_b3blocksize;
+	for (controller = 1; controller <= capi_num_controllers; controller++) {
+		if ((capi_controllers[controller] != NULL) &&
+		    (capi_controllers[controller]->b3blocks == 0)) {
+			capi_controllers[controller]->b3blocks = capi_default_b3blocks;
+			capi_controllers[controller]->b3blocksize = capi_default_b3blocksize;
 		}
 	}
-	if (cc_register_capi(CAPI_MAX_B3_BLOCK_SIZE + rtp_ext_size, needchannels))
+	for (i = capi_iflist; i; i = i->next) {
+		if (i->b3blocks > capi_b3_window)
+			capi_b3_window = i->b3blocks;
+		if (i->b3blocksize > capi_b3_maxblocksize)
+			capi_b3_maxblocksize = i->b3blocksize;
+	}
+	capi_b3_regblocksize = capi_b3_maxblocksize + rtp_ext_size;
+	if (cc_register_capi(capi_b3_regblocksize, capi_b3_window, needchannels))
 		return -1;
 
+	for (i = capi_iflist; i; i = i->next) {
+		if (capi_alloc_b3_buffers(i) != 0)
+			return -1;
+	}
+	capi_nullif_pool_init(capi_nullif_pool_size);
+#ifdef DIVA_STREAMING
+	capi_DivaStreamingPrewarm(streamchannels);
+#endif
+
 	for (controller = 1; controller <= capi_num_controllers; controller++) {
 		if (capi_controllers[controller]->used) {
 			if ((error = capi_ListenOnController(ALL_SERVICES, controller)) != 0) {
@@ -8988,7 +9482,7 @@ static int conf_interface(struct cc_capi_conf *conf, struct ast_variable *v)
 	} else
 #define CONF_INTEGER_SAFE(var, token, lower, upper) \
 	if (!strcasecmp(v->name, token)) { \
-		typeof((var)) vi = (typeof((var)))atoi(v->value); if (var <= upper && var >= lower) var = vi; \
+		typeof((var)) vi = (typeof((var)))atoi(v->value); if (vi <= upper && vi >= lower) var = vi; \
 		continue;                  \
 	} else
 #define CONF_TRUE(var, token, val)         \
@@ -9108,6 +9602,8 @@ static int conf_interface(struct cc_capi_conf *conf, struct ast_variable *v)
 				conf->faxsetting &= ~(CAPI_FAX_DETECT_OUTGOING | CAPI_FAX_DETECT_INCOMING);
 		} else
 		CONF_INTEGER(conf->faxdetecttime, "faxdetecttime")
+		CONF_INTEGER_SAFE(conf->b3blocks, "b3blocks", CAPI_MIN_B3_BLOCKS, CAPI_MAX_B3_BLOCKS)
+		CONF_INTEGER_SAFE(conf->b3blocksize, "b3blocksize", CAPI_MIN_B3_BLOCK_SIZE, CAPI_B3_BLOCK_SIZE_LIMIT)
 		if (!strcasecmp(v->name, "echocancel")) {
 			if (ast_true(v->value)) {
 				conf->echocancel = 1;
@@ -9221,6 +9717,15 @@ static int capi_eval_config(struct ast_config *cfg)
 	float rxgain = 1.0;
 	float txgain = 1.0;
 
+	capi_dispatch_nworkers = 0;
+	capi_rx_zerocopy = 0;
+	capi_default_b3blocks = CAPI_MAX_B3_BLOCKS;
+	capi_default_b3blocksize = CAPI_MAX_B3_BLOCK_SIZE;
+	capi_nullif_pool_size = 0;
+#ifdef DIVA_STREAMING
+	capi_DivaStreamingSetFlushDelay(0);
+#endif
+
 	/* prefix defaults */
 	cc_copy_string(capi_national_prefix, CAPI_NATIONAL_PREF, sizeof(capi_national_prefix));
 	cc_copy_string(capi_international_prefix, CAPI_INTERNAT_PREF, sizeof(capi_international_prefix));
@@ -9262,11 +9767,49 @@ static int capi_eval_config(struct ast_config *cfg)
 			if (ast_true(v->value)) {
 				capi_capability = CC_FORMAT_ULAW;
 			}
+		} else if (!strcasecmp(v->name, "dispatchthreads")) {
+			if ((sscanf(v->value, "%d", &capi_dispatch_nworkers) != 1) ||
+			    (capi_dispatch_nworkers < 0) ||
+			    (capi_dispatch_nworkers > CAPI_MAX_DISPATCH_WORKERS)) {
+				cc_log(LOG_ERROR, "invalid dispatchthreads, using single CAPI thread\n");
+				capi_dispatch_nworkers = 0;
+			}
+		} else if (!strcasecmp(v->name, "rxzerocopy")) {
+			capi_rx_zerocopy = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "nullplcipool")) {
+			if ((sscanf(v->value, "%d", &capi_nullif_pool_size) != 1) ||
+			    (capi_nullif_pool_size < 0) ||
+			    (capi_nullif_pool_size > CAPI_MAX_NULLIF_POOL)) {
+				cc_log(LOG_ERROR, "invalid nullplcipool, pool disabled\n");
+				capi_nullif_pool_size = 0;
+			}
+		} else if (!strcasecmp(v->name, "b3blocks")) {
+			if ((sscanf(v->value, "%d", &capi_default_b3blocks) != 1) ||
+			    (capi_default_b3blocks < CAPI_MIN_B3_BLOCKS) ||
+			    (capi_default_b3blocks > CAPI_MAX_B3_BLOCKS)) {
+				cc_log(LOG_ERROR, "invalid b3blocks, using %d\n", CAPI_MAX_B3_BLOCKS);
+				capi_default_b3blocks = CAPI_MAX_B3_BLOCKS;
+			}
+		} else if (!strcasecmp(v->name, "b3blocksize")) {
+			if ((sscanf(v->value, "%d", &capi_default_b3blocksize) != 1) ||
+			    (capi_default_b3blocksize < CAPI_MIN_B3_BLOCK_SIZE) ||
+			    (capi_default_b3blocksize > CAPI_B3_BLOCK_SIZE_LIMIT)) {
+				cc_log(LOG_ERROR, "invalid b3blocksize, using %d\n", CAPI_MAX_B3_BLOCK_SIZE);
+				capi_default_b3blocksize = CAPI_MAX_B3_BLOCK_SIZE;
+			}
 #ifdef DIVA_STREAMING
 		} else if (!strcasecmp(v->name, "nodivastreaming")) {
 			if (ast_true(v->value)) {
 				capi_DivaStreamingDisable ();
 			}
+		} else if (!strcasecmp(v->name, "divastreamflush")) {
+			int delay;
+			if ((sscanf(v->value, "%d", &delay) != 1) ||
+			    (delay < 0) || (delay > CAPI_MAX_DIVA_FLUSH_DELAY)) {
+				cc_log(LOG_ERROR, "invalid divastreamflush, flushing every write\n");
+				delay = 0;
+			}
+			capi_DivaStreamingSetFlushDelay(delay);
 #endif
 		}
 	}
@@ -9291,6 +9834,8 @@ static int capi_eval_config(struct ast_config *cfg)
 		conf.ectail = EC_DEFAULT_TAIL;
 		conf.ecSelector = FACILITYSELECTOR_ECHO_CANCEL;
 		conf.echocancelpath = EC_ECHOCANCEL_PATH_IFC;
+		conf.b3blocks = capi_default_b3blocks;
+		conf.b3blocksize = capi_default_b3blocksize;
 		cc_copy_string(conf.name, cat, sizeof(conf.name));
 		cc_copy_string(conf.language, default_language, sizeof(conf.language));
 #ifdef CC_AST_HAS_VERSION_1_4
@@ -9343,6 +9888,11 @@ int unload_module(void)
 		capi_device_thread = (pthread_t)(0-1);
 	}
 
+	capidev_stop_dispatch_workers();
+	capidev_wakeup_cleanup();
+	capi_do_tasks(&capi_main_tasks);
+	capi_nullif_pool_cleanup();
+
 	cc_mutex_lock(&iflock);
 
 	if (capi_ApplID != CAPI_APPLID_UNUSED) {
@@ -9365,18 +9915,18 @@ int unload_module(void)
 	while (i) {
 		if ((i->owner) || (i->used))
 			cc_log(LOG_WARNING, "On unload, interface still has owner or is used.\n");
-		if (i->smoother) {
-			ast_smoother_free(i->smoother);
-			i->smoother = 0;
-		}
+		capi_timer_stop(&i->timer);
+		capi_free_b3_buffers(i);
+		capi_ifconf_unref(i->conf);
 		
 		pbx_capi_qsig_unload_module(i);
+		capi_interface_index_remove(i);
 		
 		cc_mutex_destroy(&i->lock);
 		ast_cond_destroy(&i->event_trigger);
 		itmp = i;
 		i = i->next;
-		ast_free(itmp);
+		capi_pvt_free(itmp);
 	}
 	capi_iflist = NULL;
 
@@ -9515,9 +10065,20 @@ int load_module(void)
 	pbx_capi_ami_register(myself);
 	pbx_capi_register_device_state_providers();
 	pbx_capi_chat_init_module();
+	capi_timer_init_module();
 	
 	ast_register_application(commandapp, pbx_capicommand_exec, commandsynopsis, commandtdesc);
 
+	if (capidev_start_dispatch_workers() != 0) {
+		unload_module();
+		return -1;
+	}
+
+	if (capidev_wakeup_init() != 0) {
+		unload_module();
+		return -1;
+	}
+
 	if (ast_pthread_create(&capi_device_thread, NULL, capidev_loop, NULL) < 0) {
 		capi_device_thread = (pthread_t)(0-1);
 		cc_log(LOG_ERROR, "Unable to start CAPI device thread!\n");
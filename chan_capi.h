@@ -49,6 +49,7 @@
 #include "asterisk/musiconhold.h"
 #include "dlist.h"
 #include "chan_capi_fmt.h"
+#include "chan_capi_msg.h"
  
 #ifndef _PBX_CAPI_H
 #define _PBX_CAPI_H
@@ -57,15 +58,33 @@
 struct _diva_stream_scheduling_entry;
 #endif
 struct _pbx_capi_conference_bridge;
+struct capi_frame_ring;
 
 #define CAPI_MAX_CONTROLLERS             64
+/* max. B3 window allowed by CAPI, the window is set with 'b3blocks' */
 #define CAPI_MAX_B3_BLOCKS                7
+#define CAPI_MIN_B3_BLOCKS                2
 
 /* was : 130 bytes Alaw = 16.25 ms audio not suitable for VoIP */
 /* now : 160 bytes Alaw = 20 ms audio */
 /* now : 640 bytes slinear 16000Hz = 20 ms audio */
-/* you can tune this to your need. higher value == more latency */
+/* default, set with 'b3blocksize'. higher value == more latency */
 #define CAPI_MAX_B3_BLOCK_SIZE          160
+#define CAPI_MIN_B3_BLOCK_SIZE           80
+#define CAPI_B3_BLOCK_SIZE_LIMIT       2048
+
+/* B3 blocks queued per NCCI while the window is full, the oldest is dropped */
+#define CAPI_B3_TX_QUEUE                  3
+#define CAPI_B3_TX_SLOTS                (CAPI_MAX_B3_BLOCKS + CAPI_B3_TX_QUEUE + 1)
+
+/* max. delay in ms of the coalesced Diva stream flush */
+#define CAPI_MAX_DIVA_FLUSH_DELAY        20
+
+/* max. number of free null-interfaces kept per controller */
+#define CAPI_MAX_NULLIF_POOL             64
+
+/* max. number of queued CAPI messages handled in one pass of the device thread */
+#define CAPI_MAX_MSG_BATCH               16
 
 #define ALL_SERVICES             0x1FFF03FF
 
@@ -84,35 +103,6 @@ typedef format_t cc_format_t;
 typedef int cc_format_t;
 #endif
 
-/* some helper functions */
-static inline void write_capi_word(void *m, unsigned short val)
-{
-	((unsigned char *)m)[0] = val & 0xff;
-	((unsigned char *)m)[1] = (val >> 8) & 0xff;
-}
-static inline unsigned short read_capi_word(const void *m)
-{
-	unsigned short val;
-
-	val = ((const unsigned char *)m)[0] | (((const unsigned char *)m)[1] << 8);	
-	return (val);
-}
-static inline void write_capi_dword(void *m, unsigned int val)
-{
-	((unsigned char *)m)[0] = val & 0xff;
-	((unsigned char *)m)[1] = (val >> 8) & 0xff;
-	((unsigned char *)m)[2] = (val >> 16) & 0xff;
-	((unsigned char *)m)[3] = (val >> 24) & 0xff;
-}
-static inline unsigned int read_capi_dword(const void *m)
-{
-	unsigned int val;
-
-	val = ((const unsigned char *)m)[0] | (((const unsigned char *)m)[1] << 8) |	
-	      (((const unsigned char *)m)[2] << 16) | (((const unsigned char *)m)[3] << 24);	
-	return (val);
-}
-
 /*
  * global name for messages and commands
  */
@@ -126,6 +116,7 @@ static inline unsigned int read_capi_dword(const void *m)
 #define cc_mutex_init             ast_mutex_init
 #define cc_mutex_lock(x)          ast_mutex_lock(x)
 #define cc_mutex_unlock(x)        ast_mutex_unlock(x)
+#define cc_mutex_trylock(x)       ast_mutex_trylock(x)
 #define cc_mutex_destroy(x)       ast_mutex_destroy(x)
 #define cc_log(x...)              ast_log(x)
 #define cc_pbx_verbose(x...)      ast_verbose(x)
@@ -136,6 +127,17 @@ static inline unsigned int read_capi_dword(const void *m)
 	static cc_mutex_t mutex = AST_MUTEX_INITIALIZER
 #endif
 
+/*
+ * timer of the timer wheel run by the CAPI device thread
+ */
+struct capi_timer {
+	struct capi_timer *next;
+	struct capi_timer **pprev;   /* NULL if not armed */
+	unsigned long long expires;  /* monotonic time in ms */
+	void (*func)(void *data);
+	void *data;
+};
+
 /*
  * definitions for nice compatibility
  */
@@ -297,6 +299,7 @@ typedef struct fax3proto3 B3_PROTO_FAXG3;
 #define CAPI_B3_ON_SUCCESS              2
 
 #define CAPI_MAX_STRING              2048
+#define CAPI_MAX_NAME                 128
 
 #define CAPI_FAX_DETECT_INCOMING      0x00000001
 #define CAPI_FAX_DETECT_OUTGOING      0x00000002
@@ -307,9 +310,14 @@ typedef struct fax3proto3 B3_PROTO_FAXG3;
 #define CAPI_FAX_STATE_CONN           0x00100000
 #define CAPI_FAX_STATE_MASK           0xffff0000
 
+/*
+ * voice byte transforms including bit reversal and gain,
+ * rx is indexed by the byte received from the line,
+ * tx by the byte going to the line.
+ */
 struct cc_capi_gains {
-	unsigned char txgains[256];
-	unsigned char rxgains[256];
+	unsigned char tx_xform[256];
+	unsigned char rx_xform[256];
 };
 
 #define CAPI_ISDN_STATE_SETUP         0x00000001
@@ -383,25 +391,143 @@ struct cc_qsig_data {
 };
 
 /* ! Private data for a capi device */
+/*
+ * configuration of an interface section, shared by all its channels
+ */
+struct cc_capi_ifconf {
+	int refs;
+
+	char context[AST_MAX_EXTENSION];
+	/*! Multiple Subscriber Number we listen to (, seperated list) */
+	char incomingmsn[CAPI_MAX_STRING];	
+	/*! Prefix to Build CID */
+	char prefix[AST_MAX_EXTENSION];	
+	/* the default caller id */
+	char defaultcid[CAPI_MAX_STRING];
+
+	char accountcode[20];	
+
+	/* language */
+	char language[MAX_LANGUAGE];	
+
+	/* custom fax context,exten,prio */
+	char faxcontext[AST_MAX_EXTENSION+1];
+	char faxexten[AST_MAX_EXTENSION+1];
+	int faxpriority;
+
+#ifdef CC_AST_HAS_VERSION_1_4
+	struct ast_jb_conf jbconf;
+	char mohinterpret[MAX_MUSICCLASS];
+#endif
+};
+
+/* interfaces start on a cache line, allocate them with capi_pvt_alloc() */
+#define CAPI_CACHE_LINE 64
+
 struct capi_pvt {
+	/* fields of the data path first, they share the first cache lines,
+	   capi_nullif_reset() clears all but lock and event_trigger */
 	cc_mutex_t lock;
 
+	unsigned int NCCI;
+	unsigned int PLCI;
+	/* current state */
+	int state;
+	/* the state of the line */
+	unsigned int isdnstate;
+	/* which b-protocol is active */
+	int bproto;
+	/* on which controller we do live */
+	int controller;
+
+	/* DATA_B3_REQ waiting for DATA_B3_CONF, used credits of the window */
+	int B3count;
+	/* B3 window and block size of this interface */
+	unsigned short b3blocks;
+	unsigned short b3blocksize;
+	unsigned short send_buffer_handle;
+	unsigned short transfercapability;
+	/* send buffer, ring of b3blocks + CAPI_B3_TX_QUEUE + 1 slots:
+	   slots from txsendseq to txfillseq are queued, txfillseq is filled.
+	   One more slot after the ring takes a block to discard while the
+	   slot of txfillseq is still sent (txdiscard) */
+	unsigned char *send_buffer;
+	unsigned short txslotsize;
+	unsigned short txlen[CAPI_B3_TX_SLOTS];
+	unsigned int txfillseq;
+	unsigned int txsendseq;
+	int txdiscard;
+	_cword txpending[CAPI_MAX_B3_BLOCKS];
+	unsigned char txpendslot[CAPI_MAX_B3_BLOCKS];
+	/* transmit statistics */
+	unsigned int txdrops;
+	unsigned int txunderruns;
+	unsigned long long txidle;	/* ms the window ran empty, 0 while sending */
+	unsigned int txqueuemax;
+	/* receive buffer */
+	unsigned char *rec_buffer;
+
 	int readerfd;
 	int writerfd;
-	struct ast_frame f;
-	unsigned char frame_data[CAPI_MAX_B3_BLOCK_SIZE + AST_FRIENDLY_OFFSET + RTP_HEADER_SIZE];
+	/* frame ring between CAPI thread and PBX, pipe is the doorbell */
+	struct capi_frame_ring *reader_ring;
+	struct capi_frame_ring *writer_ring;
+
+	/* frames are assembled into B3 blocks in the send buffer under lock,
+	   txfill bytes of the current block are filled */
+	unsigned short txfill;
+	int txenergy;
+	cc_format_t txformat;
+
+	/*! Channel we belong to, possibly NULL */
+	struct ast_channel *owner;		
+
+	/* if not null, receiving a fax */
+	FILE *fFax;
+	/* Fax status */
+	unsigned int FaxState;
+
+	/* do software dtmf detection */
+	int doDTMF;
+	struct ast_dsp *vad;
+
+	/* do ECHO SURPRESSION */
+	int ES;
+	int doES;
+	short txavg[ECHO_TX_COUNT];      /* ring of tx frame energies */
+	unsigned char txavgpos;          /* next write position == oldest entry */
+	float rxmin;
+	float txmin;
+
+	float txgain;
+	float rxgain;
+
+	int codec;
+
+	/* Resource PLCI line if data */
+	struct capi_pvt *line_plci;
+#ifdef DIVA_STREAMING
+	struct _diva_stream_scheduling_entry* diva_stream_entry;
+#endif
+	/* Connection between two conference rooms. NULL PLCI */
+	int virtualBridgePeer;
+	struct capi_pvt *bridgePeer;
+
+	struct cc_capi_gains g;
+
+	/* configuration of the interface section, see mkif() */
+	struct cc_capi_ifconf *conf;
 
 	ast_cond_t event_trigger;
 	unsigned int waitevent;
 
-	char name[CAPI_MAX_STRING];
-	char vname[CAPI_MAX_STRING];
-	unsigned char tmpbuf[CAPI_MAX_STRING];
+	char name[CAPI_MAX_NAME];
+	char vname[CAPI_MAX_NAME];
+	/* B channel global configuration of CONNECT_B3 */
+	unsigned char globalconfiguration[3];
 
 	/*! Channel who used us, possibly NULL */
 	struct ast_channel *used;		
-	/*! Channel we belong to, possibly NULL */
-	struct ast_channel *owner;		
 	/*! Channel who called us, possibly NULL */
 	struct ast_channel *peer;		
 	/*! Set if structure is reserved */
@@ -409,38 +535,15 @@ struct capi_pvt {
 	
 	/* capi message number */
 	_cword MessageNumber;	
-	unsigned int NCCI;
-	unsigned int PLCI;
-	/* on which controller we do live */
-	int controller;
-	
-	/* send buffer */
-	unsigned char send_buffer[CAPI_MAX_B3_BLOCKS *
-		(CAPI_MAX_B3_BLOCK_SIZE + AST_FRIENDLY_OFFSET)];
-	unsigned short send_buffer_handle;
-
-	/* receive buffer */
-	unsigned char rec_buffer[CAPI_MAX_B3_BLOCK_SIZE + AST_FRIENDLY_OFFSET + RTP_HEADER_SIZE];
-
-	/* current state */
-	int state;
+	/* PLCI/message number lookup index, see capi_interface_set_plci() */
+	unsigned int index_plci;
+	_cword index_msgnum;
+	struct capi_pvt *plci_hash_next;
+	struct capi_pvt *msgnum_hash_next;
 
-	/* the state of the line */
-	unsigned int isdnstate;
 	unsigned int isdnstate2;
 	int cause;
 
-	/* which b-protocol is active */
-	int bproto;
-
-	char context[AST_MAX_EXTENSION];
-	/*! Multiple Subscriber Number we listen to (, seperated list) */
-	char incomingmsn[CAPI_MAX_STRING];	
-	/*! Prefix to Build CID */
-	char prefix[AST_MAX_EXTENSION];	
-	/* the default caller id */
-	char defaultcid[CAPI_MAX_STRING];
-
 	/*! Caller ID if available */
 	char cid[AST_MAX_EXTENSION];	
 	/*! Dialed Number if available */
@@ -448,7 +551,6 @@ struct capi_pvt {
 	/* callerid type of number */
 	int cid_ton;
 
-	char accountcode[20];	
 	int amaflags;
 
 	ast_group_t callgroup;
@@ -457,9 +559,6 @@ struct capi_pvt {
 	
 	ast_group_t transfergroup;
 
-	/* language */
-	char language[MAX_LANGUAGE];	
-
 	/* additional numbers to dial */
 	int doOverlap;
 	char overlapdigits[AST_MAX_EXTENSION];
@@ -471,8 +570,6 @@ struct capi_pvt {
 	int doB3;
 	/* store plci here for the call that is onhold */
 	unsigned int onholdPLCI;
-	/* do software dtmf detection */
-	int doDTMF;
 	/* CAPI echo cancellation */
 	int doEC;
 	int doEC_global;
@@ -495,39 +592,16 @@ struct capi_pvt {
 
 	/* Common ISDN Profile (CIP) */
 	int cip;
-	unsigned short transfercapability;
 
 	/* Features and settings of current connection */
 	unsigned int fsetting;
 	
-	/* if not null, receiving a fax */
-	FILE *fFax;
-	/* Fax status */
-	unsigned int FaxState;
 	/* Window for fax detection */
 	unsigned int faxdetecttime;
-	/* custom fax context,exten,prio */
-	char faxcontext[AST_MAX_EXTENSION+1];
-	char faxexten[AST_MAX_EXTENSION+1];
-	int faxpriority;
 
 	/* handle for CCBS/CCNR callback */
 	unsigned int ccbsnrhandle;
 
-	/* not all codecs supply frames in nice 160 byte chunks */
-	struct ast_smoother *smoother;
-
-	/* outgoing queue count */
-	int B3q;
-	int B3count;
-
-	/* do ECHO SURPRESSION */
-	int ES;
-	int doES;
-	short txavg[ECHO_TX_COUNT];
-	float rxmin;
-	float txmin;
-
 	unsigned short divaAudioFlags;
 	unsigned short divaDataStubAudioFlags;
 	unsigned short divaDigitalRxGain;
@@ -544,24 +618,14 @@ struct capi_pvt {
 	int command_pass_digits;
 	diva_entity_queue_t channel_command_q;
 
-#ifdef CC_AST_HAS_VERSION_1_4
-	struct ast_jb_conf jbconf;
-	char mohinterpret[MAX_MUSICCLASS];
-#endif
-	
-	struct cc_capi_gains g;
-
-	float txgain;
-	float rxgain;
-	struct ast_dsp *vad;
-
 	unsigned int reason;
 	unsigned int reasonb3;
 
-	/* deferred tasks */
-	time_t whentohangup;
-	time_t whentoqueuehangup;
-	time_t whentoretrieve;
+	/* deferred tasks, monotonic time in ms */
+	unsigned long long whentohangup;
+	unsigned long long whentoqueuehangup;
+	unsigned long long whentoretrieve;
+	struct capi_timer timer;
 
 	/* RTP */
 #ifdef CC_AST_HAS_RTP_ENGINE_H
@@ -571,7 +635,6 @@ struct capi_pvt {
 #endif
 	cc_format_t capability;
 	int rtpcodec;
-	int codec;
 	unsigned int timestamp;
 
 	/* Q.SIG features */
@@ -581,22 +644,15 @@ struct capi_pvt {
 
 	/* Resource PLCI data */
 	int resource_plci_type; /* NULL PLCI, DATA, LINE */
+	unsigned int generation;           /* new with each use of a null-interface */
+	unsigned int line_plci_generation; /* of line_plci */
 
-	/* Resource PLCI line if data */
-	struct capi_pvt *line_plci;
 	/* Resource PLCI data data if line */
 	struct capi_pvt *data_plci;
 
-#ifdef DIVA_STREAMING
-	struct _diva_stream_scheduling_entry* diva_stream_entry;
-#endif
-	/* Connection between two conference rooms. NULL PLCI */
-	int virtualBridgePeer;
-	struct capi_pvt *bridgePeer;
-
 	/*! Next channel in list */
 	struct capi_pvt *next;
-};
+} __attribute__((aligned(CAPI_CACHE_LINE)));
 
 struct cc_capi_profile {
 	unsigned short ncontrollers;
@@ -679,6 +735,9 @@ struct cc_capi_conf {
 
 	int hlimit;
 	int slimit;
+
+	int b3blocks;
+	int b3blocksize;
 };
 
 struct cc_capi_controller;
@@ -739,6 +798,9 @@ struct cc_capi_controller {
 	int divaExtendedFeaturesAvailable;
 	int ecPath;
 	int ecOnTransit;
+	/* B3 window and block size of the interfaces on this controller */
+	int b3blocks;
+	int b3blocksize;
 	int fax_t30_extended;
 #ifdef DIVA_STREAMING
 	int divaStreaming;
@@ -801,6 +863,9 @@ extern format_t capi_capability;
 extern int capi_capability;
 #endif
 extern unsigned capi_ApplID;
+extern unsigned capi_b3_window;
+extern unsigned capi_b3_maxblocksize;
+extern unsigned capi_b3_regblocksize;
 extern struct capi_pvt *capi_iflist;
 extern void cc_start_b3(struct capi_pvt *i);
 extern unsigned char capi_tcap_is_digital(unsigned short tcap);
@@ -811,6 +876,7 @@ extern void capi_wait_for_answered(struct capi_pvt *i);
 extern int capi_wait_for_b3_up(struct capi_pvt *i);
 extern void capi_activehangup(struct capi_pvt *i, int state);
 extern void capi_gains(struct cc_capi_gains *g, float rxgain, float txgain);
+extern unsigned short capi_line_magnitude[256];
 #ifdef CC_AST_HAS_VERSION_1_6
 extern char chatinfo_usage[];
 #endif
@@ -830,6 +896,10 @@ const struct cc_capi_controller *pbx_capi_get_controller(int controller);
 	\brief capi_num_controllers
 	*/
 int pbx_capi_get_num_controllers(void);
+/*!
+	\brief number of queued deferred tasks and high-water mark
+	*/
+void pbx_capi_get_task_stats(int *depth, int *highwater);
 /*!
 	\brief tdesc
 	*/
@@ -1050,8 +1050,15 @@ struct capi_pvt* pbx_check_resource_plci(struct ast_channel *c)
 		const char* id = pbx_builtin_getvar_helper(c, "RESOURCEPLCI");
 
 		if (id != 0) {
-			i = (struct capi_pvt*)strtoul(id, NULL, 0);
-			if (i != 0 && capi_verify_resource_plci(i) != 0) {
+			char *end;
+			unsigned int generation = 0;
+
+			/* <pointer>/<generation> */
+			i = (struct capi_pvt*)strtoul(id, &end, 0);
+			if (*end == '/') {
+				generation = (unsigned int)strtoul(end + 1, NULL, 0);
+			}
+			if (i != 0 && capi_verify_resource_plci(i, generation) != 0) {
 				cc_log(LOG_ERROR, "resource PLCI lost\n");
 				i = 0;
 			}
@@ -1102,8 +1109,8 @@ int pbx_capi_chat_associate_resource_plci(struct ast_channel *c, char *param)
 	if (cur_tech != &capi_tech) {
 		i = capi_mkresourceif(c, contr, 0, codecs, all);
 		if (i != NULL) {
-			char buffer[24];
-			snprintf(buffer, sizeof(buffer)-1, "%p", i);
+			char buffer[40];
+			snprintf(buffer, sizeof(buffer)-1, "%p/%u", i, i->generation);
 			/**
 				Not sure ast_channel pointer does not change across the
 				use of resource PLCI. For this reason use variable to provide
@@ -177,7 +177,7 @@ static int pbxcli_capi_show_channels(int fd, int argc, char *argv[])
 	struct capi_pvt *i;
 	char iochar;
 	char i_state[80];
-	char b3q[32];
+	char b3q[96];
 	int required_args;
 	int provided_args;
 	const char* required_channel_name = NULL;
@@ -224,8 +224,10 @@ static int pbxcli_capi_show_channels(int fd, int argc, char *argv[])
 			iochar = 'I';
 
 		if (capidebug) {
-			snprintf(b3q, sizeof(b3q), "  B3q=%d B3count=%d",
-				i->B3q, i->B3count);
+			snprintf(b3q, sizeof(b3q), "  B3count=%d/%d(%d) txq=%u/%u drops=%u underruns=%u",
+				i->B3count, i->b3blocks, i->b3blocksize,
+				i->txfillseq - i->txsendseq, i->txqueuemax,
+				i->txdrops, i->txunderruns);
 		} else {
 			b3q[0] = '\0';
 		}
@@ -443,6 +445,23 @@ static int pbxcli_capi_info(int fd, int argc, char *argv[])
 #endif
 {
 	int i = 0, capi_num_controllers = pbx_capi_get_num_controllers();
+	unsigned long flushes, messages;
+	int taskdepth, taskhighwater;
+	int poolcount;
+	unsigned long poolhits, poolmisses;
+	unsigned long txdrops = 0, txunderruns = 0;
+	struct capi_pvt *ifc;
+#ifdef DIVA_STREAMING
+	unsigned int segmapped, segbusy, segsetupmaps, segfailed, segavg, segmax;
+#endif
+#ifdef CAPI20EXT_TRACE_STATS
+	unsigned long tracewritten, tracedropped;
+#endif
+#ifdef CAPI20EXT_BUFFER_STATS
+	unsigned buftotal, bufinuse, bufhighwater;
+	unsigned long buffailures;
+	int bufhuge;
+#endif
 #ifdef CC_AST_HAS_VERSION_1_6
 	int fd = a->fd;
 
@@ -469,8 +488,52 @@ static int pbxcli_capi_info(int fd, int argc, char *argv[])
 				i, capiController->nbchannels,
 				capiController->nfreebchannels,
 				(capiController->used) ? "":" (unused)");
+			if (capi_nullif_pool_enabled()) {
+				capi_nullif_pool_stats(i, &poolcount, &poolhits, &poolmisses);
+				ast_cli(fd, "Contr%d: %d NULL-PLCI interfaces in pool, %lu hits, %lu misses.\n",
+					i, poolcount, poolhits, poolmisses);
+			}
 		}
 	}
+
+	capi_put_batch_stats(&flushes, &messages);
+	ast_cli(fd, "CAPI messages: %lu sent in %lu writes (%.2f messages per write).\n",
+		messages, flushes, (flushes != 0) ? ((double)messages / (double)flushes) : 0.0);
+	pbx_capi_lock_interfaces();
+	for (ifc = capi_iflist; ifc; ifc = ifc->next) {
+		txdrops += ifc->txdrops;
+		txunderruns += ifc->txunderruns;
+	}
+	pbx_capi_unlock_interfaces();
+	ast_cli(fd, "B3 transmit: %lu blocks dropped, %lu underruns.\n",
+		txdrops, txunderruns);
+	pbx_capi_get_task_stats(&taskdepth, &taskhighwater);
+	ast_cli(fd, "Deferred tasks: %d queued, high-water mark %d.\n",
+		taskdepth, taskhighwater);
+#ifdef CAPI20EXT_TRACE_STATS
+	capi20ext_trace_stats(&tracewritten, &tracedropped);
+	if ((tracewritten != 0) || (tracedropped != 0)) {
+		ast_cli(fd, "CAPI trace: %lu messages written, %lu dropped.\n",
+			tracewritten, tracedropped);
+	}
+#endif
+#ifdef CAPI20EXT_BUFFER_STATS
+	bufhuge = capi20ext_buffer_stats(capi_ApplID, &buftotal, &bufinuse,
+		&bufhighwater, &buffailures);
+	if (bufhuge >= 0) {
+		ast_cli(fd, "CAPI receive buffers: %u in use, %u max, %u total%s, %lu allocation failures.\n",
+			bufinuse, bufhighwater, buftotal, (bufhuge) ? " (huge pages)" : "", buffailures);
+	}
+#endif
+#ifdef DIVA_STREAMING
+	if (capi_DivaStreamingSegmentStats(&segmapped, &segbusy, &segsetupmaps,
+	    &segfailed, &segavg, &segmax) == 0) {
+		ast_cli(fd, "Diva streaming segments: %u mapped, %u busy, %u free, "
+			"%u mapped at call setup, %u failed, map time %u/%u usec (avg/max).\n",
+			segmapped, segbusy, segmapped - segbusy, segsetupmaps, segfailed, segavg, segmax);
+	}
+#endif
+
 #ifdef CC_AST_HAS_VERSION_1_6
 	return CLI_SUCCESS;
 #else
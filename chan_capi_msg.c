@@ -0,0 +1,134 @@
+/*
+ * An implementation of Common ISDN API 2.0 for Asterisk
+ *
+ * Copyright (C) 2006-2009 Cytronics & Melware
+ *
+ * Armin Schindler <armin@melware.de>
+ *
+ * capi_sendf() by Eicon Networks / Dialogic
+ *
+ * This program is free software and may be modified and
+ * distributed under the terms of the GNU Public License.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include "chan_capi_platform.h"
+#include "chan_capi20.h"
+#include "chan_capi_msg.h"
+
+/*
+ * Eicon's format interpreter of capi_sendf()
+ * Copyright by Eicon Networks / Dialogic
+ */
+int capi_encode_msgv(unsigned char *msg, int size,
+	_cword command, _cdword Id, _cword Number, const char *format, va_list ap,
+	int *format_errors)
+{
+	int i, j;
+	unsigned int d;
+	unsigned char *p, *p_length;
+	unsigned char *string;
+	unsigned short header_length;
+	va_list ap_data;
+	capi_prestruct_t *s;
+
+	*format_errors = 0;
+
+	write_capi_word(&msg[2], capi_ApplID);
+	msg[4] = (unsigned char)((command >> 8) & 0xff);
+	msg[5] = (unsigned char)(command & 0xff);
+	write_capi_word(&msg[6], Number);
+	write_capi_dword(&msg[8], Id);
+
+	p = &msg[12];
+	p_length = 0;
+
+	va_copy(ap_data, ap);
+	for (i = 0; format[i]; i++) {
+		if (unlikely(((p - (&msg[0])) + 12) >= size)) {
+			va_end(ap_data);
+			return CAPI_ENCODE_TOO_BIG;
+		}
+		switch(format[i]) {
+		case 'b': /* byte */
+			d = (unsigned char)va_arg(ap, unsigned int);
+			*(p++) = (unsigned char) d;
+			break;
+		case 'w': /* word (2 bytes) */
+			d = (unsigned short)va_arg(ap, unsigned int);
+			*(p++) = (unsigned char) d;
+			*(p++) = (unsigned char)(d >> 8);
+			break;
+		case 'd': /* double word (4 bytes) */
+			d = va_arg(ap, unsigned int);
+			*(p++) = (unsigned char) d;
+			*(p++) = (unsigned char)(d >> 8);
+			*(p++) = (unsigned char)(d >> 16);
+			*(p++) = (unsigned char)(d >> 24);
+			break;
+		case 's': /* struct, length is the first byte */
+			string = va_arg(ap, unsigned char *);
+			if (string == NULL) {
+				*(p++) = 0;
+			} else {
+				for (j = 0; j <= string[0]; j++)
+					*(p++) = string[j];
+			}
+			break;
+		case 'a': /* ascii string, NULL terminated string */
+			string = va_arg(ap, unsigned char *);
+			for (j = 0; string[j] != '\0'; j++)
+				*(++p) = string[j];
+			*((p++)-j) = (unsigned char) j;
+			break;
+		case 'c': /* predefined capi_prestruct_t */
+			s = va_arg(ap, capi_prestruct_t *);
+			if (s->wLen < 0xff) {
+				*(p++) = (unsigned char)(s->wLen);
+			} else	{
+				*(p++) = 0xff;
+				*(p++) = (unsigned char)(s->wLen);
+				*(p++) = (unsigned char)(s->wLen >> 8);
+			}
+			for (j = 0; j < s->wLen; j++)
+				*(p++) = s->info[j];
+			break;
+		case '(': /* begin of a structure */
+			*p = (p_length) ? p - p_length : 0;
+			p_length = p++;
+			break;
+		case ')': /* end of structure */
+			if (p_length) {
+				j = *p_length;
+				*p_length = (unsigned char)((p - p_length) - 1);
+				p_length = (j != 0) ? p_length - j : 0;
+			} else {
+				*format_errors |= CAPI_ENCODE_INCONSISTENT;
+			}
+			break;
+		default:
+			*format_errors |= CAPI_ENCODE_UNKNOWN_FORMAT;
+		}
+	}
+
+	if (p_length) {
+		*format_errors |= CAPI_ENCODE_INCONSISTENT;
+	}
+
+	header_length = (unsigned short)(p - (&msg[0]));
+
+	if ((sizeof(void *) > 4) && (command == CAPI_DATA_B3_REQ)) {
+		void* req_data;
+		req_data = va_arg(ap_data, void *);
+
+		header_length += 8;
+		write_capi_dword(&msg[12], 0);
+		memcpy(&msg[22], &req_data, sizeof(void *));
+	}
+	va_end(ap_data);
+
+	write_capi_word(&msg[0], header_length);
+
+	return header_length;
+}
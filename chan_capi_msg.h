@@ -0,0 +1,175 @@
+/*
+ * An implementation of Common ISDN API 2.0 for Asterisk
+ *
+ * Copyright (C) 2006-2009 Cytronics & Melware
+ *
+ * Armin Schindler <armin@melware.de>
+ *
+ * capi_sendf() by Eicon Networks / Dialogic
+ *
+ * This program is free software and may be modified and
+ * distributed under the terms of the GNU Public License.
+ */
+
+/*
+ * Building of capi messages, without any dependency on the PBX
+ * (used by tools/ too). Needs chan_capi20.h.
+ */
+
+#ifndef _PBX_CAPI_MSG_H
+#define _PBX_CAPI_MSG_H
+
+#include <stdarg.h>
+#include <string.h>
+
+extern unsigned capi_ApplID;
+
+/* some helper functions */
+static inline void write_capi_word(void *m, unsigned short val)
+{
+	((unsigned char *)m)[0] = val & 0xff;
+	((unsigned char *)m)[1] = (val >> 8) & 0xff;
+}
+static inline unsigned short read_capi_word(const void *m)
+{
+	unsigned short val;
+
+	val = ((const unsigned char *)m)[0] | (((const unsigned char *)m)[1] << 8);
+	return (val);
+}
+static inline void write_capi_dword(void *m, unsigned int val)
+{
+	((unsigned char *)m)[0] = val & 0xff;
+	((unsigned char *)m)[1] = (val >> 8) & 0xff;
+	((unsigned char *)m)[2] = (val >> 16) & 0xff;
+	((unsigned char *)m)[3] = (val >> 24) & 0xff;
+}
+static inline unsigned int read_capi_dword(const void *m)
+{
+	unsigned int val;
+
+	val = ((const unsigned char *)m)[0] | (((const unsigned char *)m)[1] << 8) |
+	      (((const unsigned char *)m)[2] << 16) | (((const unsigned char *)m)[3] << 24);
+	return (val);
+}
+
+typedef struct capi_prestruct_s {
+	unsigned short wLen;
+	unsigned char *info;
+} capi_prestruct_t;
+
+/*
+ * format interpreter of capi_sendf(), returns the length of the message
+ * or CAPI_ENCODE_TOO_BIG. Errors in the format are returned in
+ * format_errors, the message is built anyway.
+ */
+#define CAPI_ENCODE_TOO_BIG          -1
+#define CAPI_ENCODE_UNKNOWN_FORMAT   0x01
+#define CAPI_ENCODE_INCONSISTENT     0x02
+
+extern int capi_encode_msgv(unsigned char *msg, int size,
+	_cword command, _cdword Id, _cword Number, const char *format, va_list ap,
+	int *format_errors);
+
+/*
+ * Encoders for the fixed layout messages sent for every voice block,
+ * instead of the format interpreter of capi_sendf(). The parameters are
+ * written with the CAPI_ENC_* macros in the order of the CAPI spec.
+ * Each encoder needs a buffer of its CAPI_ENC_*_SIZE.
+ */
+#define CAPI_ENC_HEADER(m, command, Id, Number) do { \
+	write_capi_word(&(m)[2], capi_ApplID); \
+	(m)[4] = (unsigned char)(((command) >> 8) & 0xff); \
+	(m)[5] = (unsigned char)((command) & 0xff); \
+	write_capi_word(&(m)[6], (Number)); \
+	write_capi_dword(&(m)[8], (Id)); \
+} while(0)
+#define CAPI_ENC_BYTE(p, val) do { *(p)++ = (unsigned char)(val); } while(0)
+#define CAPI_ENC_WORD(p, val) do { write_capi_word((p), (val)); (p) += 2; } while(0)
+#define CAPI_ENC_DWORD(p, val) do { write_capi_dword((p), (val)); (p) += 4; } while(0)
+#define CAPI_ENC_STRUCT(p, s) do { \
+	if ((s) == NULL) { \
+		*(p)++ = 0; \
+	} else { \
+		memcpy((p), (s), (s)[0] + 1); \
+		(p) += (s)[0] + 1; \
+	} \
+} while(0)
+#define CAPI_ENC_LENGTH(m, p) write_capi_word(&(m)[0], (unsigned short)((p) - &(m)[0]))
+
+#define CAPI_ENC_DATA_B3_REQ_SIZE           32
+#define CAPI_ENC_DATA_B3_RESP_SIZE          16
+#define CAPI_ENC_CONNECT_B3_RESP_SIZE       (12 + 2 + 256)
+#define CAPI_ENC_CONNECT_B3_ACTIVE_RESP_SIZE 12
+#define CAPI_ENC_DTMF_REQ_SIZE              32
+
+static inline void capi_encode_data_b3_req(unsigned char *msg, _cdword NCCI, _cword Number,
+	void *data, _cword len, _cword handle, _cword flags)
+{
+	unsigned char *p = &msg[12];
+
+	CAPI_ENC_HEADER(msg, CAPI_DATA_B3_REQ, NCCI, Number);
+	CAPI_ENC_DWORD(p, (sizeof(void *) > 4) ? 0 : (unsigned int)(unsigned long)data);
+	CAPI_ENC_WORD(p, len);
+	CAPI_ENC_WORD(p, handle);
+	CAPI_ENC_WORD(p, flags);
+	if (sizeof(void *) > 4) {
+		memcpy(p, &data, sizeof(void *));
+		p += 8;
+	}
+	CAPI_ENC_LENGTH(msg, p);
+}
+
+static inline void capi_encode_data_b3_resp(unsigned char *msg, _cdword NCCI, _cword Number,
+	_cword handle)
+{
+	unsigned char *p = &msg[12];
+
+	CAPI_ENC_HEADER(msg, CAPI_DATA_B3_RESP, NCCI, Number);
+	CAPI_ENC_WORD(p, handle);
+	CAPI_ENC_LENGTH(msg, p);
+}
+
+static inline void capi_encode_connect_b3_resp(unsigned char *msg, _cdword NCCI, _cword Number,
+	_cword reject, _cstruct ncpi)
+{
+	unsigned char *p = &msg[12];
+
+	CAPI_ENC_HEADER(msg, CAPI_CONNECT_B3_RESP, NCCI, Number);
+	CAPI_ENC_WORD(p, reject);
+	CAPI_ENC_STRUCT(p, ncpi);
+	CAPI_ENC_LENGTH(msg, p);
+}
+
+static inline void capi_encode_connect_b3_active_resp(unsigned char *msg, _cdword NCCI,
+	_cword Number)
+{
+	CAPI_ENC_HEADER(msg, CAPI_CONNECT_B3_ACTIVE_RESP, NCCI, Number);
+	write_capi_word(&msg[0], CAPI_ENC_CONNECT_B3_ACTIVE_RESP_SIZE);
+}
+
+/*
+ * FACILITY_REQ DTMF: "w(www(b)())" with digit, "w(www()())" without (digit < 0)
+ */
+static inline void capi_encode_dtmf_req(unsigned char *msg, _cdword Id, _cword Number,
+	_cword selector, _cword function, _cword tone_duration, _cword gap_duration, int digit)
+{
+	unsigned char *p = &msg[12];
+
+	CAPI_ENC_HEADER(msg, CAPI_FACILITY_REQ, Id, Number);
+	CAPI_ENC_WORD(p, selector);
+	CAPI_ENC_BYTE(p, (digit < 0) ? 8 : 9);
+	CAPI_ENC_WORD(p, function);
+	CAPI_ENC_WORD(p, tone_duration);
+	CAPI_ENC_WORD(p, gap_duration);
+	if (digit < 0) {
+		CAPI_ENC_BYTE(p, 0);
+	} else {
+		CAPI_ENC_BYTE(p, 1);
+		CAPI_ENC_BYTE(p, digit);
+	}
+	CAPI_ENC_BYTE(p, 0);
+	CAPI_ENC_LENGTH(msg, p);
+}
+
+#endif
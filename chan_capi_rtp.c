@@ -273,33 +273,20 @@ int capi_write_rtp(struct capi_pvt *i, struct ast_frame *f)
 		rtpheader[1] = htonl(i->timestamp);
 		i->timestamp += CAPI_MAX_B3_BLOCK_SIZE;
 			
-		if (len > (CAPI_MAX_B3_BLOCK_SIZE + RTP_HEADER_SIZE)) {
+		if (len > (capi_b3_maxblocksize + RTP_HEADER_SIZE)) {
 			cc_verbose(4, 0, VERBOSE_PREFIX_4 "%s: rtp write data: frame too big (len = %d).\n",
 				i->vname, len);
 			continue;
 		}
-		if (i->B3count >= CAPI_MAX_B3_BLOCKS) {
-			cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: B3count is full, dropping packet.\n",
-				i->vname);
-			continue;
-		}
-		cc_mutex_lock(&i->lock);
-		i->B3count++;
-		cc_mutex_unlock(&i->lock);
-
-		i->send_buffer_handle++;
 
 		cc_verbose(6, 1, VERBOSE_PREFIX_4 "%s: RTP write for NCCI=%#x len=%d(%d) %s ts=%x\n",
 			i->vname, i->NCCI, len, f->datalen, cc_getformatname(GET_FRAME_SUBCLASS_CODEC(f->subclass)),
 			i->timestamp);
 
-		capi_sendf(NULL, 0, CAPI_DATA_B3_REQ, i->NCCI, get_capi_MessageNumber(),
-			"dwww",
-			buf,
-			len,
-			i->send_buffer_handle,
-			0
-		);
+		cc_mutex_lock(&i->lock);
+		memcpy(capi_b3_tx_slot(i), buf, len);
+		capi_b3_tx_commit(i, len);
+		cc_mutex_unlock(&i->lock);
 	}
 
 #endif
@@ -42,25 +42,29 @@ struct ccbsnr_s {
 	char context[AST_MAX_CONTEXT];
 	char exten[AST_MAX_EXTENSION];
 	int priority;
-	time_t age;
+	struct capi_timer timer;
 	struct ccbsnr_s *next;
 };
 
+#define CCBSNR_TIMEOUT  86400 /* seconds */
+
 static struct ccbsnr_s *ccbsnr_list = NULL;
 AST_MUTEX_DEFINE_STATIC(ccbsnr_lock);
 
 /*
- * remove too old CCBS/CCNR entries
- * (must be called with ccbsnr_lock held)
+ * remove a too old CCBS/CCNR entry, the timer data is the handle
+ * because the entry may be gone already
  */
-static void del_old_ccbsnr(void)
+static void del_old_ccbsnr(void *data)
 {
+	unsigned int handle = (unsigned int)(unsigned long)data;
 	struct ccbsnr_s *ccbsnr;
 	struct ccbsnr_s *tmp = NULL;
 
+	cc_mutex_lock(&ccbsnr_lock);
 	ccbsnr = ccbsnr_list;
 	while (ccbsnr) {
-		if ((ccbsnr->age + 86400) < time(NULL)) {
+		if (ccbsnr->handle == handle) {
 			cc_verbose(1, 1, VERBOSE_PREFIX_3 CC_MESSAGE_NAME
 				": CCBS/CCNR handle=%d timeout.\n", ccbsnr->handle);
 			if (!tmp) {
@@ -68,12 +72,14 @@ static void del_old_ccbsnr(void)
 			} else {
 				tmp->next = ccbsnr->next;
 			}
+			capi_timer_stop(&ccbsnr->timer);
 			ast_free(ccbsnr);
 			break;
 		}
 		tmp = ccbsnr;
 		ccbsnr = ccbsnr->next;
 	}
+	cc_mutex_unlock(&ccbsnr_lock);
 }
 
 /*
@@ -89,8 +95,10 @@ void cleanup_ccbsnr(void)
 	while (ccbsnr) {
 		tmp = ccbsnr;
 		ccbsnr = ccbsnr->next;
+		capi_timer_stop(&tmp->timer);
 		ast_free(tmp);
 	}
+	ccbsnr_list = NULL;
 	cc_mutex_unlock(&ccbsnr_lock);
 }
 
@@ -132,7 +140,6 @@ static void new_ccbsnr_id(char type, unsigned int plci,
 	}
 	memset(ccbsnr, 0, sizeof(struct ccbsnr_s));
 
-    ccbsnr->age = time(NULL);
     ccbsnr->type = type;
     ccbsnr->id = id;
     ccbsnr->rbref = 0xdead;
@@ -147,10 +154,12 @@ static void new_ccbsnr_id(char type, unsigned int plci,
 		cc_log(LOG_NOTICE, "No peerlink found to set CCBS/CCNR linkage ID.\n");
 	}
 
+	capi_timer_init(&ccbsnr->timer, del_old_ccbsnr, (void *)(unsigned long)ccbsnr->handle);
+
 	cc_mutex_lock(&ccbsnr_lock);
-	del_old_ccbsnr();
 	ccbsnr->next = ccbsnr_list;
 	ccbsnr_list = ccbsnr;
+	capi_timer_start(&ccbsnr->timer, CCBSNR_TIMEOUT * 1000);
 	cc_mutex_unlock(&ccbsnr_lock);
 
 	cc_verbose(1, 1, VERBOSE_PREFIX_3
@@ -262,6 +271,7 @@ static void del_ccbsnr_ref(unsigned int plci, _cword ref)
 			} else {
 				tmp->next = ccbsnr->next;
 			}
+			capi_timer_stop(&ccbsnr->timer);
 			ast_free(ccbsnr);
 			cc_verbose(1, 1, VERBOSE_PREFIX_3 CC_MESSAGE_NAME
 				": PLCI=%#x CCBS/CCNR removed ref=0x%04x\n", plci, ref);
@@ -322,6 +332,7 @@ static void del_ccbsnr_id(unsigned int plci, _cword id)
 				} else {
 					tmp->next = ccbsnr->next;
 				}
+				capi_timer_stop(&ccbsnr->timer);
 				ast_free(ccbsnr);
 				cc_verbose(1, 1, VERBOSE_PREFIX_3 CC_MESSAGE_NAME ": PLCI=%#x CCBS/CCNR removed "
 					"id=0x%04x state=%d\n",	plci, id, oldstate);
@@ -706,7 +717,7 @@ int handle_facility_indication_supplementary(
 			show_capi_info(i, infoword);
 		} else {
 			i->state = CAPI_STATE_CONNECTED;
-			i->PLCI = i->onholdPLCI;
+			capi_interface_set_plci(i, i->onholdPLCI);
 			i->onholdPLCI = 0;
 			cc_verbose(1, 1, VERBOSE_PREFIX_3 "%s: PLCI=%#x retrieved\n",
 				i->vname, PLCI);
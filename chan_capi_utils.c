@@ -19,6 +19,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <sys/types.h>
+#include <poll.h>
 #include "chan_capi_platform.h"
 #include "xlaw.h"
 #include "chan_capi20.h"
@@ -44,7 +45,6 @@
 #endif
 
 #ifdef CC_AST_HAS_VERSION_13_0
-#include "asterisk/smoother.h"
 #endif
 
 int capidebug = 0;
@@ -55,16 +55,36 @@ AST_MUTEX_DEFINE_STATIC(messagenumber_lock);
 AST_MUTEX_DEFINE_STATIC(capi_put_lock);
 AST_MUTEX_DEFINE_STATIC(peerlink_lock);
 AST_MUTEX_DEFINE_STATIC(nullif_lock);
+AST_MUTEX_DEFINE_STATIC(ifindex_lock);
 
 static _cword capi_MessageNumber;
 
 static struct capi_pvt *nulliflist = NULL;
 static int controller_nullplcis[CAPI_MAX_CONTROLLERS];
 
+/*
+ * free null-interfaces of a controller, ready to be used again
+ */
+struct capi_nullif_pool {
+	struct capi_pvt *free;
+	int count;
+	unsigned long hits;
+	unsigned long misses;
+};
+static struct capi_nullif_pool nullif_pool[CAPI_MAX_CONTROLLERS];
+static int nullif_pool_size;
+static unsigned int nullif_generation; /* last generation handed out */
+
+#define CAPI_IFINDEX_HASH_SIZE  256 /* must be power of two */
+static struct capi_pvt *plci_hash[CAPI_IFINDEX_HASH_SIZE];
+static struct capi_pvt *msgnum_hash[CAPI_IFINDEX_HASH_SIZE];
+
 #define CAPI_MAX_PEERLINKCHANNELS  32
+#define CAPI_PEERLINK_TIMEOUT      60000 /* ms */
 static struct peerlink_s {
 	struct ast_channel *channel;
-	time_t age;
+	unsigned long long age;
+	struct capi_timer timer;
 } peerlinkchannel[CAPI_MAX_PEERLINKCHANNELS];
 
 /*
@@ -95,6 +115,254 @@ void cc_verbose_internal(char *text, ...)
 	cc_mutex_unlock(&verbose_lock);	
 }
 
+/*
+ * B3 window and block size of a null-interface, from its controller
+ */
+static void capi_nullif_b3_config(struct capi_pvt *i)
+{
+	const struct cc_capi_controller *cp = pbx_capi_get_controller(i->controller);
+
+	i->b3blocks = capi_b3_window;
+	i->b3blocksize = CAPI_MAX_B3_BLOCK_SIZE;
+	if ((cp != NULL) && (cp->b3blocks != 0) && (cp->b3blocksize != 0)) {
+		i->b3blocks = cp->b3blocks;
+		i->b3blocksize = cp->b3blocksize;
+	}
+}
+
+/*
+ * allocate a cleared interface on a cache line. ast_malloc() only
+ * guarantees the alignment of the C library, the pointer it returned
+ * is kept in front of the interface.
+ */
+struct capi_pvt *capi_pvt_alloc(void)
+{
+	unsigned char *mem;
+	struct capi_pvt *i;
+
+	mem = ast_malloc(sizeof(struct capi_pvt) + CAPI_CACHE_LINE + sizeof(void *));
+	if (mem == NULL) {
+		return NULL;
+	}
+	i = (struct capi_pvt *)(((unsigned long)(mem + sizeof(void *)) + CAPI_CACHE_LINE - 1) &
+		~((unsigned long)CAPI_CACHE_LINE - 1));
+	((void **)i)[-1] = mem;
+	memset(i, 0, sizeof(struct capi_pvt));
+
+	return i;
+}
+
+void capi_pvt_free(struct capi_pvt *i)
+{
+	if (i != NULL) {
+		ast_free(((void **)i)[-1]);
+	}
+}
+
+/*
+ * allocate a null-interface with its lock and B3 buffers
+ */
+static struct capi_pvt *capi_nullif_new(unsigned int controller)
+{
+	struct capi_pvt *i;
+
+	i = capi_pvt_alloc();
+	if (!i) {
+		return NULL;
+	}
+
+	i->controller = controller;
+	capi_nullif_b3_config(i);
+	if (capi_alloc_b3_buffers(i) != 0) {
+		capi_pvt_free(i);
+		return NULL;
+	}
+	cc_mutex_init(&i->lock);
+	ast_cond_init(&i->event_trigger, NULL);
+	i->readerfd = -1;
+	i->writerfd = -1;
+
+	return i;
+}
+
+static void capi_nullif_free(struct capi_pvt *i)
+{
+	capi_free_b3_buffers(i);
+	cc_mutex_destroy(&i->lock);
+	ast_cond_destroy(&i->event_trigger);
+	capi_pvt_free(i);
+}
+
+/*
+ * compile time check, the array size is negative if cond is false
+ */
+#define CAPI_BUILD_ASSERT(name, cond) typedef char capi_build_assert_##name[(cond) ? 1 : -1]
+
+/*
+ * capi_nullif_reset() clears the interface around lock and event_trigger
+ * with two memset()s, so only lock may be in front of NCCI and waitevent
+ * has to follow event_trigger.
+ */
+CAPI_BUILD_ASSERT(lock_first, offsetof(struct capi_pvt, lock) == 0);
+CAPI_BUILD_ASSERT(ncci_after_lock, offsetof(struct capi_pvt, NCCI) <
+	(sizeof(cc_mutex_t) + sizeof(unsigned int)));
+CAPI_BUILD_ASSERT(waitevent_after_event_trigger, offsetof(struct capi_pvt, waitevent) <
+	(offsetof(struct capi_pvt, event_trigger) + sizeof(ast_cond_t) + sizeof(unsigned int)));
+
+/*
+ * clear the state of a pooled null-interface, lock, condition,
+ * and B3 buffers are kept
+ */
+static void capi_nullif_reset(struct capi_pvt *i)
+{
+	unsigned int controller = i->controller;
+	unsigned short b3blocks = i->b3blocks;
+	unsigned short b3blocksize = i->b3blocksize;
+	unsigned char *send_buffer = i->send_buffer;
+	unsigned char *rec_buffer = i->rec_buffer;
+	unsigned short txslotsize = i->txslotsize;
+
+	/* all fields between lock and event_trigger and after event_trigger */
+	memset(&i->NCCI, 0, offsetof(struct capi_pvt, event_trigger) -
+		offsetof(struct capi_pvt, NCCI));
+	memset(&i->waitevent, 0, sizeof(struct capi_pvt) -
+		offsetof(struct capi_pvt, waitevent));
+
+	i->controller = controller;
+	i->b3blocks = b3blocks;
+	i->b3blocksize = b3blocksize;
+	i->send_buffer = send_buffer;
+	i->rec_buffer = rec_buffer;
+	i->txslotsize = txslotsize;
+	i->readerfd = -1;
+	i->writerfd = -1;
+}
+
+/*
+ * get a null-interface for controller, from the pool if possible
+ */
+static struct capi_pvt *capi_nullif_get(unsigned int controller)
+{
+	struct capi_nullif_pool *pool = &nullif_pool[controller - 1];
+	struct capi_pvt *i;
+
+	cc_mutex_lock(&nullif_lock);
+	i = pool->free;
+	if (i != NULL) {
+		pool->free = i->next;
+		pool->count--;
+		pool->hits++;
+	} else if (nullif_pool_size > 0) {
+		pool->misses++;
+	}
+	cc_mutex_unlock(&nullif_lock);
+
+	if (i == NULL) {
+		i = capi_nullif_new(controller);
+		if (i == NULL) {
+			return NULL;
+		}
+	}
+	i->next = NULL;
+
+	/* a reference to the last use of this interface is not valid anymore */
+	cc_mutex_lock(&nullif_lock);
+	if (++nullif_generation == 0) {
+		nullif_generation = 1;
+	}
+	i->generation = nullif_generation;
+	cc_mutex_unlock(&nullif_lock);
+
+	return i;
+}
+
+/*
+ * put a null-interface back to the pool of its controller or free it
+ */
+static void capi_nullif_release(struct capi_pvt *i)
+{
+	struct capi_nullif_pool *pool = &nullif_pool[i->controller - 1];
+
+	capi_close_reader_writer_pipe(i);
+
+	cc_mutex_lock(&nullif_lock);
+	if (pool->count < nullif_pool_size) {
+		capi_nullif_reset(i);
+		i->next = pool->free;
+		pool->free = i;
+		pool->count++;
+		i = NULL;
+	}
+	cc_mutex_unlock(&nullif_lock);
+
+	if (i != NULL) {
+		capi_nullif_free(i);
+	}
+}
+
+/*
+ * prewarm the null-interface pools of all controllers
+ */
+void capi_nullif_pool_init(int size)
+{
+	struct capi_pvt *i;
+	int controller, n;
+
+	nullif_pool_size = size;
+
+	for (controller = 1; controller <= pbx_capi_get_num_controllers(); controller++) {
+		if (pbx_capi_get_controller(controller) == NULL)
+			continue;
+		for (n = nullif_pool[controller - 1].count; n < size; n++) {
+			if ((i = capi_nullif_new(controller)) == NULL)
+				break;
+			cc_mutex_lock(&nullif_lock);
+			i->next = nullif_pool[controller - 1].free;
+			nullif_pool[controller - 1].free = i;
+			nullif_pool[controller - 1].count++;
+			cc_mutex_unlock(&nullif_lock);
+		}
+	}
+	if (size > 0) {
+		cc_verbose(3, 0, VERBOSE_PREFIX_3 "null-interface pool of %d per controller\n", size);
+	}
+}
+
+void capi_nullif_pool_cleanup(void)
+{
+	struct capi_pvt *i;
+	int controller;
+
+	cc_mutex_lock(&nullif_lock);
+	nullif_pool_size = 0;
+	for (controller = 0; controller < CAPI_MAX_CONTROLLERS; controller++) {
+		while ((i = nullif_pool[controller].free) != NULL) {
+			nullif_pool[controller].free = i->next;
+			capi_nullif_free(i);
+		}
+		nullif_pool[controller].count = 0;
+	}
+	cc_mutex_unlock(&nullif_lock);
+}
+
+/*
+ * pool usage of a controller
+ */
+void capi_nullif_pool_stats(int controller, int *count,
+	unsigned long *hits, unsigned long *misses)
+{
+	cc_mutex_lock(&nullif_lock);
+	*count = nullif_pool[controller - 1].count;
+	*hits = nullif_pool[controller - 1].hits;
+	*misses = nullif_pool[controller - 1].misses;
+	cc_mutex_unlock(&nullif_lock);
+}
+
+int capi_nullif_pool_enabled(void)
+{
+	return nullif_pool_size;
+}
+
 /*
  * hangup and remove null-interface
  */
@@ -108,6 +376,8 @@ void capi_remove_nullif(struct capi_pvt *i)
 		return;
 	}
 
+	capi_timer_stop_sync(&i->timer);
+
 	cc_mutex_lock(&i->lock);
 	if (i->line_plci != 0) {
 		ii = i->line_plci;
@@ -139,30 +409,230 @@ void capi_remove_nullif(struct capi_pvt *i)
 			}
 			cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: removed null-interface from controller %d.\n",
 				i->vname, i->controller);
-			if (i->smoother) {
-				ast_smoother_free(i->smoother);
-				i->smoother = 0;
-			}
-			cc_mutex_destroy(&i->lock);
-			ast_cond_destroy(&i->event_trigger);
 			controller_nullplcis[i->controller - 1]--;
-			ast_free(i);
 			break;
 		}
 		tmp = ii;
 		ii = ii->next;
 	}
 	cc_mutex_unlock(&nullif_lock);
+
+	if (ii != NULL) {
+		capi_interface_index_remove(i);
+		capi_nullif_release(i);
+	}
 }
 
-int capi_verify_resource_plci(const struct capi_pvt *i) {
+/*
+ * the resource PLCI is still in use and not a later use of the same
+ * pooled null-interface
+ */
+int capi_verify_resource_plci(const struct capi_pvt *i, unsigned int generation) {
 	const struct capi_pvt *ii;
+	int ret = -1;
 
 	cc_mutex_lock(&nullif_lock);
 	for (ii = nulliflist; ii != 0 && ii != i; ii = ii->next);
+	if ((ii != 0) && (ii->generation == generation)) {
+		ret = 0;
+	}
 	cc_mutex_unlock(&nullif_lock);
 
-	return ((ii == i) ? 0 : -1);
+	return ret;
+}
+
+/*
+ * null-interfaces have no interface section, they share an empty one
+ */
+static struct cc_capi_ifconf capi_nullif_conf;
+
+void capi_ifconf_unref(struct cc_capi_ifconf *conf)
+{
+	if ((conf == NULL) || (conf == &capi_nullif_conf))
+		return;
+	if (__sync_sub_and_fetch(&conf->refs, 1) == 0)
+		ast_free(conf);
+}
+
+/*
+ * allocate the B3 send and receive buffers of an interface
+ */
+int capi_alloc_b3_buffers(struct capi_pvt *i)
+{
+	size_t sendsize;
+	size_t recsize = capi_b3_maxblocksize + AST_FRIENDLY_OFFSET + RTP_HEADER_SIZE;
+
+	/* a slot takes a voice block or a RTP packet */
+	i->txslotsize = i->b3blocksize;
+	if (i->txslotsize < (capi_b3_maxblocksize + RTP_HEADER_SIZE))
+		i->txslotsize = capi_b3_maxblocksize + RTP_HEADER_SIZE;
+	i->txslotsize += AST_FRIENDLY_OFFSET;
+	sendsize = (i->b3blocks + CAPI_B3_TX_QUEUE + 2) * i->txslotsize;
+
+	i->send_buffer = ast_malloc(sendsize + recsize);
+	if (i->send_buffer == NULL) {
+		cc_log(LOG_ERROR, "%s: unable to allocate B3 buffers.\n",
+			i->vname);
+		return -1;
+	}
+	i->rec_buffer = i->send_buffer + sendsize;
+	return 0;
+}
+
+void capi_free_b3_buffers(struct capi_pvt *i)
+{
+	if (i->send_buffer != NULL) {
+		ast_free(i->send_buffer);
+		i->send_buffer = NULL;
+		i->rec_buffer = NULL;
+	}
+}
+
+/*
+ * B3 transmit flow control
+ *
+ * Each DATA_B3_REQ takes a credit of the B3 window, its DATA_B3_CONF
+ * returns it by data handle. Blocks which do not fit into the window
+ * wait in the send buffer, up to CAPI_B3_TX_QUEUE blocks, then the
+ * oldest one is dropped. A dropped block leaves a gap, so the slot to
+ * fill may still be sent; the next block is then written aside and
+ * dropped. All functions are called with i->lock held, the writer
+ * keeps it from capi_b3_tx_slot() until the block is committed, so a
+ * reset by CONNECT_B3_IND cannot hit a half filled block.
+ */
+#define CAPI_B3_TX_NSLOTS(i)  ((i)->b3blocks + CAPI_B3_TX_QUEUE + 1)
+
+/*
+ * slot to fill with the next block
+ */
+unsigned char *capi_b3_tx_slot(struct capi_pvt *i)
+{
+	if (unlikely(i->txdiscard)) {
+		return &i->send_buffer[CAPI_B3_TX_NSLOTS(i) * i->txslotsize];
+	}
+	return &i->send_buffer[(i->txfillseq % CAPI_B3_TX_NSLOTS(i)) * i->txslotsize];
+}
+
+/*
+ * the slot to fill waits for a DATA_B3_CONF
+ */
+static int capi_b3_tx_inflight(struct capi_pvt *i)
+{
+	unsigned int slot = i->txfillseq % CAPI_B3_TX_NSLOTS(i);
+	int n;
+
+	for (n = 0; n < i->B3count; n++) {
+		if (i->txpendslot[n] == slot)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * send queued blocks while there are credits
+ */
+static void capi_b3_tx_flush(struct capi_pvt *i)
+{
+	unsigned int slot;
+
+	while ((i->txsendseq != i->txfillseq) && (i->B3count < i->b3blocks)) {
+		slot = i->txsendseq % CAPI_B3_TX_NSLOTS(i);
+		i->txsendseq++;
+		i->send_buffer_handle++;
+		if (capi_send_data_b3_req(i->NCCI, get_capi_MessageNumber(),
+		    &i->send_buffer[slot * i->txslotsize], i->txlen[slot],
+		    i->send_buffer_handle, 0) == 0) {
+			i->txpending[i->B3count] = i->send_buffer_handle;
+			i->txpendslot[i->B3count] = slot;
+			i->B3count++;
+		} else {
+			i->txdrops++;
+		}
+	}
+}
+
+/*
+ * queue the filled slot and send what the window allows
+ */
+void capi_b3_tx_commit(struct capi_pvt *i, int len)
+{
+	unsigned int queued;
+
+	if (unlikely(i->txdiscard)) {
+		i->txdrops++;
+		i->txdiscard = capi_b3_tx_inflight(i);
+		return;
+	}
+
+	if (i->txidle != 0) {
+		/* the line was without data longer than a block lasts */
+		if ((capi_timer_now() - i->txidle > (i->b3blocksize / 8)) &&
+		    (!(i->FaxState & CAPI_FAX_STATE_SENDMODE))) {
+			i->txunderruns++;
+		}
+		i->txidle = 0;
+	}
+
+	i->txlen[i->txfillseq % CAPI_B3_TX_NSLOTS(i)] = len;
+	i->txfillseq++;
+
+	capi_b3_tx_flush(i);
+
+	queued = i->txfillseq - i->txsendseq;
+	if (queued > CAPI_B3_TX_QUEUE) {
+		/* drop the oldest block, the newest is more important */
+		i->txsendseq++;
+		i->txdrops++;
+		queued--;
+		cc_verbose(4, 1, VERBOSE_PREFIX_4 "%s: B3 window full, dropped block for NCCI=%#x\n",
+			i->vname, i->NCCI);
+	}
+	if (queued > i->txqueuemax)
+		i->txqueuemax = queued;
+
+	i->txdiscard = capi_b3_tx_inflight(i);
+}
+
+/*
+ * DATA_B3_CONF, return the credit of handle
+ */
+void capi_b3_tx_confirm(struct capi_pvt *i, _cword handle)
+{
+	int n;
+
+	for (n = 0; n < i->B3count; n++) {
+		if (i->txpending[n] == handle)
+			break;
+	}
+	if (n == i->B3count) {
+		/* not sent with a credit */
+		return;
+	}
+	i->B3count--;
+	memmove(&i->txpending[n], &i->txpending[n + 1],
+		(i->B3count - n) * sizeof(i->txpending[0]));
+	memmove(&i->txpendslot[n], &i->txpendslot[n + 1],
+		(i->B3count - n) * sizeof(i->txpendslot[0]));
+
+	capi_b3_tx_flush(i);
+
+	if ((i->B3count == 0) && (i->txsendseq == i->txfillseq) && (i->txidle == 0)) {
+		/* the line runs out of data, an underrun if the next block is late */
+		i->txidle = capi_timer_now();
+	}
+}
+
+/*
+ * forget queued and pending blocks, e.g. the NCCI is gone
+ */
+void capi_b3_tx_reset(struct capi_pvt *i)
+{
+	i->B3count = 0;
+	i->txsendseq = i->txfillseq;
+	i->txdiscard = 0;
+	i->txidle = 0;
+	i->txfill = 0;
+	i->txenergy = 0;
 }
 
 /*
@@ -190,14 +660,12 @@ struct capi_pvt *capi_mknullif(struct ast_channel *c, unsigned long long control
 		}
 	}
 
-	tmp = ast_malloc(sizeof(struct capi_pvt));
+	tmp = capi_nullif_get(controller);
 	if (!tmp) {
 		return NULL;
 	}
-	memset(tmp, 0, sizeof(struct capi_pvt));
+	tmp->conf = &capi_nullif_conf;
 	
-	cc_mutex_init(&tmp->lock);
-	ast_cond_init(&tmp->event_trigger, NULL);
 	if (c) {
 #ifdef CC_AST_HAS_VERSION_11_0
 		cur_chan_name = (char *)ast_channel_name(c);
@@ -220,7 +688,6 @@ struct capi_pvt *capi_mknullif(struct ast_channel *c, unsigned long long control
 
 	tmp->cip = CAPI_CIPI_SPEECH;
 	tmp->transfercapability = PRI_TRANS_CAP_SPEECH;
-	tmp->controller = controller;
 	tmp->doEC = 1;
 	tmp->doEC_global = 1;
 	tmp->ecOption = EC_OPTION_DISABLE_NEVER;
@@ -235,14 +702,13 @@ struct capi_pvt *capi_mknullif(struct ast_channel *c, unsigned long long control
 
 	if (c != 0) {
 		if (!(capi_create_reader_writer_pipe(tmp))) {
-			ast_free(tmp);
+			capi_nullif_release(tmp);
 			return NULL;
 		}
 	}
 
 	tmp->bproto = CC_BPROTO_TRANSPARENT;	
 	tmp->doB3 = CAPI_B3_DONT;
-	tmp->smoother = ast_smoother_new(CAPI_MAX_B3_BLOCK_SIZE);
 	tmp->isdnstate |= CAPI_ISDN_STATE_PBX;
 		
 	cc_mutex_lock(&nullif_lock);
@@ -254,7 +720,7 @@ struct capi_pvt *capi_mknullif(struct ast_channel *c, unsigned long long control
 	/* connect to driver */
 	tmp->outgoing = 1;
 	tmp->state = CAPI_STATE_CONNECTPENDING;
-	tmp->MessageNumber = get_capi_MessageNumber();
+	capi_interface_set_msgnum(tmp, get_capi_MessageNumber());
 
 #ifdef DIVA_STREAMING
 	tmp->diva_stream_entry = 0;
@@ -326,14 +792,11 @@ struct capi_pvt *capi_mkresourceif(
 			fmt = cc_get_best_codec_as_bits(fmt);
 	}
 
-	data_ifc = ast_malloc(sizeof(struct capi_pvt));
+	data_ifc = capi_nullif_get(controller);
 	if (data_ifc == 0) {
 		return NULL;
 	}
-	memset(data_ifc, 0, sizeof(struct capi_pvt));
-	
-	cc_mutex_init(&data_ifc->lock);
-	ast_cond_init(&data_ifc->event_trigger, NULL);
+	data_ifc->conf = &capi_nullif_conf;
 
 #ifdef CC_AST_HAS_VERSION_11_0
 	const char *cur_name = ast_channel_name(c);
@@ -352,7 +815,6 @@ struct capi_pvt *capi_mkresourceif(
 
 	data_ifc->cip = CAPI_CIPI_SPEECH;
 	data_ifc->transfercapability = PRI_TRANS_CAP_SPEECH;
-	data_ifc->controller = controller;
 	data_ifc->doEC = 1;
 	data_ifc->doEC_global = 1;
 	data_ifc->ecOption = EC_OPTION_DISABLE_NEVER;
@@ -368,7 +830,7 @@ struct capi_pvt *capi_mkresourceif(
 
 	if (data_plci_ifc == 0) {
 		if (!(capi_create_reader_writer_pipe(data_ifc))) {
-			ast_free(data_ifc);
+			capi_nullif_release(data_ifc);
 			return NULL;
 		}
 	} else {
@@ -378,7 +840,6 @@ struct capi_pvt *capi_mkresourceif(
 
 	data_ifc->bproto = (fmt != 0 && data_plci_ifc != 0) ? CC_BPROTO_VOCODER : CC_BPROTO_TRANSPARENT;
 	data_ifc->doB3 = CAPI_B3_DONT;
-	data_ifc->smoother = ast_smoother_new(CAPI_MAX_B3_BLOCK_SIZE);
 	data_ifc->isdnstate |= CAPI_ISDN_STATE_PBX;
 		
 	cc_mutex_lock(&nullif_lock);
@@ -390,7 +851,7 @@ struct capi_pvt *capi_mkresourceif(
 	/* connect to driver */
 	data_ifc->outgoing = 1;
 	data_ifc->state = CAPI_STATE_CONNECTPENDING;
-	data_ifc->MessageNumber = get_capi_MessageNumber();
+	capi_interface_set_msgnum(data_ifc, get_capi_MessageNumber());
 
 	cc_mutex_lock(&data_ifc->lock);
 
@@ -428,6 +889,7 @@ struct capi_pvt *capi_mkresourceif(
 		} else {
 			cc_mutex_lock(&data_plci_ifc->lock);
 			data_plci_ifc->line_plci = data_ifc;
+			data_plci_ifc->line_plci_generation = data_ifc->generation;
 			capi_sendf(data_plci_ifc, 1, CAPI_FACILITY_REQ, data_plci_ifc->PLCI, get_capi_MessageNumber(),
 				"w(w(d()))",
 				FACILITYSELECTOR_LINE_INTERCONNECT,
@@ -438,8 +900,7 @@ struct capi_pvt *capi_mkresourceif(
 
 			data_ifc->data_plci      = data_plci_ifc;
 
-			data_ifc->writerfd = data_plci_ifc->writerfd;
-			data_plci_ifc->writerfd = -1;
+			capi_move_writer_pipe(data_ifc, data_plci_ifc);
 		}
 	}
 
@@ -473,6 +934,112 @@ _cword get_capi_MessageNumber(void)
 	return mn;
 }
 
+/*
+ * PLCI and message number lookup index
+ *
+ * Every interface (B-channel, NULL-PLCI and resource PLCI) with a PLCI
+ * assigned is kept in plci_hash. Interfaces without PLCI but with a
+ * pending message number (outgoing CONNECT_REQ / MANUFACTURER_REQ)
+ * are kept in msgnum_hash. The index is updated by
+ * capi_interface_set_plci() and capi_interface_set_msgnum(),
+ * so i->PLCI and i->MessageNumber must not be assigned directly.
+ */
+static unsigned int capi_plci_hash(unsigned int plci)
+{
+	/* low byte is the controller, second byte the PLCI on that controller */
+	return (((plci >> 8) ^ (plci >> 16) ^ ((plci & 0x7f) << 3)) &
+		(CAPI_IFINDEX_HASH_SIZE - 1));
+}
+
+static unsigned int capi_msgnum_hash(_cword msgnum)
+{
+	return (msgnum & (CAPI_IFINDEX_HASH_SIZE - 1));
+}
+
+/*
+ * remove interface from index, ifindex_lock must be held
+ */
+static void capi_interface_index_unlink(struct capi_pvt *i)
+{
+	struct capi_pvt **pp;
+
+	if (i->index_plci != 0) {
+		for (pp = &plci_hash[capi_plci_hash(i->index_plci)]; *pp; pp = &(*pp)->plci_hash_next) {
+			if (*pp == i) {
+				*pp = i->plci_hash_next;
+				break;
+			}
+		}
+		i->plci_hash_next = NULL;
+		i->index_plci = 0;
+	}
+
+	if (i->index_msgnum != 0) {
+		for (pp = &msgnum_hash[capi_msgnum_hash(i->index_msgnum)]; *pp; pp = &(*pp)->msgnum_hash_next) {
+			if (*pp == i) {
+				*pp = i->msgnum_hash_next;
+				break;
+			}
+		}
+		i->msgnum_hash_next = NULL;
+		i->index_msgnum = 0;
+	}
+}
+
+/*
+ * (re)insert interface into index, ifindex_lock must be held
+ */
+static void capi_interface_index_link(struct capi_pvt *i)
+{
+	unsigned int h;
+
+	capi_interface_index_unlink(i);
+
+	if (i->PLCI != 0) {
+		h = capi_plci_hash(i->PLCI);
+		i->plci_hash_next = plci_hash[h];
+		plci_hash[h] = i;
+		i->index_plci = i->PLCI;
+	} else if (i->MessageNumber != 0) {
+		h = capi_msgnum_hash(i->MessageNumber);
+		i->msgnum_hash_next = msgnum_hash[h];
+		msgnum_hash[h] = i;
+		i->index_msgnum = i->MessageNumber;
+	}
+}
+
+/*
+ * assign PLCI to interface and update lookup index
+ */
+void capi_interface_set_plci(struct capi_pvt *i, unsigned int plci)
+{
+	cc_mutex_lock(&ifindex_lock);
+	i->PLCI = plci;
+	capi_interface_index_link(i);
+	cc_mutex_unlock(&ifindex_lock);
+}
+
+/*
+ * assign message number to interface and update lookup index
+ */
+void capi_interface_set_msgnum(struct capi_pvt *i, _cword msgnum)
+{
+	cc_mutex_lock(&ifindex_lock);
+	i->MessageNumber = msgnum;
+	capi_interface_index_link(i);
+	cc_mutex_unlock(&ifindex_lock);
+}
+
+/*
+ * remove interface from lookup index before it is freed
+ */
+void capi_interface_index_remove(struct capi_pvt *i)
+{
+	cc_mutex_lock(&ifindex_lock);
+	capi_interface_index_unlink(i);
+	cc_mutex_unlock(&ifindex_lock);
+}
+
 /*
  * find the interface (pvt) the PLCI belongs to
  */
@@ -483,17 +1050,12 @@ struct capi_pvt *capi_find_interface_by_plci(unsigned int plci)
 	if (unlikely(plci == 0))
 		return NULL;
 
-	for (i = capi_iflist; i; i = i->next) {
-		if (i->PLCI == plci)
-			return i;
-	}
-
-	cc_mutex_lock(&nullif_lock);
-	for (i = nulliflist; i; i = i->next) {
+	cc_mutex_lock(&ifindex_lock);
+	for (i = plci_hash[capi_plci_hash(plci)]; i; i = i->plci_hash_next) {
 		if (i->PLCI == plci)
 			break;
 	}
-	cc_mutex_unlock(&nullif_lock);
+	cc_mutex_unlock(&ifindex_lock);
 
 	return i;
 }
@@ -508,17 +1070,12 @@ struct capi_pvt *capi_find_interface_by_msgnum(unsigned short msgnum)
 	if (msgnum == 0x0000)
 		return NULL;
 
-	for (i = capi_iflist; i; i = i->next) {
-	    if ((i->PLCI == 0) && (i->MessageNumber == msgnum))
-			return i;
-	}
-
-	cc_mutex_lock(&nullif_lock);
-	for (i = nulliflist; i; i = i->next) {
-	    if ((i->PLCI == 0) && (i->MessageNumber == msgnum))
+	cc_mutex_lock(&ifindex_lock);
+	for (i = msgnum_hash[capi_msgnum_hash(msgnum)]; i; i = i->msgnum_hash_next) {
+		if ((i->PLCI == 0) && (i->MessageNumber == msgnum))
 			break;
 	}
-	cc_mutex_unlock(&nullif_lock);
+	cc_mutex_unlock(&ifindex_lock);
 
 	return i;
 }
@@ -550,6 +1107,18 @@ MESSAGE_EXCHANGE_ERROR capi_wait_conf(struct capi_pvt *i, unsigned short wCmd)
 	return error;
 }
 
+/*
+ * readable string of a capi message in the buffer of the caller
+ */
+char *capi_cmsg2str_buf(_cmsg *CMSG, char *buf, size_t size)
+{
+#ifdef capi20_cmsg2str_r
+	return capi_cmsg2str_r(CMSG, buf, size);
+#else
+	return capi_cmsg2str(CMSG);
+#endif
+}
+
 /*
  * log an error in sending capi message
  */
@@ -557,80 +1126,530 @@ static void log_capi_error_message(MESSAGE_EXCHANGE_ERROR err, unsigned char* ms
 {
 	if (err) {
 		_cmsg _CMSG, *CMSG = &_CMSG;
+		char msgstr[CAPI_MSGSTR_SIZE];
 
 		capi_message2cmsg(CMSG, msg);
 		cc_log(LOG_ERROR, "CAPI error sending %s (NCCI=%#x) (error=%#x %s)\n",
-			capi_cmsg2str(CMSG), (unsigned int)HEADER_CID(CMSG),
+			capi_cmsg2str_buf(CMSG, msgstr, sizeof(msgstr)), (unsigned int)HEADER_CID(CMSG),
 			err, capi_info_string((unsigned int)err));
 	}
 }
 
 /*
- * log verbose a capi message
+ * log verbose a capi message, the level is checked by the caller
  */
-static void log_capi_message(_cmsg *CMSG)
+static void log_capi_message(unsigned char *msg)
 {
-	unsigned short wCmd;
+	_cmsg CMSG;
+	char msgstr[CAPI_MSGSTR_SIZE];
 
-	wCmd = HEADER_CMD(CMSG);
-	if ((wCmd == CAPI_P_REQ(DATA_B3)) ||
-	    (wCmd == CAPI_P_RESP(DATA_B3))) {
-		cc_verbose(7, 1, "%s\n", capi_cmsg2str(CMSG));
-	} else {
-		cc_verbose(4, 1, "%s\n", capi_cmsg2str(CMSG));
+	capi_message2cmsg(&CMSG, msg);
+	cc_verbose_internal("%s\n", capi_cmsg2str_buf(&CMSG, msgstr, sizeof(msgstr)));
+}
+
+/*
+ * Messages put by a thread inside capi_put_batch_begin()/capi_put_batch_end()
+ * are collected and written to the capi device together. Each thread
+ * has its own batch, a message put without batching flushes the batch
+ * of its thread first, so the messages of a thread keep their order.
+ * DATA_B3_REQ is never batched, the caller needs its real result
+ * to account the block in the B3 window.
+ */
+#ifdef CAPI20EXT_PUT_MESSAGES_MAX
+#define CAPI_PUT_BATCH_MAX      CAPI20EXT_PUT_MESSAGES_MAX
+#else
+#define CAPI_PUT_BATCH_MAX      16
+#endif
+#define CAPI_PUT_BATCH_BUFSIZE  4096
+
+static __thread struct {
+	int depth;
+	unsigned int count;
+	unsigned int used;
+	unsigned char *msg[CAPI_PUT_BATCH_MAX];
+	unsigned char buffer[CAPI_PUT_BATCH_BUFSIZE];
+} capi_put_batch;
+
+/* protected by capi_put_lock */
+static unsigned long capi_put_batch_flushes;
+static unsigned long capi_put_batch_messages;
+
+/*
+ * write pending messages of this thread, capi_put_lock must be held
+ */
+static void capi_put_batch_flush(void)
+{
+	MESSAGE_EXCHANGE_ERROR error = 0;
+	unsigned int sent = 0;
+	unsigned int n;
+
+	if (capi_put_batch.count == 0) {
+		return;
+	}
+
+#ifdef CAPI20EXT_PUT_MESSAGES_MAX
+	error = capi20ext_put_messages(capi_ApplID, capi_put_batch.msg,
+		capi_put_batch.count, &sent);
+#else
+	for (sent = 0; sent < capi_put_batch.count; sent++) {
+		if ((error = capi20_put_message(capi_ApplID, capi_put_batch.msg[sent])) != 0)
+			break;
+	}
+#endif
+	if (error) {
+		/* the failed message, all following are dropped */
+		for (n = sent; n < capi_put_batch.count; n++) {
+			log_capi_error_message(error, capi_put_batch.msg[n]);
+		}
+	}
+
+	capi_put_batch_flushes++;
+	capi_put_batch_messages += capi_put_batch.count;
+	capi_put_batch.count = 0;
+	capi_put_batch.used = 0;
+}
+
+/*
+ * start collecting messages of this thread
+ */
+void capi_put_batch_begin(void)
+{
+	capi_put_batch.depth++;
+}
+
+/*
+ * write the collected messages of this thread
+ */
+void capi_put_batch_end(void)
+{
+	if ((capi_put_batch.depth != 0) && (--capi_put_batch.depth == 0) &&
+	    (capi_put_batch.count != 0)) {
+		cc_mutex_lock(&capi_put_lock);
+		capi_put_batch_flush();
+		cc_mutex_unlock(&capi_put_lock);
+	}
+}
+
+/*
+ * get batching statistics
+ */
+void capi_put_batch_stats(unsigned long *flushes, unsigned long *messages)
+{
+	cc_mutex_lock(&capi_put_lock);
+	*flushes = capi_put_batch_flushes;
+	*messages = capi_put_batch_messages;
+	cc_mutex_unlock(&capi_put_lock);
+}
+
+/*
+ * Timer wheel for timeouts of interfaces and other objects. The timers are
+ * run by the CAPI device thread, callbacks are called without timer_lock.
+ * Each slot holds the timers expiring in one tick, longer timeouts stay in
+ * their slot until the wheel has turned often enough.
+ * A stopped timer is never called afterwards, but its callback may be
+ * running already; objects freed by other threads must therefore use
+ * capi_timer_stop_sync() or a callback which does not use the timer.
+ */
+#define CAPI_TIMER_TICK         10  /* ms */
+#define CAPI_TIMER_WHEEL_SIZE  256  /* must be power of two */
+
+AST_MUTEX_DEFINE_STATIC(timer_lock);
+static struct capi_timer *timer_wheel[CAPI_TIMER_WHEEL_SIZE];
+static struct capi_timer *timer_expired;    /* expired, callback not called yet */
+static unsigned long long timer_tick;       /* first tick not completely run */
+static unsigned long long timer_next;       /* earliest expiry, 0 if none */
+static struct capi_timer *timer_running;
+static ast_cond_t timer_done;               /* signalled when timer_running is cleared */
+static pthread_t timer_thread;
+
+void capi_timer_init_module(void)
+{
+	ast_cond_init(&timer_done, NULL);
+}
+
+/*
+ * monotonic time in ms
+ */
+unsigned long long capi_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000);
+}
+
+static void capi_timer_unlink(struct capi_timer *t)
+{
+	if (t->pprev != NULL) {
+		if (t->next != NULL) {
+			t->next->pprev = t->pprev;
+		}
+		*t->pprev = t->next;
+		t->next = NULL;
+		t->pprev = NULL;
+	}
+}
+
+/*
+ * setup a timer, must be called before first use
+ */
+void capi_timer_init(struct capi_timer *t, void (*func)(void *data), void *data)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->func = func;
+	t->data = data;
+}
+
+/*
+ * (re)arm a timer to expire in ms milliseconds
+ */
+void capi_timer_start(struct capi_timer *t, unsigned int ms)
+{
+	struct capi_timer **slot;
+	unsigned long long now = capi_timer_now();
+	unsigned long long tick;
+
+	cc_mutex_lock(&timer_lock);
+	capi_timer_unlink(t);
+
+	if (timer_tick == 0) {
+		timer_tick = now / CAPI_TIMER_TICK;
+	}
+	t->expires = now + ms;
+	tick = t->expires / CAPI_TIMER_TICK;
+	if (tick < timer_tick) {
+		/* slot of this tick was already run */
+		tick = timer_tick;
+	}
+	slot = &timer_wheel[tick & (CAPI_TIMER_WHEEL_SIZE - 1)];
+	t->next = *slot;
+	if (t->next != NULL) {
+		t->next->pprev = &t->next;
+	}
+	t->pprev = slot;
+	*slot = t;
+
+	if ((timer_next == 0) || (t->expires < timer_next)) {
+		timer_next = t->expires;
+	}
+	cc_mutex_unlock(&timer_lock);
+}
+
+/*
+ * disarm a timer, the callback may still be running in the device thread
+ */
+void capi_timer_stop(struct capi_timer *t)
+{
+	cc_mutex_lock(&timer_lock);
+	capi_timer_unlink(t);
+	cc_mutex_unlock(&timer_lock);
+}
+
+/*
+ * disarm a timer and wait for a running callback, needed before
+ * the object of the timer is freed. Must not be called with a lock
+ * the callback takes.
+ */
+void capi_timer_stop_sync(struct capi_timer *t)
+{
+	cc_mutex_lock(&timer_lock);
+	capi_timer_unlink(t);
+	while ((timer_running == t) && (!pthread_equal(timer_thread, pthread_self()))) {
+		ast_cond_wait(&timer_done, &timer_lock);
+	}
+	cc_mutex_unlock(&timer_lock);
+}
+
+/*
+ * run all expired timers
+ */
+void capi_timer_run(void)
+{
+	struct capi_timer *t;
+	void (*func)(void *data);
+	void *data;
+	unsigned long long now = capi_timer_now();
+	unsigned long long now_tick = now / CAPI_TIMER_TICK;
+	unsigned long long next = 0;
+	unsigned int n;
+	int found;
+
+	cc_mutex_lock(&timer_lock);
+	timer_thread = pthread_self();
+
+	if ((timer_next == 0) || (timer_next > now)) {
+		cc_mutex_unlock(&timer_lock);
+		return;
+	}
+
+	/* visit each slot at most once */
+	if ((now_tick - timer_tick) >= CAPI_TIMER_WHEEL_SIZE) {
+		timer_tick = now_tick - (CAPI_TIMER_WHEEL_SIZE - 1);
+	}
+	for (; timer_tick <= now_tick; timer_tick++) {
+		struct capi_timer *tnext;
+
+		for (t = timer_wheel[timer_tick & (CAPI_TIMER_WHEEL_SIZE - 1)]; t; t = tnext) {
+			tnext = t->next;
+			if (t->expires <= now) {
+				capi_timer_unlink(t);
+				t->next = timer_expired;
+				if (t->next != NULL) {
+					t->next->pprev = &t->next;
+				}
+				t->pprev = &timer_expired;
+				timer_expired = t;
+			}
+		}
+	}
+	/* the current tick is not over, timers later in it are seen next time */
+	timer_tick = now_tick;
+
+	/*
+	 * find the next expiry, the first slot from the current tick on with
+	 * a timer of this turn of the wheel holds it. Timers of later turns
+	 * seen on the way expire after it anyway.
+	 */
+	for (n = 0; n < CAPI_TIMER_WHEEL_SIZE; n++) {
+		found = 0;
+		for (t = timer_wheel[(timer_tick + n) & (CAPI_TIMER_WHEEL_SIZE - 1)]; t; t = t->next) {
+			if ((next == 0) || (t->expires < next)) {
+				next = t->expires;
+			}
+			if ((t->expires / CAPI_TIMER_TICK) <= (timer_tick + n)) {
+				found = 1;
+			}
+		}
+		if (found) {
+			break;
+		}
+	}
+	timer_next = next;
+
+	while ((t = timer_expired) != NULL) {
+		capi_timer_unlink(t);
+		func = t->func;
+		data = t->data;
+		timer_running = t;
+		cc_mutex_unlock(&timer_lock);
+		func(data);
+		cc_mutex_lock(&timer_lock);
+		timer_running = NULL;
+		ast_cond_broadcast(&timer_done);
+	}
+	cc_mutex_unlock(&timer_lock);
+}
+
+/*
+ * time in ms until the next timer expires, at most max_ms
+ */
+unsigned int capi_timer_next_timeout(unsigned int max_ms)
+{
+	unsigned long long now;
+	unsigned int ms = max_ms;
+
+	cc_mutex_lock(&timer_lock);
+	if (timer_next != 0) {
+		now = capi_timer_now();
+		if (timer_next <= now) {
+			ms = 0;
+		} else if ((timer_next - now) < max_ms) {
+			ms = (unsigned int)(timer_next - now);
+		}
 	}
+	cc_mutex_unlock(&timer_lock);
+
+	return ms;
 }
 
 /*
  * write a capi message to capi device
  */
-static MESSAGE_EXCHANGE_ERROR _capi_put_msg(unsigned char *msg)
+static MESSAGE_EXCHANGE_ERROR _capi_put_msg(unsigned char *msg, int nobatch)
 {
-	MESSAGE_EXCHANGE_ERROR error;
-	_cmsg CMSG;
+	MESSAGE_EXCHANGE_ERROR error = 0;
+	unsigned int len = read_capi_word(&msg[0]);
 	
 	if (cc_mutex_lock(&capi_put_lock)) {
 		cc_log(LOG_WARNING, "Unable to lock chan_capi put!\n");
 		return -1;
 	} 
 
-	if (cc_verbose_check(4, 1) != 0) {
-		capi_message2cmsg(&CMSG, msg);
-		log_capi_message(&CMSG);
+	if (cc_verbose_check(capi_msg_verbose_level(msg[4]), 1) != 0) {
+		log_capi_message(msg);
+	}
+
+	if ((!nobatch) && (capi_put_batch.depth != 0) &&
+	    (!((msg[4] == CAPI_DATA_B3) && (msg[5] == CAPI_REQ)))) {
+		if ((capi_put_batch.count == CAPI_PUT_BATCH_MAX) ||
+		    ((capi_put_batch.used + len) > CAPI_PUT_BATCH_BUFSIZE)) {
+			capi_put_batch_flush();
+		}
+		if (len <= CAPI_PUT_BATCH_BUFSIZE) {
+			unsigned char *p = &capi_put_batch.buffer[capi_put_batch.used];
+
+			memcpy(p, msg, len);
+			capi_put_batch.msg[capi_put_batch.count++] = p;
+			capi_put_batch.used += (len + 7) & ~7U;
+			msg = NULL;
+		}
+	} else {
+		capi_put_batch_flush();
 	}
 
-	error = capi20_put_message(capi_ApplID, msg);
+	if (msg != NULL) {
+		error = capi20_put_message(capi_ApplID, msg);
+		capi_put_batch_flushes++;
+		capi_put_batch_messages++;
+	}
 	
 	if (cc_mutex_unlock(&capi_put_lock)) {
 		cc_log(LOG_WARNING, "Unable to unlock chan_capi put!\n");
 		return -1;
 	}
 
-	log_capi_error_message(error, msg);
+	if (msg != NULL) {
+		log_capi_error_message(error, msg);
+	}
 
 	return error;
 }
 
+/*
+ * decode a received capi message. DATA_B3_IND/CONF, which are most of
+ * the traffic, have a fixed layout and only the fields used by the
+ * handlers are read. They are decoded completely if they are logged.
+ */
+void capidev_message2cmsg(_cmsg *CMSG, unsigned char *msg)
+{
+	if ((msg[4] != CAPI_DATA_B3) ||
+	    ((msg[5] != CAPI_IND) && (msg[5] != CAPI_CONF)) ||
+	    (cc_verbose_check(7, 1) != 0)) {
+		capi_message2cmsg(CMSG, msg);
+		return;
+	}
+
+	CMSG->m = msg;
+	CMSG->l = read_capi_word(&msg[0]);
+	CMSG->ApplId = read_capi_word(&msg[2]);
+	CMSG->Command = msg[4];
+	CMSG->Subcommand = msg[5];
+	CMSG->Messagenumber = read_capi_word(&msg[6]);
+	CMSG->adr.adrNCCI = read_capi_dword(&msg[8]);
+
+	if (msg[5] == CAPI_CONF) {
+		CMSG->DataHandle = read_capi_word(&msg[12]);
+		CMSG->Info = read_capi_word(&msg[14]);
+		return;
+	}
+
+	CMSG->DataLength = read_capi_word(&msg[16]);
+	CMSG->DataHandle = read_capi_word(&msg[18]);
+	CMSG->Flags = read_capi_word(&msg[20]);
+	if (sizeof(void *) > 4) {
+		memcpy(&CMSG->Data, &msg[22], sizeof(void *));
+	} else {
+		CMSG->Data = (void *)(unsigned long)read_capi_dword(&msg[12]);
+	}
+}
+
+/*
+ * Other threads end the wait of the CAPI device thread for the next capi
+ * message with a byte in the wakeup pipe, e.g. a Diva stream with data to
+ * publish before the next poll. Only one byte is pending at a time.
+ */
+static int capidev_wakeup_fds[2] = { -1, -1 };
+static volatile int capidev_wakeup_pending;
+
+int capidev_wakeup_init(void)
+{
+	int n, flags;
+
+	if (pipe(capidev_wakeup_fds) != 0) {
+		cc_log(LOG_ERROR, "Unable to create CAPI device wakeup pipe\n");
+		capidev_wakeup_fds[0] = -1;
+		capidev_wakeup_fds[1] = -1;
+		return -1;
+	}
+	for (n = 0; n < 2; n++) {
+		flags = fcntl(capidev_wakeup_fds[n], F_GETFL);
+		fcntl(capidev_wakeup_fds[n], F_SETFL, flags | O_NONBLOCK);
+	}
+	capidev_wakeup_pending = 0;
+	return 0;
+}
+
+void capidev_wakeup_cleanup(void)
+{
+	int n;
+
+	for (n = 0; n < 2; n++) {
+		if (capidev_wakeup_fds[n] != -1) {
+			close(capidev_wakeup_fds[n]);
+			capidev_wakeup_fds[n] = -1;
+		}
+	}
+}
+
+/*
+ * end the wait of the CAPI device thread
+ */
+void capidev_wakeup(void)
+{
+	if ((capidev_wakeup_fds[1] != -1) &&
+	    (__sync_lock_test_and_set(&capidev_wakeup_pending, 1) == 0)) {
+		if (write(capidev_wakeup_fds[1], "", 1) != 1) {
+			cc_log(LOG_ERROR, "Unable to wake CAPI device thread, errno:%d\n", errno);
+		}
+	}
+}
+
+/*
+ * wait for a capi message or a wakeup, 0x1104 if no message is there
+ */
+static MESSAGE_EXCHANGE_ERROR capidev_wait_message(struct timeval *tv)
+{
+	struct pollfd fds[2];
+	unsigned char dummy[16];
+
+	fds[0].fd = capi20_fileno(capi_ApplID);
+	if ((fds[0].fd < 0) || (capidev_wakeup_fds[0] == -1)) {
+		return capi20_waitformessage(capi_ApplID, tv);
+	}
+	fds[0].events = POLLIN;
+	fds[1].fd = capidev_wakeup_fds[0];
+	fds[1].events = POLLIN;
+
+	if (poll(fds, 2, (tv->tv_sec * 1000) + (tv->tv_usec / 1000)) <= 0) {
+		return 0x1104;
+	}
+	if (fds[1].revents & POLLIN) {
+		__sync_lock_release(&capidev_wakeup_pending);
+		while (read(capidev_wakeup_fds[0], dummy, sizeof(dummy)) > 0);
+	}
+	if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+		return 0x0000;
+	}
+	return 0x1104;
+}
+
 /*
  * wait some time for a new capi message
  */
-MESSAGE_EXCHANGE_ERROR capidev_check_wait_get_cmsg(_cmsg *CMSG)
+static MESSAGE_EXCHANGE_ERROR capidev_wait_get_cmsg(_cmsg *CMSG, struct timeval *tv)
 {
 	MESSAGE_EXCHANGE_ERROR Info;
-	struct timeval tv;
+	unsigned char *msg;
 
-	tv.tv_sec = 0;
-#ifdef DIVA_STREAMING
-	tv.tv_usec = 5000;
-#else
-	tv.tv_usec = 500000;
-#endif
-
-	Info = capi20_waitformessage(capi_ApplID, &tv);
+	Info = capidev_wait_message(tv);
 
 	if (Info == 0x0000) {
-		
-		Info = capi_get_cmsg(CMSG, capi_ApplID);
+		Info = capi20_get_message(capi_ApplID, &msg);
+		if (Info == 0x0000) {
+			capidev_message2cmsg(CMSG, msg);
+		}
 
 #if (CAPI_OS_HINT == 1) || (CAPI_OS_HINT == 2)
 		if (Info == 0x0000) {
@@ -644,13 +1663,148 @@ MESSAGE_EXCHANGE_ERROR capidev_check_wait_get_cmsg(_cmsg *CMSG)
 #endif
 	}
 
-	if ((Info != 0x0000) && (Info != 0x1104)) {
-		if (capidebug) {
-			cc_log(LOG_DEBUG, "Error waiting for cmsg... INFO = %#x\n", Info);
+	return Info;
+}
+
+/*
+ * time to wait for the next capi message
+ */
+static unsigned int capidev_wait_timeout(void)
+{
+#ifdef DIVA_STREAMING
+	/*
+	 * Diva streams have no receive notification, their shared memory is
+	 * polled after each wakeup, but only as long as there are streams at
+	 * all. A new stream is always followed by the confirmation of its
+	 * MANUFACTURER_REQ, which ends a longer wait. Written data is flushed
+	 * with the first poll after its delay.
+	 */
+	if (capi_DivaStreamingScheduled() != 0)
+		return capi_timer_next_timeout(capi_DivaStreamingPollTimeout());
+#endif
+	return capi_timer_next_timeout(500);
+}
+
+MESSAGE_EXCHANGE_ERROR capidev_check_wait_get_cmsg(_cmsg *CMSG)
+{
+	MESSAGE_EXCHANGE_ERROR Info;
+	struct timeval tv;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = capidev_wait_timeout() * 1000;
+
+	Info = capidev_wait_get_cmsg(CMSG, &tv);
+
+	if ((Info != 0x0000) && (Info != 0x1104)) {
+		if (capidebug) {
+			cc_log(LOG_DEBUG, "Error waiting for cmsg... INFO = %#x\n", Info);
+		}
+	}
+    
+	return Info;
+}
+
+/*
+ * get a capi message if one is already queued, do not wait
+ */
+MESSAGE_EXCHANGE_ERROR capidev_check_get_cmsg(_cmsg *CMSG)
+{
+	struct timeval tv;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+
+	return capidev_wait_get_cmsg(CMSG, &tv);
+}
+
+/*
+ * wait some time for a new capi message and return a private copy of it,
+ * which is decoded later by a dispatch worker. DATA_B3_IND data is copied
+ * behind the message and answered here, so all buffer handling of libcapi20
+ * stays in the calling thread. The copy must be freed with ast_free().
+ */
+MESSAGE_EXCHANGE_ERROR capidev_check_wait_get_rawmsg(struct capi_rawmsg **copy)
+{
+	MESSAGE_EXCHANGE_ERROR Info;
+	struct timeval tv;
+	struct capi_rawmsg *raw;
+	unsigned char *msg, *p;
+	unsigned int len, datalen = 0;
+	_cword datahandle = 0;
+	int data_b3_ind;
+
+	*copy = NULL;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = capidev_wait_timeout() * 1000;
+
+	Info = capidev_wait_message(&tv);
+	if (Info != 0x0000) {
+		return Info;
+	}
+
+	if ((Info = capi20_get_message(capi_ApplID, &msg)) != 0x0000) {
+		if ((Info != 0x1104) && (capidebug)) {
+			cc_log(LOG_DEBUG, "Error waiting for cmsg... INFO = %#x\n", Info);
+		}
+		return Info;
+	}
+
+	len = read_capi_word(&msg[0]);
+	data_b3_ind = ((msg[4] == CAPI_DATA_B3) && (msg[5] == CAPI_IND));
+	if (data_b3_ind) {
+		datalen = read_capi_word(&msg[16]);
+		datahandle = read_capi_word(&msg[18]);
+	}
+
+	raw = ast_malloc(sizeof(*raw) + len + datalen + 8);
+	if (raw == NULL) {
+		cc_log(LOG_ERROR, "Unable to allocate dispatch message buffer\n");
+		return 0x1108; /* OS resource error */
+	}
+	raw->next = NULL;
+	p = raw->msg;
+	memcpy(p, msg, len);
+
+	if (data_b3_ind) {
+		void *data = p + len;
+		void *src;
+
+		if (sizeof(void *) > 4) {
+			memcpy(&src, &msg[22], sizeof(void *));
+			memcpy(data, src, datalen);
+			memcpy(&p[22], &data, sizeof(void *));
+		} else {
+			src = (void *)(unsigned long)read_capi_dword(&msg[12]);
+			memcpy(data, src, datalen);
+			write_capi_dword(&p[12], (unsigned int)(unsigned long)data);
 		}
 	}
-    
-	return Info;
+
+#if (CAPI_OS_HINT == 1) || (CAPI_OS_HINT == 2)
+	/*
+	 * For BSD allow controller 0:
+	 */
+	if (p[8] == 0) {
+		p[8] += capi_num_controllers;
+	}
+#endif
+
+	if (data_b3_ind) {
+		/* send a DATA_B3_RESP very quickly to free the buffer in capi */
+		capi_send_data_b3_resp(read_capi_dword(&p[8]), read_capi_word(&p[6]), datahandle);
+	}
+
+	*copy = raw;
+	return 0x0000;
+}
+
+/*
+ * write a capi message built by one of the capi_send_* encoders
+ */
+MESSAGE_EXCHANGE_ERROR capi_put_msg(unsigned char *msg)
+{
+	return _capi_put_msg(msg, 0);
 }
 
 /*
@@ -663,116 +1817,27 @@ MESSAGE_EXCHANGE_ERROR capi_sendf(
 	_cword command, _cdword Id, _cword Number, char * format, ...)
 {
 	MESSAGE_EXCHANGE_ERROR ret;
-	int i, j;
-	unsigned int d;
-	unsigned char *p, *p_length;
-	unsigned char *string;
-	unsigned short header_length;
+	int len, format_errors;
 	va_list ap;
-	capi_prestruct_t *s;
 	unsigned char msg[2048];
 
-	write_capi_word(&msg[2], capi_ApplID);
-	msg[4] = (unsigned char)((command >> 8) & 0xff);
-	msg[5] = (unsigned char)(command & 0xff);
-	write_capi_word(&msg[6], Number);
-	write_capi_dword(&msg[8], Id);
-
-	p = &msg[12];
-	p_length = 0;
-
 	va_start(ap, format);
-	for (i = 0; format[i]; i++) {
-		if (unlikely(((p - (&msg[0])) + 12) >= sizeof(msg))) {
-			cc_log(LOG_ERROR, "capi_sendf: message too big (%d)\n",
-				(int)(p - (&msg[0])));
-			return 0x1004;
-		}
-		switch(format[i]) {
-		case 'b': /* byte */
-			d = (unsigned char)va_arg(ap, unsigned int);
-			*(p++) = (unsigned char) d;
-			break;
-		case 'w': /* word (2 bytes) */
-			d = (unsigned short)va_arg(ap, unsigned int);
-			*(p++) = (unsigned char) d;
-			*(p++) = (unsigned char)(d >> 8);
-			break;
-		case 'd': /* double word (4 bytes) */
-			d = va_arg(ap, unsigned int);
-			*(p++) = (unsigned char) d;
-			*(p++) = (unsigned char)(d >> 8);
-			*(p++) = (unsigned char)(d >> 16);
-			*(p++) = (unsigned char)(d >> 24);
-			break;
-		case 's': /* struct, length is the first byte */
-			string = va_arg(ap, unsigned char *);
-			if (string == NULL) {
-				*(p++) = 0;
-			} else {
-				for (j = 0; j <= string[0]; j++)
-					*(p++) = string[j];
-			}
-			break;
-		case 'a': /* ascii string, NULL terminated string */
-			string = va_arg(ap, unsigned char *);
-			for (j = 0; string[j] != '\0'; j++)
-				*(++p) = string[j];
-			*((p++)-j) = (unsigned char) j;
-			break;
-		case 'c': /* predefined capi_prestruct_t */
-			s = va_arg(ap, capi_prestruct_t *);
-			if (s->wLen < 0xff) {
-				*(p++) = (unsigned char)(s->wLen);
-			} else	{
-				*(p++) = 0xff;
-				*(p++) = (unsigned char)(s->wLen);
-				*(p++) = (unsigned char)(s->wLen >> 8);
-			}
-			for (j = 0; j < s->wLen; j++)
-				*(p++) = s->info[j];
-			break;
-		case '(': /* begin of a structure */
-			*p = (p_length) ? p - p_length : 0;
-			p_length = p++;
-			break;
-		case ')': /* end of structure */
-			if (p_length) {
-				j = *p_length;
-				*p_length = (unsigned char)((p - p_length) - 1);
-				p_length = (j != 0) ? p_length - j : 0;
-			} else {
-				cc_log(LOG_ERROR, "capi_sendf: inconsistent format \"%s\"\n",
-					format);
-			}
-			break;
-		default:
-			cc_log(LOG_ERROR, "capi_sendf: unknown format \"%s\"\n",
-				format);
-		}
-	}
+	len = capi_encode_msgv(msg, sizeof(msg), command, Id, Number, format, ap,
+		&format_errors);
 	va_end(ap);
 
-	if (p_length) {
-		cc_log(LOG_ERROR, "capi_sendf: inconsistent format \"%s\"\n", format);
+	if (unlikely(len == CAPI_ENCODE_TOO_BIG)) {
+		cc_log(LOG_ERROR, "capi_sendf: message too big \"%s\"\n", format);
+		return 0x1004;
 	}
-
-	header_length = (unsigned short)(p - (&msg[0]));
-
-	if ((sizeof(void *) > 4) && (command == CAPI_DATA_B3_REQ)) {
-		void* req_data;
-		va_start(ap, format);
-		req_data = va_arg(ap, void *);
-		va_end(ap);
-
-		header_length += 8;
-		write_capi_dword(&msg[12], 0);
-		memcpy(&msg[22], &req_data, sizeof(void *));
+	if (format_errors & CAPI_ENCODE_UNKNOWN_FORMAT) {
+		cc_log(LOG_ERROR, "capi_sendf: unknown format \"%s\"\n", format);
+	}
+	if (format_errors & CAPI_ENCODE_INCONSISTENT) {
+		cc_log(LOG_ERROR, "capi_sendf: inconsistent format \"%s\"\n", format);
 	}
 
-	write_capi_word(&msg[0], header_length);
-
-	ret = _capi_put_msg(&msg[0]);
+	ret = _capi_put_msg(&msg[0], waitconf);
 	if ((!(ret)) && (waitconf)) {
 		ret = capi_wait_conf(capii, (command & 0xff00) | CAPI_CONF);
 	}
@@ -1300,6 +2365,24 @@ void capi_parse_dialstring(char *buffer, char **interface, char **dest, char **p
 	return;
 }
 
+/*
+ * remove a too old peer link entry
+ */
+static void cc_peer_link_timeout(void *data)
+{
+	int a = (int)(long)data;
+
+	cc_mutex_lock(&peerlink_lock);
+	/* the slot may have been taken and reused meanwhile */
+	if ((peerlinkchannel[a].channel != NULL) &&
+	    ((peerlinkchannel[a].age + CAPI_PEERLINK_TIMEOUT) <= capi_timer_now())) {
+		peerlinkchannel[a].channel = NULL;
+		cc_verbose(3, 1, VERBOSE_PREFIX_4 CC_MESSAGE_NAME
+			": peerlink %d timeout-erase\n", a);
+	}
+	cc_mutex_unlock(&peerlink_lock);
+}
+
 /*
  * Add a new peer link id
  */
@@ -1311,15 +2394,10 @@ int cc_add_peer_link_id(struct ast_channel *c)
 	for (a = 0; a < CAPI_MAX_PEERLINKCHANNELS; a++) {
 		if (peerlinkchannel[a].channel == NULL) {
 			peerlinkchannel[a].channel = c;
-			peerlinkchannel[a].age = time(NULL);
+			peerlinkchannel[a].age = capi_timer_now();
+			capi_timer_init(&peerlinkchannel[a].timer, cc_peer_link_timeout, (void *)(long)a);
+			capi_timer_start(&peerlinkchannel[a].timer, CAPI_PEERLINK_TIMEOUT);
 			break;
-		} else {
-			/* remove too old entries */
-			if ((peerlinkchannel[a].age + 60) < time(NULL)) {
-				peerlinkchannel[a].channel = NULL;
-				cc_verbose(3, 1, VERBOSE_PREFIX_4 CC_MESSAGE_NAME
-					": peerlink %d timeout-erase\n", a);
-			}
 		}
 	}
 	cc_mutex_unlock(&peerlink_lock);
@@ -1346,6 +2424,7 @@ struct ast_channel *cc_get_peer_link_id(const char *p)
 	if ((id >= 0) && (id < CAPI_MAX_PEERLINKCHANNELS)) {
 		chan = peerlinkchannel[id].channel;
 		peerlinkchannel[id].channel = NULL;
+		capi_timer_stop(&peerlinkchannel[id].timer);
 	}
 	if (chan) {
 #ifdef CC_AST_HAS_VERSION_11_0
@@ -1360,17 +2439,118 @@ struct ast_channel *cc_get_peer_link_id(const char *p)
 	return chan;
 }
 
+/*
+ * Frames are passed from the CAPI device thread to the PBX side of an
+ * interface through a ring of preallocated frame slots. The pipe is only
+ * used as doorbell, so the PBX can poll on the reader side: one byte is
+ * written when the ring becomes non-empty and is drained by the reader
+ * once the ring is empty again.
+ * Producers are serialized by writerlock, there is only one reader.
+ * A voice frame may also stay in the libcapi20 receive buffer of its
+ * DATA_B3_IND (held slot), the DATA_B3_RESP is sent when the reader
+ * releases the slot or when the NCCI goes away. At most b3blocks - 2
+ * slots of an interface are held, so the B3 window is never used up.
+ * Once a ring had a held slot, the reader takes writerlock too; so
+ * capi_frame_ring_revoke() knows which slot the PBX is reading.
+ * Voice frames can't take the last CAPI_FRAME_RING_CONTROL slots, so
+ * control frames still fit when a stalled reader let the voice pile up.
+ * A hangup which finds the ring full anyway is remembered in the ring
+ * and seen by the reader when the ring is empty.
+ */
+#define CAPI_FRAME_RING_SIZE     32 /* must be power of two */
+#define CAPI_FRAME_RING_CONTROL   8 /* slots kept for non-voice frames */
+
+struct capi_ring_frame {
+	struct ast_frame f;
+	volatile int held;          /* DATA_B3_RESP still to be sent */
+	unsigned char *held_data;   /* payload in receive buffer of libcapi20 */
+	_cdword held_ncci;
+	_cword held_msgnum;
+	_cword held_datahandle;
+	unsigned char *data;        /* datasize bytes of the ring data area */
+};
+
+struct capi_frame_ring {
+	volatile unsigned int head; /* next slot to fill, written by producer */
+	volatile unsigned int tail; /* next slot to read, written by consumer */
+	volatile int doorbell;      /* byte is pending in the pipe */
+	volatile int refs;          /* reader and writer side */
+	volatile int nheld;         /* held slots */
+	volatile int hangup;        /* hangup did not fit into the ring */
+	volatile int holding;       /* held slots were queued, reader locks */
+	int noholdlog;              /* logged that b3blocks is too small */
+	unsigned int dropped;       /* frames dropped, under writerlock */
+	time_t droplog;             /* last log of dropped frames */
+	int hold;                   /* slot at tail still in use by PBX */
+	int bellfd;                 /* own write side of the pipe */
+	int datasize;               /* space of a slot, max. B3 block */
+	cc_mutex_t writerlock;
+	struct capi_ring_frame slot[CAPI_FRAME_RING_SIZE];
+};
+
+/*
+ * answer the DATA_B3_IND of a held slot, whoever comes first.
+ * After the cleanup of the connection libcapi20 only frees the
+ * buffer and does not send the DATA_B3_RESP.
+ */
+static void capi_frame_ring_release(struct capi_frame_ring *r, struct capi_ring_frame *slot)
+{
+	if (__sync_bool_compare_and_swap(&slot->held, 1, 0)) {
+		__sync_sub_and_fetch(&r->nheld, 1);
+		capi_send_data_b3_resp(slot->held_ncci, slot->held_msgnum, slot->held_datahandle);
+	}
+}
+
+static void capi_frame_ring_unref(struct capi_frame_ring *r)
+{
+	int n;
+
+	if (__sync_sub_and_fetch(&r->refs, 1) == 0) {
+		for (n = 0; (r->nheld) && (n < CAPI_FRAME_RING_SIZE); n++) {
+			capi_frame_ring_release(r, &r->slot[n]);
+		}
+		if (r->bellfd != -1) {
+			close(r->bellfd);
+		}
+		cc_mutex_destroy(&r->writerlock);
+		ast_free(r);
+	}
+}
+
 /*
  * create pipe for interface connection
  */
 int capi_create_reader_writer_pipe(struct capi_pvt *i)
 {
 	int fds[2];
-	int flags;
+	int flags, n;
+	struct capi_frame_ring *r;
+	int datasize = capi_b3_maxblocksize + AST_FRIENDLY_OFFSET + RTP_HEADER_SIZE;
+	unsigned char *data;
+
+	datasize = (datasize + 15) & ~15;
+	r = ast_malloc(sizeof(*r) + (CAPI_FRAME_RING_SIZE * datasize));
+	if (r == NULL) {
+		cc_log(LOG_ERROR, "%s: unable to allocate frame ring.\n",
+			i->vname);
+		return 0;
+	}
+	memset(r, 0, offsetof(struct capi_frame_ring, slot));
+	r->datasize = datasize;
+	data = (unsigned char *)(r + 1);
+	for (n = 0; n < CAPI_FRAME_RING_SIZE; n++) {
+		r->slot[n].held = 0;
+		r->slot[n].held_data = NULL;
+		r->slot[n].data = data + (n * datasize);
+	}
+	r->refs = 2;
+	cc_mutex_init(&r->writerlock);
 
 	if (pipe(fds) != 0) {
 		cc_log(LOG_ERROR, "%s: unable to create pipe.\n",
 			i->vname);
+		cc_mutex_destroy(&r->writerlock);
+		ast_free(r);
 		return 0;
 	}
 	i->readerfd = fds[0];
@@ -1380,55 +2560,395 @@ int capi_create_reader_writer_pipe(struct capi_pvt *i)
 	flags = fcntl(i->writerfd, F_GETFL);
 	fcntl(i->writerfd, F_SETFL, flags | O_NONBLOCK);
 
+	r->bellfd = dup(i->writerfd);
+	if (r->bellfd == -1) {
+		cc_log(LOG_ERROR, "%s: unable to duplicate pipe.\n",
+			i->vname);
+		close(i->readerfd);
+		close(i->writerfd);
+		i->readerfd = -1;
+		i->writerfd = -1;
+		cc_mutex_destroy(&r->writerlock);
+		ast_free(r);
+		return 0;
+	}
+
+	i->reader_ring = r;
+	i->writer_ring = r;
+
 	return 1;
 }
 
+/*
+ * close reader and writer side of interface connection
+ */
+void capi_close_reader_writer_pipe(struct capi_pvt *i)
+{
+	if (i->readerfd != -1) {
+		close(i->readerfd);
+		i->readerfd = -1;
+	}
+	if (i->writerfd != -1) {
+		close(i->writerfd);
+		i->writerfd = -1;
+	}
+	if (i->reader_ring != NULL) {
+		capi_frame_ring_unref(i->reader_ring);
+		i->reader_ring = NULL;
+	}
+	if (i->writer_ring != NULL) {
+		capi_frame_ring_unref(i->writer_ring);
+		i->writer_ring = NULL;
+	}
+}
+
+/*
+ * pass the writer side of interface connection to another interface
+ */
+void capi_move_writer_pipe(struct capi_pvt *to, struct capi_pvt *from)
+{
+	to->writerfd = from->writerfd;
+	to->writer_ring = from->writer_ring;
+	from->writerfd = -1;
+	from->writer_ring = NULL;
+}
+
+/*
+ * queue a frame to the reader side
+ */
+int capi_write_pipeframe(struct capi_pvt *i, struct ast_frame *f)
+{
+	struct capi_frame_ring *r = i->writer_ring;
+	struct capi_ring_frame *slot;
+	unsigned int head, size;
+	int datalen = f->datalen;
+	time_t now;
+
+	if (unlikely(r == NULL)) {
+		return -1;
+	}
+
+	if (unlikely(datalen > (r->datasize - AST_FRIENDLY_OFFSET))) {
+		cc_log(LOG_ERROR, "%s: f.datalen(%d) greater than space of frame slot(%d)\n",
+			i->vname, datalen, r->datasize - AST_FRIENDLY_OFFSET);
+		datalen = r->datasize - AST_FRIENDLY_OFFSET;
+	}
+
+	size = (f->frametype == AST_FRAME_VOICE) ?
+		(CAPI_FRAME_RING_SIZE - CAPI_FRAME_RING_CONTROL) : CAPI_FRAME_RING_SIZE;
+
+	cc_mutex_lock(&r->writerlock);
+
+	head = r->head;
+	if (unlikely((head - r->tail) >= size)) {
+		if ((f->frametype == AST_FRAME_CONTROL) &&
+		    (FRAME_SUBCLASS_INTEGER(f->subclass) == AST_CONTROL_HANGUP)) {
+			r->hangup = 1;
+			cc_mutex_unlock(&r->writerlock);
+			if (__sync_lock_test_and_set(&r->doorbell, 1) == 0) {
+				if (write(r->bellfd, "", 1) != 1) {
+					cc_log(LOG_ERROR, "Could not write to pipe for %s fd:%d errno:%d\n",
+						i->vname, r->bellfd, errno);
+				}
+			}
+			return 0;
+		}
+		r->dropped++;
+		now = time(NULL);
+		if (now != r->droplog) {
+			r->droplog = now;
+			cc_mutex_unlock(&r->writerlock);
+			cc_log(LOG_WARNING, "Frame ring full for %s, dropping frame %d/%d (%u dropped)\n",
+				i->vname, f->frametype, FRAME_SUBCLASS_INTEGER(f->subclass), r->dropped);
+		} else {
+			cc_mutex_unlock(&r->writerlock);
+		}
+		return -1;
+	}
+
+	slot = &r->slot[head & (CAPI_FRAME_RING_SIZE - 1)];
+	memcpy(&slot->f, f, sizeof(struct ast_frame));
+	slot->f.datalen = datalen;
+	slot->held_data = NULL;
+	if (datalen != 0) {
+		memcpy(slot->data + AST_FRIENDLY_OFFSET, f->FRAME_DATA_PTR, datalen);
+	}
+
+	/* publish slot before the new head becomes visible */
+	__sync_synchronize();
+	r->head = head + 1;
+
+	cc_mutex_unlock(&r->writerlock);
+
+	if (__sync_lock_test_and_set(&r->doorbell, 1) == 0) {
+		if (write(r->bellfd, "", 1) != 1) {
+			cc_log(LOG_ERROR, "Could not write to pipe for %s fd:%d errno:%d\n",
+				i->vname, r->bellfd, errno);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * queue a voice frame to the reader side, leaving the data in the
+ * receive buffer of its DATA_B3_IND. Only some blocks of the B3 window
+ * are held, so the line keeps running if the PBX is slow to read.
+ * Returns -1 if the frame was not queued and the caller must answer
+ * the DATA_B3_IND.
+ */
+int capi_write_pipeframe_held(struct capi_pvt *i, struct ast_frame *f,
+	_cdword ncci, _cword msgnum, _cword datahandle)
+{
+	struct capi_frame_ring *r = i->writer_ring;
+	struct capi_ring_frame *slot;
+	unsigned int head;
+
+	if (r == NULL) {
+		return -1;
+	}
+	if (unlikely(i->b3blocks <= 2)) {
+		if (!r->noholdlog) {
+			r->noholdlog = 1;
+			cc_verbose(3, 0, VERBOSE_PREFIX_3 "%s: B3 window of %d blocks too small for rxzerocopy, "
+				"voice data is copied\n", i->vname, i->b3blocks);
+		}
+		return -1;
+	}
+	if (r->nheld >= (i->b3blocks - 2)) {
+		return -1;
+	}
+
+	cc_mutex_lock(&r->writerlock);
+
+	head = r->head;
+	if ((head - r->tail) >= (CAPI_FRAME_RING_SIZE - CAPI_FRAME_RING_CONTROL)) {
+		cc_mutex_unlock(&r->writerlock);
+		return -1;
+	}
+
+	slot = &r->slot[head & (CAPI_FRAME_RING_SIZE - 1)];
+	memcpy(&slot->f, f, sizeof(struct ast_frame));
+	slot->f.offset = 0;
+	slot->held_data = f->FRAME_DATA_PTR;
+	slot->held_ncci = ncci;
+	slot->held_msgnum = msgnum;
+	slot->held_datahandle = datahandle;
+	r->holding = 1;
+	__sync_add_and_fetch(&r->nheld, 1);
+	slot->held = 1;
+
+	/* publish slot before the new head becomes visible */
+	__sync_synchronize();
+	r->head = head + 1;
+
+	cc_mutex_unlock(&r->writerlock);
+
+	if (__sync_lock_test_and_set(&r->doorbell, 1) == 0) {
+		if (write(r->bellfd, "", 1) != 1) {
+			cc_log(LOG_ERROR, "Could not write to pipe for %s fd:%d errno:%d\n",
+				i->vname, r->bellfd, errno);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * take the next slot for a voice frame of up to len bytes, so the
+ * producer can write the data straight into the ring. Returns NULL if
+ * the ring is full. Otherwise writerlock stays held until the frame is
+ * queued with capi_write_pipeframe_publish().
+ */
+unsigned char *capi_write_pipeframe_reserve(struct capi_pvt *i, int len)
+{
+	struct capi_frame_ring *r = i->writer_ring;
+	unsigned int head;
+
+	if ((r == NULL) || (len > (r->datasize - AST_FRIENDLY_OFFSET))) {
+		return NULL;
+	}
+
+	cc_mutex_lock(&r->writerlock);
+
+	head = r->head;
+	if ((head - r->tail) >= (CAPI_FRAME_RING_SIZE - CAPI_FRAME_RING_CONTROL)) {
+		cc_mutex_unlock(&r->writerlock);
+		return NULL;
+	}
+
+	return r->slot[head & (CAPI_FRAME_RING_SIZE - 1)].data + AST_FRIENDLY_OFFSET;
+}
+
+/*
+ * queue the frame of the reserved slot, its data is already in place
+ */
+void capi_write_pipeframe_publish(struct capi_pvt *i, struct ast_frame *f)
+{
+	struct capi_frame_ring *r = i->writer_ring;
+	struct capi_ring_frame *slot;
+	unsigned int head = r->head;
+
+	slot = &r->slot[head & (CAPI_FRAME_RING_SIZE - 1)];
+	memcpy(&slot->f, f, sizeof(struct ast_frame));
+	slot->f.offset = AST_FRIENDLY_OFFSET;
+	slot->held_data = NULL;
+
+	/* publish slot before the new head becomes visible */
+	__sync_synchronize();
+	r->head = head + 1;
+
+	cc_mutex_unlock(&r->writerlock);
+
+	if (__sync_lock_test_and_set(&r->doorbell, 1) == 0) {
+		if (write(r->bellfd, "", 1) != 1) {
+			cc_log(LOG_ERROR, "Could not write to pipe for %s fd:%d errno:%d\n",
+				i->vname, r->bellfd, errno);
+		}
+	}
+}
+
+/*
+ * the NCCI (or all NCCIs of a PLCI) goes away: the data of held frames
+ * not read yet is copied into the ring and their DATA_B3_IND answered.
+ * The frame the PBX is reading stays held until the reader releases it,
+ * libcapi20 keeps its buffer until the DATA_B3_RESP.
+ */
+void capi_frame_ring_revoke(struct capi_pvt *i, _cdword id)
+{
+	struct capi_frame_ring *r = i->writer_ring;
+	struct capi_ring_frame *slot;
+	int n, inuse, len;
+
+	if ((r == NULL) || (r->nheld == 0)) {
+		return;
+	}
+
+	cc_mutex_lock(&r->writerlock);
+	inuse = (r->hold) ? (int)(r->tail & (CAPI_FRAME_RING_SIZE - 1)) : -1;
+	for (n = 0; n < CAPI_FRAME_RING_SIZE; n++) {
+		slot = &r->slot[n];
+		if ((n == inuse) || (!slot->held) ||
+		    ((slot->held_ncci != id) && ((slot->held_ncci & 0xffff) != id))) {
+			continue;
+		}
+		len = slot->f.datalen;
+		if (len > (r->datasize - AST_FRIENDLY_OFFSET)) {
+			len = r->datasize - AST_FRIENDLY_OFFSET;
+		}
+		if (len > 0) {
+			memcpy(slot->data + AST_FRIENDLY_OFFSET, slot->held_data, len);
+		}
+		slot->f.datalen = len;
+		slot->f.offset = AST_FRIENDLY_OFFSET;
+		slot->held_data = NULL;
+		capi_frame_ring_release(r, slot);
+	}
+	cc_mutex_unlock(&r->writerlock);
+}
+
+/*
+ * drain the doorbell if ring is empty, keep it set if frames are pending
+ */
+static void capi_frame_ring_doorbell(struct capi_pvt *i, struct capi_frame_ring *r)
+{
+	unsigned char dummy[16];
+
+	while (read(i->readerfd, dummy, sizeof(dummy)) > 0);
+
+	__sync_lock_release(&r->doorbell);
+	__sync_synchronize();
+
+	if ((r->head != r->tail) || (r->hangup)) {
+		if (__sync_lock_test_and_set(&r->doorbell, 1) == 0) {
+			if (write(r->bellfd, "", 1) != 1) {
+				cc_log(LOG_ERROR, "Could not write to pipe for %s fd:%d errno:%d\n",
+					i->vname, r->bellfd, errno);
+			}
+		}
+	}
+}
+
 /*
  * read a frame from the pipe
  */
 struct ast_frame *capi_read_pipeframe(struct capi_pvt *i)
 {
+	struct capi_frame_ring *r;
+	struct capi_ring_frame *slot;
 	struct ast_frame *f;
-	int readsize;
+	unsigned int tail;
+	int locked;
 
 	if (i == NULL) {
 		cc_log(LOG_ERROR, "channel has no interface\n");
 		return NULL;
 	}
-	if (i->readerfd == -1) {
+	if ((i->readerfd == -1) || (i->reader_ring == NULL)) {
 		cc_log(LOG_ERROR, "no readerfd\n");
 		return NULL;
 	}
+	r = i->reader_ring;
 
-	f = &i->f;
-	f->frametype = AST_FRAME_NULL;
-	FRAME_SUBCLASS_INTEGER(f->subclass) = 0;
+	locked = r->holding;
+	if (locked) {
+		cc_mutex_lock(&r->writerlock);
+	}
 
-	readsize = read(i->readerfd, f, sizeof(struct ast_frame));
-	if ((readsize != sizeof(struct ast_frame)) && (readsize > 0)) {
-		cc_log(LOG_ERROR, "did not read a whole frame (len=%d, err=%d)\n",
-			readsize, errno);
+	/* the frame returned last time is no longer used by the PBX */
+	tail = r->tail;
+	if (r->hold) {
+		r->hold = 0;
+		capi_frame_ring_release(r, &r->slot[tail & (CAPI_FRAME_RING_SIZE - 1)]);
+		__sync_synchronize();
+		r->tail = ++tail;
 	}
-	
+
+	if (tail == r->head) {
+		if (r->hangup) {
+			/* hangup which did not fit into the ring */
+			f = NULL;
+		} else {
+			capi_frame_ring_doorbell(i, r);
+			f = &ast_null_frame;
+		}
+		if (locked) {
+			cc_mutex_unlock(&r->writerlock);
+		}
+		return f;
+	}
+	__sync_synchronize();
+
+	if ((!locked) && (r->holding)) {
+		/* the first held slot was queued meanwhile */
+		locked = 1;
+		cc_mutex_lock(&r->writerlock);
+	}
+
+	slot = &r->slot[tail & (CAPI_FRAME_RING_SIZE - 1)];
+	f = &slot->f;
+	r->hold = 1;
+
+	if ((tail + 1) == r->head) {
+		capi_frame_ring_doorbell(i, r);
+	}
+
 	f->mallocd = 0;
 	f->FRAME_DATA_PTR = NULL;
 
 	if ((f->frametype == AST_FRAME_CONTROL) &&
 		(FRAME_SUBCLASS_INTEGER(f->subclass) == AST_CONTROL_HANGUP)) {
-		return NULL;
+		f = NULL;
+	} else if ((f->frametype == AST_FRAME_VOICE) && (f->datalen > 0)) {
+		if (slot->held_data != NULL) {
+			f->FRAME_DATA_PTR = slot->held_data;
+		} else {
+			f->FRAME_DATA_PTR = slot->data + AST_FRIENDLY_OFFSET;
+		}
 	}
 
-	if ((f->frametype == AST_FRAME_VOICE) && (f->datalen > 0)) {
-		if (f->datalen > sizeof(i->frame_data)) {
-			cc_log(LOG_ERROR, "f.datalen(%d) greater than space of frame_data(%d)\n",
-				f->datalen, (int)sizeof(i->frame_data));
-			f->datalen = sizeof(i->frame_data);
-		}
-		readsize = read(i->readerfd, i->frame_data + AST_FRIENDLY_OFFSET, f->datalen);
-		if (readsize != f->datalen) {
-			cc_log(LOG_ERROR, "did not read whole frame data\n");
-		}
-		f->FRAME_DATA_PTR = i->frame_data + AST_FRIENDLY_OFFSET;
+	if (locked) {
+		cc_mutex_unlock(&r->writerlock);
 	}
 	return f;
 }
@@ -1438,13 +2958,11 @@ struct ast_frame *capi_read_pipeframe(struct capi_pvt *i)
  */
 int capi_write_frame(struct capi_pvt *i, struct ast_frame *f)
 {
-	MESSAGE_EXCHANGE_ERROR error;
-	int j = 0;
 	unsigned char *buf;
-	struct ast_frame *fsmooth;
+	const unsigned char *data;
+	int len, n;
 	int txavg=0;
 	int ret = 0;
-	int B3Blocks = 1;
 
 	if (unlikely(!i)) {
 		cc_log(LOG_ERROR, "channel has no interface\n");
@@ -1502,134 +3020,85 @@ int capi_write_frame(struct capi_pvt *i, struct ast_frame *f)
 		return capi_write_rtp(i, f);
 	}
 
-	if (unlikely(i->B3count >= CAPI_MAX_B3_BLOCKS)) {
-		cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: B3count is full, dropping packet.\n",
-			i->vname);
-		return 0;
-	}
-
 	if (i->bproto == CC_BPROTO_VOCODER || (i->line_plci != 0 && i->line_plci->bproto == CC_BPROTO_VOCODER)) {
 #ifdef DIVA_STREAMING
-		capi_DivaStreamLock();
-		if (i->diva_stream_entry != 0) {
-			int written = 0, ready = 0;
-
-			B3Blocks = 0;
-			if ((ready = (i->diva_stream_entry->diva_stream_state == DivaStreamActive)) &&
-					(i->diva_stream_entry->diva_stream->get_tx_free (i->diva_stream_entry->diva_stream) > 2*CAPI_MAX_B3_BLOCK_SIZE+128)) {
-				written = i->diva_stream_entry->diva_stream->write (i->diva_stream_entry->diva_stream, 8U << 8 | DIVA_STREAM_MESSAGE_TX_IDI_REQUEST, f->FRAME_DATA_PTR, f->datalen);
-				i->diva_stream_entry->diva_stream->flush_stream(i->diva_stream_entry->diva_stream);
-			}
-			capi_DivaStreamUnLock ();
-
-			error = written != f->datalen;
-			if (unlikely(error != 0)) {
-				cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: stream is %s, dropping packet.\n", i->vname, (ready != 0) ? "full" : "not ready");
-			}
-		} else
+		if (capi_DivaStreamingWrite(i, f->FRAME_DATA_PTR, f->datalen) < 0)
 #endif
 		{
-#ifdef DIVA_STREAMING
-			capi_DivaStreamUnLock ();
-#endif
-			buf = &(i->send_buffer[(i->send_buffer_handle % CAPI_MAX_B3_BLOCKS) *
-				(CAPI_MAX_B3_BLOCK_SIZE + AST_FRIENDLY_OFFSET)]);
-			i->send_buffer_handle++;
-
-			memcpy (buf, f->FRAME_DATA_PTR, f->datalen);
-
-			error = capi_sendf(NULL, 0, CAPI_DATA_B3_REQ, i->NCCI, get_capi_MessageNumber(),
-				"dwww", buf, f->datalen, i->send_buffer_handle, 0);
-		}
-		if (likely(error == 0)) {
+			if (unlikely(f->datalen > capi_b3_regblocksize)) {
+				cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: frame too big for B3 block (len = %d).\n",
+					i->vname, f->datalen);
+				i->txdrops++;
+				return 0;
+			}
 			cc_mutex_lock(&i->lock);
-			i->B3count += B3Blocks;
-			i->B3q -= f->datalen;
-			if (i->B3q < 0)
-				i->B3q = 0;
+			memcpy(capi_b3_tx_slot(i), f->FRAME_DATA_PTR, f->datalen);
+			capi_b3_tx_commit(i, f->datalen);
 			cc_mutex_unlock(&i->lock);
 		}
 
 		return 0;
 	}
 
-	if ((!i->smoother) || (ast_smoother_feed(i->smoother, f) != 0)) {
-		cc_log(LOG_ERROR, "%s: failed to fill smoother\n", i->vname);
+	cc_mutex_lock(&i->lock);
+
+	if (unlikely((i->txformat != 0) &&
+	    (i->txformat != GET_FRAME_SUBCLASS_CODEC(f->subclass)))) {
+		cc_mutex_unlock(&i->lock);
+		cc_log(LOG_ERROR, "%s: transmit format changed, dropping frame\n", i->vname);
 		return 0;
 	}
+	i->txformat = GET_FRAME_SUBCLASS_CODEC(f->subclass);
 
-	for (fsmooth = ast_smoother_read(i->smoother);
-	     fsmooth != NULL;
-	     fsmooth = ast_smoother_read(i->smoother)) {
-		buf = &(i->send_buffer[(i->send_buffer_handle % CAPI_MAX_B3_BLOCKS) *
-			(CAPI_MAX_B3_BLOCK_SIZE + AST_FRIENDLY_OFFSET)]);
-		i->send_buffer_handle++;
+	/* assemble the frame bytes into B3 blocks directly in the send buffer,
+	   the lock keeps the block and its energy consistent with a reset */
+	data = f->FRAME_DATA_PTR;
+	len = f->datalen;
+
+	while (len > 0) {
+		buf = capi_b3_tx_slot(i);
+		n = i->b3blocksize - i->txfill;
+		if (n > len)
+			n = len;
 
 		if ((i->doES == 1) && (!capi_tcap_is_digital(i->transfercapability))) {
-			for (j = 0; j < fsmooth->datalen; j++) {
-				buf[j] = capi_reversebits[ ((unsigned char *)fsmooth->FRAME_DATA_PTR)[j] ]; 
-				if (capi_capability == AST_FORMAT_ULAW) {
-					txavg += abs( capiULAW2INT[capi_reversebits[ ((unsigned char*)fsmooth->FRAME_DATA_PTR)[j]]] );
-				} else {
-					txavg += abs( capiALAW2INT[capi_reversebits[ ((unsigned char*)fsmooth->FRAME_DATA_PTR)[j]]] );
-				}
-			}
-			txavg = txavg / j;
-			for(j = 0; j < ECHO_TX_COUNT - 1; j++) {
-				i->txavg[j] = i->txavg[j+1];
-			}
-			i->txavg[ECHO_TX_COUNT - 1] = txavg;
+			i->txenergy += capi_es_tx(buf + i->txfill, data, n, capi_line_magnitude);
 		} else {
 			if ((i->txgain == 1.0) || (capi_tcap_is_digital(i->transfercapability))) {
-				for (j = 0; j < fsmooth->datalen; j++) {
-					buf[j] = capi_reversebits[((unsigned char *)fsmooth->FRAME_DATA_PTR)[j]];
-				}
+				capi_reverse_bits(buf + i->txfill, data, n);
 			} else {
-				for (j = 0; j < fsmooth->datalen; j++) {
-					buf[j] = i->g.txgains[capi_reversebits[((unsigned char *)fsmooth->FRAME_DATA_PTR)[j]]];
-				}
+				capi_xform_bytes(buf + i->txfill, data, n, i->g.tx_xform);
 			}
 		}
-   
-		error = 1; 
-		if (i->B3q > 0) {
-#if defined(DIVA_STREAMING)
-			if (i->diva_stream_entry != 0) {
-				int written = 0, ready = 0;
-
-				B3Blocks = 0;
-				capi_DivaStreamLock();
-				if ((ready = (i->diva_stream_entry->diva_stream_state == DivaStreamActive)) &&
-						(i->diva_stream_entry->diva_stream->get_tx_free (i->diva_stream_entry->diva_stream) > 2*CAPI_MAX_B3_BLOCK_SIZE+128)) {
-					written = i->diva_stream_entry->diva_stream->write (i->diva_stream_entry->diva_stream, 8U << 8 | DIVA_STREAM_MESSAGE_TX_IDI_REQUEST, buf, fsmooth->datalen);
-					i->diva_stream_entry->diva_stream->flush_stream(i->diva_stream_entry->diva_stream);
-				}
-				capi_DivaStreamUnLock ();
+		i->txfill += n;
+		data += n;
+		len -= n;
 
-				error = written != fsmooth->datalen;
-				if (unlikely(error != 0)) {
-					cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: stream is %s, dropping packet.\n", i->vname, (ready != 0) ? "full" : "not ready");
-				}
-			} else
-#endif
-			{
-				error = capi_sendf(NULL, 0, CAPI_DATA_B3_REQ, i->NCCI, get_capi_MessageNumber(),
-					"dwww", buf, fsmooth->datalen, i->send_buffer_handle, 0);
-			}
-		} else {
-			cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: too much voice to send for NCCI=%#x\n",
-				i->vname, i->NCCI);
+		if (i->txfill < i->b3blocksize) {
+			/* partial block, completed by the next frame */
+			break;
 		}
 
-		if (likely(!error)) {
-			cc_mutex_lock(&i->lock);
-			i->B3count += B3Blocks;
-			i->B3q -= fsmooth->datalen;
-			if (i->B3q < 0)
-				i->B3q = 0;
-			cc_mutex_unlock(&i->lock);
+		/* block is complete */
+		i->txfill = 0;
+		if ((i->doES == 1) && (!capi_tcap_is_digital(i->transfercapability))) {
+			txavg = i->txenergy / i->b3blocksize;
+			i->txavg[i->txavgpos] = txavg;
+			i->txavgpos = (i->txavgpos + 1) % ECHO_TX_COUNT;
 		}
+		i->txenergy = 0;
+
+#if defined(DIVA_STREAMING)
+		if (capi_DivaStreamingWrite(i, buf, i->b3blocksize) >= 0) {
+			continue;
+		}
+#endif
+		/* queue the block, sent when the B3 window has a credit */
+		capi_b3_tx_commit(i, i->b3blocksize);
 	}
+
+	cc_mutex_unlock(&i->lock);
+
 	return ret;
 }
 
@@ -39,11 +39,102 @@ static inline int cc_verbose_check(int o_v, int c_d)
 	} \
 } while(0)
 
+/*
+ * verbose level for logging a capi message, DATA_B3 is only logged
+ * with a higher level
+ */
+static inline int capi_msg_verbose_level(unsigned char command)
+{
+	return (command == CAPI_DATA_B3) ? 7 : 4;
+}
+
+#define CAPI_MSGSTR_SIZE  8192
+
+/*
+ * private copy of a received capi message, handed to a dispatch worker
+ */
+struct capi_rawmsg {
+	struct capi_rawmsg *next;
+	unsigned char msg[];
+};
+
+extern MESSAGE_EXCHANGE_ERROR capi_put_msg(unsigned char *msg);
+
+/*
+ * send the fixed layout messages of every voice block, built by the
+ * capi_encode_* encoders of chan_capi_msg.h
+ */
+static inline MESSAGE_EXCHANGE_ERROR capi_send_data_b3_req(_cdword NCCI, _cword Number,
+	void *data, _cword len, _cword handle, _cword flags)
+{
+	unsigned char msg[CAPI_ENC_DATA_B3_REQ_SIZE];
+
+	capi_encode_data_b3_req(msg, NCCI, Number, data, len, handle, flags);
+	return capi_put_msg(msg);
+}
+
+static inline MESSAGE_EXCHANGE_ERROR capi_send_data_b3_resp(_cdword NCCI, _cword Number,
+	_cword handle)
+{
+	unsigned char msg[CAPI_ENC_DATA_B3_RESP_SIZE];
+
+	capi_encode_data_b3_resp(msg, NCCI, Number, handle);
+	return capi_put_msg(msg);
+}
+
+static inline MESSAGE_EXCHANGE_ERROR capi_send_connect_b3_resp(_cdword NCCI, _cword Number,
+	_cword reject, _cstruct ncpi)
+{
+	unsigned char msg[CAPI_ENC_CONNECT_B3_RESP_SIZE];
+
+	capi_encode_connect_b3_resp(msg, NCCI, Number, reject, ncpi);
+	return capi_put_msg(msg);
+}
+
+static inline MESSAGE_EXCHANGE_ERROR capi_send_connect_b3_active_resp(_cdword NCCI, _cword Number)
+{
+	unsigned char msg[CAPI_ENC_CONNECT_B3_ACTIVE_RESP_SIZE];
+
+	capi_encode_connect_b3_active_resp(msg, NCCI, Number);
+	return capi_put_msg(msg);
+}
+
+static inline MESSAGE_EXCHANGE_ERROR capi_send_dtmf_req(_cdword Id, _cword Number,
+	_cword selector, _cword function, _cword tone_duration, _cword gap_duration, int digit)
+{
+	unsigned char msg[CAPI_ENC_DTMF_REQ_SIZE];
+
+	capi_encode_dtmf_req(msg, Id, Number, selector, function, tone_duration,
+		gap_duration, digit);
+	return capi_put_msg(msg);
+}
+
 extern _cword get_capi_MessageNumber(void);
+extern void capi_timer_init_module(void);
+extern unsigned long long capi_timer_now(void);
+extern void capi_timer_init(struct capi_timer *t, void (*func)(void *data), void *data);
+extern void capi_timer_start(struct capi_timer *t, unsigned int ms);
+extern void capi_timer_stop(struct capi_timer *t);
+extern void capi_timer_stop_sync(struct capi_timer *t);
+extern void capi_timer_run(void);
+extern unsigned int capi_timer_next_timeout(unsigned int max_ms);
 extern struct capi_pvt *capi_find_interface_by_msgnum(unsigned short msgnum);
 extern struct capi_pvt *capi_find_interface_by_plci(unsigned int plci);
+extern void capi_interface_set_plci(struct capi_pvt *i, unsigned int plci);
+extern void capi_interface_set_msgnum(struct capi_pvt *i, _cword msgnum);
+extern void capi_interface_index_remove(struct capi_pvt *i);
 extern MESSAGE_EXCHANGE_ERROR capi_wait_conf(struct capi_pvt *i, unsigned short wCmd);
+extern void capidev_message2cmsg(_cmsg *CMSG, unsigned char *msg);
+extern char *capi_cmsg2str_buf(_cmsg *CMSG, char *buf, size_t size);
 extern MESSAGE_EXCHANGE_ERROR capidev_check_wait_get_cmsg(_cmsg *CMSG);
+extern MESSAGE_EXCHANGE_ERROR capidev_check_get_cmsg(_cmsg *CMSG);
+extern MESSAGE_EXCHANGE_ERROR capidev_check_wait_get_rawmsg(struct capi_rawmsg **copy);
+extern int capidev_wakeup_init(void);
+extern void capidev_wakeup_cleanup(void);
+extern void capidev_wakeup(void);
+extern void capi_put_batch_begin(void);
+extern void capi_put_batch_end(void);
+extern void capi_put_batch_stats(unsigned long *flushes, unsigned long *messages);
 extern char *capi_info_string(unsigned int info);
 extern void show_capi_info(struct capi_pvt *i, _cword info);
 extern unsigned capi_ListenOnController(unsigned int CIPmask, unsigned controller);
@@ -53,12 +144,34 @@ extern char *capi_number_func(unsigned char *data, unsigned int strip, char *buf
 extern int cc_add_peer_link_id(struct ast_channel *c);
 extern struct ast_channel *cc_get_peer_link_id(const char *p);
 extern void capi_remove_nullif(struct capi_pvt *i);
+extern void capi_nullif_pool_init(int size);
+extern void capi_nullif_pool_cleanup(void);
+extern void capi_nullif_pool_stats(int controller, int *count,
+	unsigned long *hits, unsigned long *misses);
+extern int capi_nullif_pool_enabled(void);
 extern struct capi_pvt *capi_mknullif(struct ast_channel *c, unsigned long long controllermask);
 struct capi_pvt *capi_mkresourceif(struct ast_channel *c, unsigned long long controllermask, struct capi_pvt *data_plci_ifc, cc_format_t codecs, int all);
+extern void capi_ifconf_unref(struct cc_capi_ifconf *conf);
+extern struct capi_pvt *capi_pvt_alloc(void);
+extern void capi_pvt_free(struct capi_pvt *i);
+extern int capi_alloc_b3_buffers(struct capi_pvt *i);
+extern void capi_free_b3_buffers(struct capi_pvt *i);
+extern unsigned char *capi_b3_tx_slot(struct capi_pvt *i);
+extern void capi_b3_tx_commit(struct capi_pvt *i, int len);
+extern void capi_b3_tx_confirm(struct capi_pvt *i, _cword handle);
+extern void capi_b3_tx_reset(struct capi_pvt *i);
 extern int capi_create_reader_writer_pipe(struct capi_pvt *i);
+extern void capi_close_reader_writer_pipe(struct capi_pvt *i);
+extern void capi_move_writer_pipe(struct capi_pvt *to, struct capi_pvt *from);
+extern int capi_write_pipeframe(struct capi_pvt *i, struct ast_frame *f);
+extern int capi_write_pipeframe_held(struct capi_pvt *i, struct ast_frame *f,
+	_cdword ncci, _cword msgnum, _cword datahandle);
+extern unsigned char *capi_write_pipeframe_reserve(struct capi_pvt *i, int len);
+extern void capi_write_pipeframe_publish(struct capi_pvt *i, struct ast_frame *f);
+extern void capi_frame_ring_revoke(struct capi_pvt *i, _cdword id);
 extern struct ast_frame *capi_read_pipeframe(struct capi_pvt *i);
 extern int capi_write_frame(struct capi_pvt *i, struct ast_frame *f);
-extern int capi_verify_resource_plci(const struct capi_pvt *i);
+extern int capi_verify_resource_plci(const struct capi_pvt *i, unsigned int generation);
 extern const char* pbx_capi_get_cid (struct ast_channel* c, const char *notAvailableVisual);
 extern const char* pbx_capi_get_callername (struct ast_channel* c, const char *notAvailableVisual);
 const char* pbx_capi_get_connectedname (struct ast_channel* c, const char *notAvailableVisual);
@@ -67,11 +180,6 @@ char* pbx_capi_strsep_controller_list (char** param);
 #define capi_number(data, strip) \
   capi_number_func(data, strip, alloca(AST_MAX_EXTENSION))
 
-typedef struct capi_prestruct_s {
-	unsigned short wLen;
-	unsigned char *info;
-} capi_prestruct_t;
-
 /*
  * Eicon's capi_sendf() function to create capi messages easily
  * and send this message.
@@ -35,15 +35,52 @@
 #include "diva_streaming_messages.h"
 #include "diva_streaming_vector.h"
 #include "diva_streaming_manager.h"
+#include "diva_segment_alloc_ifc.h"
 #include "chan_capi_divastreaming_utils.h"
 
 /*
 	LOCALS
 	*/
 static int diva_streaming_disabled;
-AST_MUTEX_DEFINE_STATIC(stream_write_lock);
 
-static diva_entity_queue_t diva_streaming_new; /* protected by stream_write_lock, new streams */
+/*
+	The control lock protects the life cycle of the streams: the queue of new
+	streams, capi_pvt->diva_stream_entry and the link between entry and capi_pvt.
+	Data is written under the lock of the stream entry only, so writes on
+	different calls do not contend. Writers do not take the control lock, they
+	announce themselves in diva_streaming_writers and a released entry is not
+	freed before there is no writer.
+	*/
+AST_MUTEX_DEFINE_STATIC(stream_control_lock);
+
+static diva_entity_queue_t diva_streaming_new; /* protected by stream_control_lock, new streams */
+static volatile int diva_streaming_scheduled; /* protected by stream_control_lock, new and active streams */
+static diva_entity_queue_t diva_streaming_reclaim; /* device thread only, released entries */
+static volatile int diva_streaming_writers;
+
+/*
+	Coalesced flush: with a delay, written data is published to the card
+	by divaStreamingWakeup or when DIVA_STREAM_FLUSH_THRESHOLD bytes are pending.
+	While streams exist the device thread polls them anyway, so the flush is
+	due with the first poll after the delay (on the grid of polls from the
+	next one) and writers do not wake it up.
+	Streams with data to publish are in the ready queue in the order they
+	were written. The ready lock is taken under the lock of a stream.
+	*/
+#define DIVA_STREAM_FLUSH_THRESHOLD 1024
+#define DIVA_STREAM_POLL_INTERVAL   5 /* ms */
+static unsigned int diva_streaming_flush_delay;
+AST_MUTEX_DEFINE_STATIC(stream_ready_lock);
+static diva_entity_queue_t diva_streaming_ready; /* protected by stream_ready_lock */
+static volatile unsigned long long diva_streaming_next_poll; /* device thread wakes up at latest */
+static unsigned long long diva_streaming_rx_due; /* device thread only, next poll of all streams */
+
+/*
+	Reference to the shared segment allocator of the streams, protected by
+	stream_control_lock like all segment allocations and releases
+	*/
+#define DIVA_STREAM_SEGMENTS 2 /* one tx and one rx segment per stream */
+static struct _diva_segment_alloc* diva_streaming_segment_alloc;
 
 int capi_DivaStreamingSupported (unsigned controller)
 {
@@ -84,6 +121,96 @@ done:
 	return ret;
 }
 
+/*
+	Add to or remove from the ready queue, pE->lock held
+	*/
+static void divaStreamingSetReady (diva_stream_scheduling_entry_t* pE, int ready)
+{
+	cc_mutex_lock(&stream_ready_lock);
+	if (pE->ready != 0) {
+		diva_q_remove (&diva_streaming_ready, &pE->ready_link);
+	}
+	if (ready != 0) {
+		diva_q_add_tail (&diva_streaming_ready, &pE->ready_link);
+	}
+	pE->ready = ready;
+	cc_mutex_unlock(&stream_ready_lock);
+}
+
+/*
+	Publish written data to the card, now or deferred, pE->lock held.
+	Returns non zero if the device thread has to be woken up, that is
+	only when it has no poll scheduled. The caller does that after
+	releasing pE->lock.
+	*/
+static int divaStreamingFlush (diva_stream_scheduling_entry_t* pE, dword length)
+{
+	unsigned long long next_poll;
+	int wakeup = 0;
+
+	if (diva_streaming_flush_delay != 0) {
+		if (pE->unflushed == 0) {
+			pE->flush_due = capi_timer_now() + diva_streaming_flush_delay;
+			next_poll = diva_streaming_next_poll;
+			if (diva_streaming_scheduled != 0 && next_poll != 0) {
+				/* flushed by a poll which is scheduled anyway */
+				if (pE->flush_due < next_poll) {
+					pE->flush_due = next_poll;
+				} else {
+					pE->flush_due = next_poll + ((pE->flush_due - next_poll + DIVA_STREAM_POLL_INTERVAL - 1) /
+						DIVA_STREAM_POLL_INTERVAL) * DIVA_STREAM_POLL_INTERVAL;
+				}
+			} else {
+				wakeup = 1;
+			}
+			divaStreamingSetReady (pE, 1);
+		}
+		pE->unflushed += length;
+		if (pE->unflushed < DIVA_STREAM_FLUSH_THRESHOLD) {
+			return (wakeup);
+		}
+		divaStreamingSetReady (pE, 0);
+	}
+	pE->unflushed = 0;
+	pE->diva_stream->flush_stream(pE->diva_stream);
+
+	return (0);
+}
+
+/*
+	Publish the data of all streams which are due, device thread only
+	*/
+static void divaStreamingFlushReady (unsigned long long now)
+{
+	diva_stream_scheduling_entry_t* pE;
+	diva_entity_link_t* link;
+
+	for (;;) {
+		cc_mutex_lock(&stream_ready_lock);
+		link = diva_q_get_head (&diva_streaming_ready);
+		if (link == 0) {
+			cc_mutex_unlock(&stream_ready_lock);
+			break;
+		}
+		pE = DIVAS_CONTAINING_RECORD(link, diva_stream_scheduling_entry_t, ready_link);
+		if (pE->flush_due > now) {
+			cc_mutex_unlock(&stream_ready_lock);
+			break;
+		}
+		diva_q_remove (&diva_streaming_ready, &pE->ready_link);
+		pE->ready = 0;
+		cc_mutex_unlock(&stream_ready_lock);
+
+		/* data written meanwhile is published with it */
+		cc_mutex_lock(&pE->lock);
+		if (pE->unflushed != 0 && pE->diva_stream != 0) {
+			pE->unflushed = 0;
+			pE->diva_stream->flush_stream(pE->diva_stream);
+		}
+		cc_mutex_unlock(&pE->lock);
+	}
+}
+
 static int divaStreamingMessageRx (void* user_context, dword message, dword length, const struct _diva_streaming_vector* v, dword nr_v)
 {
 	diva_stream_scheduling_entry_t* pE = (diva_stream_scheduling_entry_t*)user_context;
@@ -108,26 +235,27 @@ static int divaStreamingMessageRx (void* user_context, dword message, dword leng
 						if (pE->i->virtualBridgePeer != 0) {
 							if (pE->i->bridgePeer != 0) {
 								struct capi_pvt* bridgePeer = pE->i->bridgePeer;
-								if (bridgePeer->NCCI != 0 && bridgePeer->diva_stream_entry != 0 &&
-										bridgePeer->diva_stream_entry->diva_stream_state == DivaStreamActive &&
-										bridgePeer->diva_stream_entry->diva_stream->get_tx_in_use (bridgePeer->diva_stream_entry->diva_stream) < 512 &&
-										bridgePeer->diva_stream_entry->diva_stream->get_tx_free (bridgePeer->diva_stream_entry->diva_stream) >
-																																																2*CAPI_MAX_B3_BLOCK_SIZE+128) {
-									dword i = 0, k = 0, b3len;
-									byte b3buf[CAPI_MAX_B3_BLOCK_SIZE];
-									b3len = diva_streaming_read_vector_data(vind, vind_nr, &i, &k, b3buf, CAPI_MAX_B3_BLOCK_SIZE);
-									bridgePeer->diva_stream_entry->diva_stream->write (bridgePeer->diva_stream_entry->diva_stream,
-																																		 8U << 8 | DIVA_STREAM_MESSAGE_TX_IDI_REQUEST,
-																																		 b3buf, b3len);
-									bridgePeer->diva_stream_entry->diva_stream->flush_stream(bridgePeer->diva_stream_entry->diva_stream);
-								} else {
-									if (bridgePeer->NCCI != 0 && bridgePeer->diva_stream_entry != 0 &&
-										bridgePeer->diva_stream_entry->diva_stream_state == DivaStreamActive) {
+								diva_stream_scheduling_entry_t* pPeer = bridgePeer->diva_stream_entry;
+
+								if (bridgePeer->NCCI != 0 && pPeer != 0) {
+									cc_mutex_lock(&pPeer->lock);
+									if (pPeer->diva_stream_state == DivaStreamActive &&
+											pPeer->diva_stream->get_tx_in_use (pPeer->diva_stream) < 512 &&
+											pPeer->diva_stream->get_tx_free (pPeer->diva_stream) > 2*bridgePeer->b3blocksize+128) {
+										dword i = 0, k = 0, b3len;
+										byte b3buf[CAPI_B3_BLOCK_SIZE_LIMIT];
+										b3len = diva_streaming_read_vector_data(vind, vind_nr, &i, &k, b3buf, capi_b3_maxblocksize);
+										pPeer->diva_stream->write (pPeer->diva_stream,
+																							 8U << 8 | DIVA_STREAM_MESSAGE_TX_IDI_REQUEST,
+																							 b3buf, b3len);
+										divaStreamingFlush (pPeer, b3len); /* device thread, awake anyway */
+									} else if (pPeer->diva_stream_state == DivaStreamActive) {
 										DBG_ERR(("%s PLCI %04x discarded bridge packet free: %u in use: %u",
 															pE->i->name, pE->i->PLCI & 0xffffU, 
-										bridgePeer->diva_stream_entry->diva_stream->get_tx_free (bridgePeer->diva_stream_entry->diva_stream),
-										bridgePeer->diva_stream_entry->diva_stream->get_tx_in_use (bridgePeer->diva_stream_entry->diva_stream)))
+										pPeer->diva_stream->get_tx_free (pPeer->diva_stream),
+										pPeer->diva_stream->get_tx_in_use (pPeer->diva_stream)))
 									}
+									cc_mutex_unlock(&pPeer->lock);
 								}
 							}
 						} else {
@@ -191,6 +319,19 @@ static int divaStreamingMessageRx (void* user_context, dword message, dword leng
   return (0);
 }
 
+/*
+	Stream create request was not answered in time after cancel,
+	called by the timer in the same thread as divaStreamingWakeup
+	*/
+static void divaStreamingCancelTimeout(void *data)
+{
+	diva_stream_scheduling_entry_t* pE = data;
+
+	cc_mutex_lock(&stream_control_lock);
+	pE->cancel_expired = 1;
+	cc_mutex_unlock(&stream_control_lock);
+}
+
 /*
  * Create Diva stream
  *
@@ -208,11 +349,12 @@ void capi_DivaStreamingOn(struct capi_pvt *i, byte streamCommand, _cword message
 	pE = ast_malloc (sizeof(*pE));
 	if (pE == 0)
 		return;
+	cc_mutex_init(&pE->lock);
 
 	snprintf (trace_ident, sizeof(trace_ident), "C%02x", (byte)i->PLCI);
 	trace_ident[sizeof(trace_ident)-1] = 0;
 
-	cc_mutex_lock(&stream_write_lock);
+	cc_mutex_lock(&stream_control_lock);
 
 	ret = diva_stream_create (&pE->diva_stream, NULL, 255, divaStreamingMessageRx, pE, trace_ident);
 
@@ -242,19 +384,31 @@ void capi_DivaStreamingOn(struct capi_pvt *i, byte streamCommand, _cword message
 			pE->diva_stream_state = DivaStreamCreated;
 			pE->PLCI              = i->PLCI;
 			pE->i                 = i;
-			i->diva_stream_entry  = pE;
 			memcpy (pE->vname, i->vname, MIN(sizeof(pE->vname), sizeof(i->vname)));
 			pE->vname[sizeof(pE->vname)-1] = 0;
 			pE->rx_flow_control = 0;
 			pE->tx_flow_control = 0;
+			pE->cancel_expired  = 0;
+			pE->unflushed       = 0;
+			pE->ready           = 0;
+			capi_timer_init(&pE->cancel_timer, divaStreamingCancelTimeout, pE);
 			diva_q_add_tail (&diva_streaming_new, &pE->link);
+			diva_streaming_scheduled++;
+			/* visible for writers only when complete */
+			__sync_synchronize();
+			i->diva_stream_entry  = pE;
+			pE = 0;
 		} else {
 			pE->diva_stream->release (pE->diva_stream);
-			ast_free (pE);
 		}
 	}
 
-	cc_mutex_unlock(&stream_write_lock);
+	cc_mutex_unlock(&stream_control_lock);
+
+	if (pE != 0) {
+		cc_mutex_destroy(&pE->lock);
+		ast_free (pE);
+	}
 }
 
 /*
@@ -272,9 +426,9 @@ void capi_DivaStreamingRemoveInfo(struct capi_pvt *i)
 	MESSAGE_EXCHANGE_ERROR error;
 	int send;
 
-	cc_mutex_lock(&stream_write_lock);
+	cc_mutex_lock(&stream_control_lock);
 	send = i->diva_stream_entry != 0;
-	cc_mutex_unlock(&stream_write_lock);
+	cc_mutex_unlock(&stream_control_lock);
 
 	if (send != 0)
 		error = capi_sendf (NULL, 0, CAPI_MANUFACTURER_REQ, i->PLCI, get_capi_MessageNumber(),
@@ -312,11 +466,12 @@ void capi_DivaStreamingRemove(struct capi_pvt *i)
 	diva_stream_scheduling_entry_t* pE = i->diva_stream_entry;
 	int send_cancel = 0;
 
-	cc_mutex_lock(&stream_write_lock);
+	cc_mutex_lock(&stream_control_lock);
 	pE = i->diva_stream_entry;
 	if (pE != 0) {
 		i->diva_stream_entry = 0;
 		pE->i = 0;
+		cc_mutex_lock(&pE->lock);
 		if (pE->diva_stream_state == DivaStreamCreated) {
 
 			if (i->NCCI != 0) {
@@ -331,26 +486,22 @@ void capi_DivaStreamingRemove(struct capi_pvt *i)
 				send_cancel = 1;
 			}
 			pE->diva_stream_state = DivaStreamCancelSent;
-			pE->cancel_start = time(NULL) + 5;
+			capi_timer_start(&pE->cancel_timer, 5000);
 			DBG_LOG(("stream cancelled [%p]", pE->diva_stream))
 		} else if (pE->diva_stream_state == DivaStreamActive) {
 			pE->diva_stream->release_stream(pE->diva_stream);
 			pE->diva_stream_state = DivaStreamDisconnectSent;
 		}
+		cc_mutex_unlock(&pE->lock);
 	}
-	cc_mutex_unlock(&stream_write_lock);
+	cc_mutex_unlock(&stream_control_lock);
 
 	if (send_cancel != 0) {
 		static byte data[] = { 0x8 /* CONTROL */, 0x01 /* CANCEL */};
-		MESSAGE_EXCHANGE_ERROR error;
 
-		error = capi_sendf(NULL, 0, CAPI_DATA_B3_REQ, i->NCCI, get_capi_MessageNumber(),
-											"dwww", data, sizeof(data), 0, 1U << 4);
-		if (likely(error == 0)) {
-			cc_mutex_lock(&i->lock);
-			i->B3count++;
-			cc_mutex_unlock(&i->lock);
-		}
+		/* data handle 0 is not sent with a credit of the B3 window */
+		capi_sendf(NULL, 0, CAPI_DATA_B3_REQ, i->NCCI, get_capi_MessageNumber(),
+			"dwww", data, sizeof(data), 0, 1U << 4);
 	}
 }
 
@@ -364,68 +515,253 @@ void divaStreamingWakeup (void)
 {
 	static diva_entity_queue_t active_streams;
 	diva_entity_link_t* link;
-	time_t current_time = time (NULL);
+	unsigned long long now;
+	int released;
+
+	if (diva_streaming_scheduled == 0 && diva_q_get_head (&diva_streaming_reclaim) == 0) {
+		/* nothing to poll, the lock is not needed to see this */
+		return;
+	}
+
+	now = capi_timer_now();
+	if (now < diva_streaming_rx_due && diva_q_get_head (&diva_streaming_reclaim) == 0) {
+		/* the streams were polled recently, only publish due data */
+		divaStreamingFlushReady (now);
+		return;
+	}
+	diva_streaming_rx_due = now + DIVA_STREAM_POLL_INTERVAL;
 
-	cc_mutex_lock(&stream_write_lock);
+	cc_mutex_lock(&stream_control_lock);
 	while ((link = diva_q_get_head (&diva_streaming_new)) != 0) {
 		diva_stream_scheduling_entry_t* pE = DIVAS_CONTAINING_RECORD(link, diva_stream_scheduling_entry_t, link);
 		diva_q_remove (&diva_streaming_new, &pE->link);
 		diva_q_add_tail (&active_streams, &pE->link);
 	}
-	cc_mutex_unlock(&stream_write_lock);
 
 	for (link = diva_q_get_head (&active_streams); likely(link != 0);) {
 		diva_entity_link_t* next = diva_q_get_next(link);
 		diva_stream_scheduling_entry_t* pE = DIVAS_CONTAINING_RECORD(link, diva_stream_scheduling_entry_t, link);
 
-		cc_mutex_lock(&stream_write_lock);
+		cc_mutex_lock(&pE->lock);
 		pE->diva_stream->wakeup (pE->diva_stream);
-		if (unlikely(pE->diva_stream_state == DivaStreamCancelSent && pE->cancel_start < current_time)) {
+		if (pE->unflushed != 0 && pE->diva_stream != 0 &&
+				pE->diva_stream_state != DivaStreamActive) {
+			pE->unflushed = 0;
+			pE->diva_stream->flush_stream(pE->diva_stream);
+		}
+		if (unlikely(pE->diva_stream_state == DivaStreamCancelSent && pE->cancel_expired != 0)) {
 			DBG_LOG(("stream reclaimed [%p]", pE->diva_stream))
 			pE->diva_stream->release (pE->diva_stream);
 			pE->diva_stream_state = DivaStreamDisconnected;
 			pE->diva_stream = 0;
 		}
+		released = (pE->diva_stream == 0);
+		if (unlikely(released != 0)) {
+			divaStreamingSetReady (pE, 0);
+		}
+		cc_mutex_unlock(&pE->lock);
 
-		if (unlikely(pE->diva_stream == 0)) {
+		if (unlikely(released != 0)) {
 			diva_q_remove (&active_streams, &pE->link);
 			if (pE->i != 0) {
 				pE->i->diva_stream_entry = 0;
+				pE->i = 0;
 			}
-			ast_free (pE);
+			capi_timer_stop(&pE->cancel_timer);
+			diva_q_add_tail (&diva_streaming_reclaim, &pE->link);
+			diva_streaming_scheduled--;
 		}
-		cc_mutex_unlock(&stream_write_lock);
 
 		link = next;
 	}
+	cc_mutex_unlock(&stream_control_lock);
+
+	divaStreamingFlushReady (now);
+
+	/*
+		Released entries are detached, a writer which still may use
+		one has announced itself before
+		*/
+	if (diva_q_get_head (&diva_streaming_reclaim) != 0 &&
+			__sync_fetch_and_add (&diva_streaming_writers, 0) == 0) {
+		while ((link = diva_q_get_head (&diva_streaming_reclaim)) != 0) {
+			diva_stream_scheduling_entry_t* pE = DIVAS_CONTAINING_RECORD(link, diva_stream_scheduling_entry_t, link);
+			diva_q_remove (&diva_streaming_reclaim, &pE->link);
+			cc_mutex_destroy(&pE->lock);
+			ast_free (pE);
+		}
+	}
+}
+
+/*
+	Time in ms until divaStreamingWakeup has to run again: the next poll
+	or earlier if data is due to be published. Device thread only.
+	*/
+unsigned int capi_DivaStreamingPollTimeout(void)
+{
+	diva_stream_scheduling_entry_t* pE;
+	diva_entity_link_t* link;
+	unsigned long long now = capi_timer_now();
+	unsigned int timeout = 0;
+
+	if (diva_streaming_rx_due > now) {
+		timeout = (unsigned int)MIN(diva_streaming_rx_due - now, DIVA_STREAM_POLL_INTERVAL);
+	}
+
+	cc_mutex_lock(&stream_ready_lock);
+	if ((link = diva_q_get_head (&diva_streaming_ready)) != 0) {
+		pE = DIVAS_CONTAINING_RECORD(link, diva_stream_scheduling_entry_t, ready_link);
+		if (pE->flush_due <= now) {
+			timeout = 0;
+		} else if ((pE->flush_due - now) < timeout) {
+			timeout = (unsigned int)(pE->flush_due - now);
+		}
+	}
+	diva_streaming_next_poll = now + timeout;
+	cc_mutex_unlock(&stream_ready_lock);
+
+	return (timeout);
+}
+
+/*
+	Non zero while divaStreamingWakeup has streams to poll
+	or released entries to reclaim
+	*/
+int capi_DivaStreamingScheduled(void)
+{
+	return (diva_streaming_scheduled != 0 || diva_q_get_head (&diva_streaming_reclaim) != 0);
+}
+
+/*
+	Write data to the stream of i, -1 if i has no stream.
+	Only the stream of i is locked.
+	*/
+int capi_DivaStreamingWrite(struct capi_pvt *i, const void *data, unsigned int length)
+{
+	diva_stream_scheduling_entry_t* pE;
+	int written = -1, ready = 0, wakeup = 0;
+
+	__sync_add_and_fetch (&diva_streaming_writers, 1);
+	pE = i->diva_stream_entry;
+	if (pE != 0) {
+		written = 0;
+		cc_mutex_lock(&pE->lock);
+		if ((ready = (pE->diva_stream_state == DivaStreamActive)) &&
+				(pE->diva_stream->get_tx_free (pE->diva_stream) > 2*i->b3blocksize+128)) {
+			written = pE->diva_stream->write (pE->diva_stream, 8U << 8 | DIVA_STREAM_MESSAGE_TX_IDI_REQUEST, data, length);
+			wakeup = divaStreamingFlush (pE, length);
+		}
+		cc_mutex_unlock(&pE->lock);
+	}
+	__sync_sub_and_fetch (&diva_streaming_writers, 1);
+
+	if (unlikely(wakeup != 0)) {
+		capidev_wakeup();
+	}
+
+	if (unlikely(written == 0)) {
+		cc_verbose(3, 1, VERBOSE_PREFIX_4 "%s: stream is %s, dropping packet.\n", i->vname, (ready != 0) ? "full" : "not ready");
+	}
+
+	return (written);
 }
 
 unsigned int capi_DivaStreamingGetStreamInUse(const struct capi_pvt* i)
 {
+	diva_stream_scheduling_entry_t* pE;
 	unsigned int ret = 0;
 
-	capi_DivaStreamLock();
-	if ((i != NULL) && (i->diva_stream_entry != NULL) &&
-			(i->diva_stream_entry->diva_stream_state == DivaStreamActive) &&
-			(i->diva_stream_entry->diva_stream != NULL)) {
-		ret = i->diva_stream_entry->diva_stream->get_tx_in_use (i->diva_stream_entry->diva_stream);
+	if (i == NULL)
+		return (0);
+
+	__sync_add_and_fetch (&diva_streaming_writers, 1);
+	pE = i->diva_stream_entry;
+	if (pE != NULL) {
+		cc_mutex_lock(&pE->lock);
+		if ((pE->diva_stream_state == DivaStreamActive) && (pE->diva_stream != NULL)) {
+			ret = pE->diva_stream->get_tx_in_use (pE->diva_stream);
+		}
+		cc_mutex_unlock(&pE->lock);
 	}
-	capi_DivaStreamUnLock();
+	__sync_sub_and_fetch (&diva_streaming_writers, 1);
 
 	return (ret);
 }
 
+/*
+	Lock the stream life cycle, not needed to write data
+	*/
 void capi_DivaStreamLock(void)
 {
-	cc_mutex_lock(&stream_write_lock);
+	cc_mutex_lock(&stream_control_lock);
 }
 
 void capi_DivaStreamUnLock(void)
 {
-	cc_mutex_unlock(&stream_write_lock);
+	cc_mutex_unlock(&stream_control_lock);
 }
 
 void capi_DivaStreamingDisable (void) {
 	diva_streaming_disabled = 1;
 }
 
+/*
+	Map the DMA segments for nr_streams streams at load time,
+	so call setup does not need to map them
+	*/
+void capi_DivaStreamingPrewarm (unsigned int nr_streams) {
+	int ret;
+
+	if (diva_streaming_disabled || nr_streams == 0)
+		return;
+
+	cc_mutex_lock(&stream_control_lock);
+	if (diva_streaming_segment_alloc == 0 &&
+			diva_create_segment_alloc (0, &diva_streaming_segment_alloc) != 0) {
+		diva_streaming_segment_alloc = 0;
+		cc_mutex_unlock(&stream_control_lock);
+		cc_log(LOG_WARNING, "Diva streaming: unable to create segment allocator\n");
+		return;
+	}
+	ret = diva_segment_alloc_prewarm (diva_streaming_segment_alloc, nr_streams * DIVA_STREAM_SEGMENTS);
+	cc_mutex_unlock(&stream_control_lock);
+
+	if (ret != 0) {
+		cc_log(LOG_WARNING, "Diva streaming: unable to map segments for %u streams\n", nr_streams);
+	} else {
+		cc_verbose(3, 0, VERBOSE_PREFIX_3 "Diva streaming: mapped segments for %u streams\n", nr_streams);
+	}
+}
+
+/*
+	Segment allocator statistics, -1 if there is no allocator
+	*/
+int capi_DivaStreamingSegmentStats (unsigned int *mapped, unsigned int *busy,
+	unsigned int *setupmaps, unsigned int *failed, unsigned int *avg_us, unsigned int *max_us) {
+	diva_segment_alloc_stats_t stats;
+
+	cc_mutex_lock(&stream_control_lock);
+	if (diva_streaming_segment_alloc == 0) {
+		cc_mutex_unlock(&stream_control_lock);
+		return (-1);
+	}
+	diva_segment_alloc_get_stats (diva_streaming_segment_alloc, &stats);
+	cc_mutex_unlock(&stream_control_lock);
+
+	*mapped    = stats.mapped;
+	*busy      = stats.busy;
+	*setupmaps = stats.setup_maps;
+	*failed    = stats.failed;
+	*avg_us    = stats.map_time_avg;
+	*max_us    = stats.map_time_max;
+
+	return (0);
+}
+
+/*
+	Max. delay in ms until written data is published, 0 to publish every write
+	*/
+void capi_DivaStreamingSetFlushDelay (int delay) {
+	diva_streaming_flush_delay = (unsigned int)delay;
+}
+
@@ -7,10 +7,17 @@ extern void capi_DivaStreamingStreamNotUsed(struct capi_pvt *i, byte streamComma
 extern void capi_DivaStreamingRemoveInfo(struct capi_pvt *i);
 extern void capi_DivaStreamingRemove(struct capi_pvt *i);
 extern void divaStreamingWakeup(void);
+extern int capi_DivaStreamingScheduled(void);
+extern unsigned int capi_DivaStreamingPollTimeout(void);
+extern int capi_DivaStreamingWrite(struct capi_pvt *i, const void *data, unsigned int length);
 extern unsigned int capi_DivaStreamingGetStreamInUse(const struct capi_pvt* i);
 extern void capi_DivaStreamLock(void);
 extern void capi_DivaStreamUnLock (void);
 extern void capi_DivaStreamingDisable (void);
+extern void capi_DivaStreamingSetFlushDelay (int delay);
+extern void capi_DivaStreamingPrewarm (unsigned int nr_streams);
+extern int capi_DivaStreamingSegmentStats (unsigned int *mapped, unsigned int *busy,
+	unsigned int *setupmaps, unsigned int *failed, unsigned int *avg_us, unsigned int *max_us);
 
 typedef enum _diva_stream_state {
   DivaStreamCreated        = 0,
@@ -20,8 +27,16 @@ typedef enum _diva_stream_state {
   DivaStreamDisconnected   = 4
 } diva_stream_state_t;
 
+/*
+	diva_stream, diva_stream_state and the flush state are protected by lock,
+	link, i and cancel_expired by the global stream control lock,
+	ready_link and ready by the stream ready lock
+	*/
 typedef struct _diva_stream_scheduling_entry {
 	diva_entity_link_t  link;
+	diva_entity_link_t  ready_link;
+	int                 ready;
+	cc_mutex_t          lock;
 	struct _diva_stream *diva_stream;
 	diva_stream_state_t diva_stream_state;
 	struct capi_pvt      *i;
@@ -29,7 +44,10 @@ typedef struct _diva_stream_scheduling_entry {
 	int									tx_flow_control;
 	char vname[CAPI_MAX_STRING]; /* Cached from capi_pvt */
 	dword               PLCI; /* Cached from capi_pvt */
-	time_t              cancel_start;
+	struct capi_timer   cancel_timer;
+	int                 cancel_expired;
+	dword               unflushed; /* written, but not published to the card */
+	unsigned long long  flush_due;
 } diva_stream_scheduling_entry_t;
 
 #endif
@@ -39,8 +39,21 @@ typedef struct _diva_segment_alloc_access {
 	void  (*resource_removed)(struct _diva_segment_alloc* ifc);
 } diva_segment_alloc_access_t;
 
+typedef struct _diva_segment_alloc_stats {
+	dword mapped;       /* segments mapped */
+	dword busy;         /* segments used by streams */
+	dword free;         /* mapped segments ready for use */
+	dword allocs;       /* segment allocations */
+	dword setup_maps;   /* allocations which had to map a new segment */
+	dword failed;       /* failed allocations */
+	dword map_time_avg; /* usec to map a new segment */
+	dword map_time_max;
+} diva_segment_alloc_stats_t;
+
 int diva_create_segment_alloc  (void* os_context, struct _diva_segment_alloc** segment_alloc);
 int diva_destroy_segment_alloc (struct _diva_segment_alloc** segment_alloc);
 diva_segment_alloc_access_t* diva_get_segment_alloc_ifc (struct _diva_segment_alloc* segment_alloc);
+int diva_segment_alloc_prewarm (struct _diva_segment_alloc* segment_alloc, dword nr_segments);
+void diva_segment_alloc_get_stats (struct _diva_segment_alloc* segment_alloc, diva_segment_alloc_stats_t* stats);
 
 #endif
@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <time.h>
 #endif
 
 typedef struct _diva_map_entry {
@@ -69,6 +70,14 @@ typedef struct _diva_segment_alloc {
 #if !defined(DIVA_USERMODE)
 	IDI_SYNC_REQ syncReq;
 #endif
+	dword nr_mapped;
+	dword nr_busy;
+	dword nr_allocs;
+	dword nr_setup_maps;
+	dword nr_failed;
+	dword nr_maps;
+	qword map_time_total;
+	dword map_time_max;
 } diva_segment_alloc_t;
 
 /*
@@ -76,6 +85,7 @@ typedef struct _diva_segment_alloc {
  */
 static void  release_proc(struct _diva_segment_alloc**);
 static void* segment_alloc_proc(struct _diva_segment_alloc*, dword* lo, dword* hi);
+static diva_map_entry_t* create_map_entry (struct _diva_segment_alloc* pI);
 static void  segment_free_proc(struct _diva_segment_alloc*, void* addr, dword lo, dword hi);
 static dword get_segment_length_proc(struct _diva_segment_alloc*);
 #if defined(DIVA_USERMODE)
@@ -110,13 +120,13 @@ static int shared_segment_alloc_count;
 
 int diva_create_segment_alloc  (void* os_context, struct _diva_segment_alloc** segment_alloc)
 {
-	diva_segment_alloc_t* pI = diva_os_malloc(0, sizeof(*pI));
+	diva_segment_alloc_t* pI;
 
 #if defined(DIVA_SHARED_SEGMENT_ALLOC)
 	if (shared_segment_alloc != 0) {
 		shared_segment_alloc_count++;
 		*segment_alloc = shared_segment_alloc;
-		DBG_TRC(("shared %d segment alloc [%p]", shared_segment_alloc_count, pI))
+		DBG_TRC(("shared %d segment alloc [%p]", shared_segment_alloc_count, shared_segment_alloc))
 		return (0);
 	}
 #endif
@@ -236,77 +246,139 @@ void  release_proc(struct _diva_segment_alloc** pI) {
 	diva_destroy_segment_alloc (pI);
 }
 
+/*
+ * time stamp in usec to measure the map latency
+ */
+static dword segment_alloc_time_us (void) {
+#if defined(DIVA_USERMODE) && defined(LINUX)
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ((dword)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000));
+#else
+	return (0);
+#endif
+}
+
 void* segment_alloc_proc(struct _diva_segment_alloc* pI, dword* lo, dword* hi) {
 	diva_entity_link_t* link = diva_q_get_head(&pI->free_q);
-	void* addr = 0;
+	diva_map_entry_t* pE;
 
-	if (link != 0) {
-		diva_map_entry_t* pE = DIVAS_CONTAINING_RECORD(link, diva_map_entry_t, link);
+	pI->nr_allocs++;
 
+	if (link != 0) {
+		pE = DIVAS_CONTAINING_RECORD(link, diva_map_entry_t, link);
 		diva_q_remove (&pI->free_q, link);
-		diva_q_add_tail (&pI->busy_q, link);
+	} else if ((pE = create_map_entry (pI)) != 0) {
+		pI->nr_setup_maps++;
+	} else {
+		pI->nr_failed++;
+		return (0);
+	}
+
+	diva_q_add_tail (&pI->busy_q, &pE->link);
+	pI->nr_busy++;
+
+	*lo = pE->dma_lo;
+	*hi = pE->dma_hi;
+
+	return (pE->mem);
+}
 
-		*lo = pE->dma_lo;
-		*hi = pE->dma_hi;
+/*
+ * get a new segment from the driver and map it
+ */
+static diva_map_entry_t* create_map_entry (struct _diva_segment_alloc* pI) {
+	diva_map_entry_t* pE = diva_os_malloc (0, sizeof(diva_map_entry_t));
+	dword start = segment_alloc_time_us ();
+	int mapped = 0;
+
+	if (pE == 0)
+		return (0);
 
-		return (pE->mem);
-	} else if ((link = diva_os_malloc (0, sizeof(diva_map_entry_t))) != 0) {
-		diva_map_entry_t* pE = (diva_map_entry_t*)link;
 #if defined(DIVA_USERMODE)
 #if defined(LINUX)
+	{
 		dword data[5];
 		int ret;
-    
+
 		data[0] = DIVA_XDI_UM_CMD_CREATE_XDI_DESCRIPTORS;
 		data[1] = 1;
 
-    { int tmp = write (pI->fd, data, 2*sizeof(dword)); tmp++; }
-    ret = read (pI->fd, data, sizeof(data));
-    if (ret == sizeof(data) || ret == (sizeof(data)-sizeof(data[0]))) {
+		{ int tmp = write (pI->fd, data, 2*sizeof(dword)); tmp++; }
+		ret = read (pI->fd, data, sizeof(data));
+		if (ret == sizeof(data) || ret == (sizeof(data)-sizeof(data[0]))) {
 			if (data[0] == DIVA_XDI_UM_CMD_CREATE_XDI_DESCRIPTORS && data[1] == 1) {
 				pE->dma_lo = data[3];
 				pE->dma_hi = (data[2] == 8) ? data[4] : 0;
-				if (map_entry(pI, pE) == 0) {
-					diva_q_add_tail (&pI->busy_q, &pE->link);
-					*lo  = pE->dma_lo;
-					*hi  = pE->dma_hi;
-					addr = pE->mem;
-				} else {
-					diva_os_free (0, pE);
-				}
-      }
+				mapped = (map_entry(pI, pE) == 0);
+			}
 		}
+	}
 #endif
 #else
-		pI->syncReq.diva_xdi_streaming_mapping_req.Req = 0;
-		pI->syncReq.diva_xdi_streaming_mapping_req.Rc  = IDI_SYNC_REQ_PROCESS_STREAMING_MAPPING;
-		pI->syncReq.diva_xdi_streaming_mapping_req.info.request = IDI_SYNC_REQ_PROCESS_STREAMING_MAPPING_ALLOC_COMMAND;
-		pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_lo     = 0;
-		pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_hi     = 0;
-		pI->syncReq.diva_xdi_streaming_mapping_req.info.addr       = 0;
-		pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_handle = -1;
-		pI->d->request((ENTITY*)&pI->syncReq);
-		if (pI->syncReq.diva_xdi_streaming_mapping_req.info.request == IDI_SYNC_REQ_PROCESS_STREAMING_COMMAND_OK &&
-				pI->syncReq.diva_xdi_streaming_mapping_req.info.addr != 0) {
-			pE->entry_nr = pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_handle;
-			pE->dma_lo   = pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_lo;
-			pE->dma_hi   = pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_hi;
-			pE->mem      = pI->syncReq.diva_xdi_streaming_mapping_req.info.addr;
+	pI->syncReq.diva_xdi_streaming_mapping_req.Req = 0;
+	pI->syncReq.diva_xdi_streaming_mapping_req.Rc  = IDI_SYNC_REQ_PROCESS_STREAMING_MAPPING;
+	pI->syncReq.diva_xdi_streaming_mapping_req.info.request = IDI_SYNC_REQ_PROCESS_STREAMING_MAPPING_ALLOC_COMMAND;
+	pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_lo     = 0;
+	pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_hi     = 0;
+	pI->syncReq.diva_xdi_streaming_mapping_req.info.addr       = 0;
+	pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_handle = -1;
+	pI->d->request((ENTITY*)&pI->syncReq);
+	if (pI->syncReq.diva_xdi_streaming_mapping_req.info.request == IDI_SYNC_REQ_PROCESS_STREAMING_COMMAND_OK &&
+			pI->syncReq.diva_xdi_streaming_mapping_req.info.addr != 0) {
+		pE->entry_nr = pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_handle;
+		pE->dma_lo   = pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_lo;
+		pE->dma_hi   = pI->syncReq.diva_xdi_streaming_mapping_req.info.dma_hi;
+		pE->mem      = pI->syncReq.diva_xdi_streaming_mapping_req.info.addr;
+
+		memset (pE->mem, 0x00, 4*1024);
+		mapped = 1;
+	}
+#endif
 
-			*lo  = pE->dma_lo;
-			*hi  = pE->dma_hi;
-			addr = pE->mem;
+	if (mapped == 0) {
+		diva_os_free (0, pE);
+		return (0);
+	}
 
-			memset (addr, 0x00, 4*1024);
+	start = segment_alloc_time_us () - start;
+	pI->nr_mapped++;
+	pI->nr_maps++;
+	pI->map_time_total += start;
+	if (start > pI->map_time_max)
+		pI->map_time_max = start;
 
-			diva_q_add_tail (&pI->busy_q, &pE->link);
-		} else {
-			diva_os_free (0, pE);
+	return (pE);
+}
+
+/*
+ * map segments in advance, call setup takes them from the free queue
+ */
+int diva_segment_alloc_prewarm (struct _diva_segment_alloc* pI, dword nr_segments) {
+	diva_map_entry_t* pE;
+
+	while (pI->nr_mapped < nr_segments) {
+		if ((pE = create_map_entry (pI)) == 0) {
+			DBG_ERR(("prewarm stopped at %u of %u segments [%p]", pI->nr_mapped, nr_segments, pI))
+			return (-1);
 		}
-#endif
+		diva_q_add_tail (&pI->free_q, &pE->link);
 	}
 
-	return (addr);
+	return (0);
+}
+
+void diva_segment_alloc_get_stats (struct _diva_segment_alloc* pI, diva_segment_alloc_stats_t* stats) {
+	stats->mapped       = pI->nr_mapped;
+	stats->busy         = pI->nr_busy;
+	stats->free         = pI->nr_mapped - pI->nr_busy;
+	stats->allocs       = pI->nr_allocs;
+	stats->setup_maps   = pI->nr_setup_maps;
+	stats->failed       = pI->nr_failed;
+	stats->map_time_avg = (pI->nr_maps != 0) ? (dword)(pI->map_time_total / pI->nr_maps) : 0;
+	stats->map_time_max = pI->map_time_max;
 }
 
 #if defined(DIVA_USERMODE)
@@ -422,6 +494,7 @@ void  segment_free_proc(struct _diva_segment_alloc* pI, void* addr, dword lo, dw
 		if (pE->mem == addr && pE->dma_lo == lo && pE->dma_hi == hi) {
 			diva_q_remove (&pI->busy_q, link);
 			diva_q_add_tail (&pI->free_q, link);
+			pI->nr_busy--;
 			return;
 		}
 	}
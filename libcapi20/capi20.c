@@ -16,9 +16,16 @@
 #include <limits.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
 #define _LINUX_LIST_H
 #include <linux/capi.h>
  
@@ -61,6 +68,9 @@ static unsigned short int port;
 static char hostname[1024];
 static int tracelevel;
 static char *tracefile;
+static unsigned long tracesize;
+static unsigned long tracerotate;
+static int usehugepages;
 
 /* REMOTE-CAPI commands */
  
@@ -192,6 +202,21 @@ static int read_config(void)
 			if (*t) *t++ = 0;
 			tracefile = strdup(s);
 			continue;
+		} else if (!(strncmp(s, "HUGEPAGES", 9))) {
+			t = skip_nonwhitespace(s);
+			s = skip_whitespace(t);
+			usehugepages = (int)strtol(s, NULL, 10);
+			continue;
+		} else if (!(strncmp(s, "TRACESIZE", 9))) {
+			t = skip_nonwhitespace(s);
+			s = skip_whitespace(t);
+			tracesize = strtoul(s, NULL, 10);
+			continue;
+		} else if (!(strncmp(s, "TRACEROTATE", 11))) {
+			t = skip_nonwhitespace(s);
+			s = skip_whitespace(t);
+			tracerotate = strtoul(s, NULL, 10);
+			continue;
 		}
 	}
 	fclose(fp);
@@ -289,11 +314,204 @@ static void set_rcapicmd_header(unsigned char **p, int len, _cword cmd, _cdword
 	put_dword(p, ctrl);
 }
 
+/*
+ * Trace writer: the messages are copied into a ring of preallocated
+ * records by the sending and receiving threads without a lock and are
+ * written to the trace file by a background thread, which keeps the
+ * file open. A message is dropped and counted if the ring is full.
+ * The writer sleeps on trace_cond while the ring is empty and is
+ * stopped, after it has written the ring, when the last application
+ * is released.
+ * Each record starts with the header of the unbuffered trace
+ *   length (16 bit, including header), seconds (32 bit),
+ *   direction (0x80 send, 0x81 receive)
+ * followed by the CAPI message.
+ */
+#define TRACE_HEADER_SIZE    7
+#define TRACE_RECORD_DATA    SEND_BUFSIZ
+#define TRACE_RING_SIZE      512 /* must be power of two */
+#define TRACE_WRITE_BATCH    32
+#define TRACE_IDLE_SEC       1
+
+struct trace_record {
+	volatile unsigned seq;
+	unsigned short len;
+	unsigned char data[TRACE_HEADER_SIZE + TRACE_RECORD_DATA];
+};
+
+static struct trace_record *trace_ring;
+static volatile unsigned trace_head;
+static unsigned trace_tail;
+static volatile unsigned long trace_written;
+static volatile unsigned long trace_dropped;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t trace_thread;
+static volatile int trace_started;
+static volatile int trace_idle; /* writer waits on trace_cond */
+static int trace_exit;
+
+static int trace_open(void)
+{
+	return open(tracefile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+/*
+ * rename the full trace file to <tracefile>.1 and start a new one
+ */
+static int trace_rotate(int fd)
+{
+	char name[PATH_MAX];
+
+	close(fd);
+	snprintf(name, sizeof(name), "%s.1", tracefile);
+	rename(tracefile, name);
+	return trace_open();
+}
+
+static inline int trace_pending(void)
+{
+	return (trace_ring[trace_tail & (TRACE_RING_SIZE - 1)].seq == (trace_tail + 1));
+}
+
+/*
+ * wait for the next record, at most TRACE_IDLE_SEC to check the
+ * rotation of an idle trace. Returns 1 if the writer has to stop.
+ */
+static int trace_wait(void)
+{
+	struct timespec ts;
+	int stop;
+
+	pthread_mutex_lock(&trace_lock);
+	trace_idle = 1;
+	__sync_synchronize();
+	if ((!trace_exit) && (!trace_pending())) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += TRACE_IDLE_SEC;
+		pthread_cond_timedwait(&trace_cond, &trace_lock, &ts);
+	}
+	trace_idle = 0;
+	stop = ((trace_exit) && (!trace_pending()));
+	pthread_mutex_unlock(&trace_lock);
+
+	return stop;
+}
+
+static void *trace_writer(void *arg)
+{
+	struct iovec iov[TRACE_WRITE_BATCH];
+	struct trace_record *rec;
+	unsigned long size = 0;
+	time_t opened;
+	struct stat st;
+	int fd, n, k;
+
+	fd = trace_open();
+	if ((fd >= 0) && (fstat(fd, &st) == 0))
+		size = st.st_size;
+	opened = time(NULL);
+
+	for (;;) {
+		for (n = 0; n < TRACE_WRITE_BATCH; n++) {
+			rec = &trace_ring[(trace_tail + n) & (TRACE_RING_SIZE - 1)];
+			if (rec->seq != (trace_tail + n + 1))
+				break;
+			iov[n].iov_base = rec->data;
+			iov[n].iov_len = rec->len;
+		}
+		if (n == 0) {
+			if (trace_wait())
+				break;
+		} else {
+			__sync_synchronize();
+
+			if (fd < 0)
+				fd = trace_open();
+			if (fd >= 0) {
+				ssize_t len = writev(fd, iov, n);
+				if (len > 0)
+					size += len;
+			}
+			for (k = 0; k < n; k++) {
+				rec = &trace_ring[trace_tail & (TRACE_RING_SIZE - 1)];
+				rec->seq = trace_tail + TRACE_RING_SIZE;
+				trace_tail++;
+			}
+			__sync_fetch_and_add(&trace_written, n);
+		}
+
+		/* an empty file is not rotated, it would replace the last one */
+		if ((fd >= 0) && (size) &&
+		    (((tracesize) && (size >= tracesize)) ||
+		     ((tracerotate) && (time(NULL) >= (opened + (time_t)tracerotate))))) {
+			fd = trace_rotate(fd);
+			size = 0;
+			opened = time(NULL);
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/*
+ * start the writer with the first traced message
+ */
+static void trace_start(void)
+{
+	unsigned n;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_started) {
+		trace_ring = (struct trace_record *)malloc(sizeof(struct trace_record) * TRACE_RING_SIZE);
+		if (trace_ring != NULL) {
+			for (n = 0; n < TRACE_RING_SIZE; n++)
+				trace_ring[n].seq = n;
+			trace_head = 0;
+			trace_tail = 0;
+			trace_exit = 0;
+			if (pthread_create(&trace_thread, NULL, trace_writer, NULL) != 0) {
+				free(trace_ring);
+				trace_ring = NULL;
+			}
+		}
+		/* without ring the messages are not traced until the next start */
+		trace_started = 1;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * let the writer write the ring and wait for it,
+ * no message may be traced meanwhile
+ */
+static void trace_stop(void)
+{
+	int running;
+
+	pthread_mutex_lock(&trace_lock);
+	running = ((trace_started) && (trace_ring != NULL));
+	trace_exit = 1;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+
+	if (running)
+		pthread_join(trace_thread, NULL);
+
+	pthread_mutex_lock(&trace_lock);
+	free(trace_ring);
+	trace_ring = NULL;
+	trace_started = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
 static void write_capi_trace(int send, unsigned char *buf, int length, int datamsg)
 {
-	int fd;
-	_cdword ltime;
-	unsigned char header[7];
+	struct trace_record *rec;
+	unsigned pos;
+	int dif;
 
 	if (!tracefile)
 		return;
@@ -301,20 +519,57 @@ static void write_capi_trace(int send, unsigned char *buf, int length, int datam
 	if (tracelevel < (datamsg + 1))
 		return;
 
-	fd = open(tracefile, O_WRONLY | O_CREAT | O_APPEND, 0644);
-	if (fd >= 0) {
-		int tmp;
+	if (unlikely(!trace_started))
+		trace_start();
+	if (trace_ring == NULL)
+		return;
+
+	if (length > TRACE_RECORD_DATA)
+		length = TRACE_RECORD_DATA;
+
+	/* claim a free record */
+	pos = trace_head;
+	for (;;) {
+		rec = &trace_ring[pos & (TRACE_RING_SIZE - 1)];
+		dif = (int)(rec->seq - pos);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&trace_head, pos, pos + 1))
+				break;
+		} else if (dif < 0) {
+			__sync_fetch_and_add(&trace_dropped, 1);
+			return;
+		}
+		pos = trace_head;
+	}
 
-		ltime = (_cdword)time(NULL);
-		capimsg_setu16(header, 0, length + sizeof(header));
-		capimsg_setu32(header, 2, ltime);
-		header[6] = (send) ? 0x80:0x81;
-		tmp = write(fd, header, sizeof(header));
-		tmp = write(fd, buf, length);
-		close(fd);
+	rec->len = length + TRACE_HEADER_SIZE;
+	capimsg_setu16(rec->data, 0, length + TRACE_HEADER_SIZE);
+	capimsg_setu32(rec->data, 2, (_cdword)time(NULL));
+	rec->data[6] = (send) ? 0x80:0x81;
+	memcpy(rec->data + TRACE_HEADER_SIZE, buf, length);
+
+	/* publish the record to the writer */
+	__sync_synchronize();
+	rec->seq = pos + 1;
+
+	/* wake the writer, see trace_wait() */
+	__sync_synchronize();
+	if (trace_idle) {
+		pthread_mutex_lock(&trace_lock);
+		pthread_cond_signal(&trace_cond);
+		pthread_mutex_unlock(&trace_lock);
 	}
 }
 
+/*
+ * number of trace records written and dropped
+ */
+void capi20ext_trace_stats(unsigned long *written, unsigned long *dropped)
+{
+	*written = trace_written;
+	*dropped = trace_dropped;
+}
+
 static inline unsigned capi20_isinstalled_internal(void)
 {
 	if (likely(capi_fd >= 0))
@@ -401,26 +656,94 @@ static inline int applid2fd(unsigned applid)
 
 /*
  * buffer management
+ *
+ * A receive buffer of a DATA_B3_IND stays in use until the DATA_B3_RESP.
+ * Buffers in use are linked per connection: each PLCI hashes to a bucket
+ * and the buffers of all NCCIs of that PLCI are in the bucket list, so
+ * the cleanup on DISCONNECT_B3_RESP or DISCONNECT_IND only visits the
+ * buffers of this connection (and of PLCIs sharing the bucket).
+ * The application may still use the data of a buffer after the cleanup,
+ * so the cleanup only orphans the buffers. An orphaned buffer is free
+ * again with its DATA_B3_RESP, which is then not sent.
+ * The buffers are returned by the threads putting messages while the
+ * thread getting messages takes them, buffer_lock protects the lists.
+ * The buffer area is cache line aligned and may be backed by huge pages
+ * (HUGEPAGES 1 in the configuration file).
  */
+#define BUFFER_ALIGN		64
 
 struct recvbuffer {
-	struct recvbuffer *next;
+	struct recvbuffer *next;   /* free list or bucket list */
+	struct recvbuffer **pprev; /* in bucket list */
 	unsigned int  datahandle;
 	unsigned int  used;
 	unsigned int  ncci;
+	unsigned int  orphan;      /* connection is gone, wait for the RESP */
 	unsigned char *buf; /* 128 + MaxSizeB3 */
 };
 
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct applinfo {
 	unsigned  maxbufs;
 	unsigned  nbufs;
+	unsigned  highwater;
+	unsigned long failures;
 	size_t    recvbuffersize;
 	struct recvbuffer *buffers;
 	struct recvbuffer *firstfree;
 	struct recvbuffer *lastfree;
 	unsigned char *bufferstart;
+	size_t    areasize;
+	int       hugepages;        /* area is mmap()ed */
+	unsigned  bucketmask;
+	struct recvbuffer **buckets;
 };
 
+static inline unsigned plci_bucket(struct applinfo *ap, unsigned ncci)
+{
+	unsigned plci = ncci & 0xffff;
+
+	return ((plci ^ (plci >> 8)) * 0x9e3779b1U >> 16) & ap->bucketmask;
+}
+
+static unsigned char *alloc_buffer_area(struct applinfo *ap, size_t size)
+{
+	void *area;
+
+	ap->hugepages = 0;
+#ifdef MAP_HUGETLB
+	if (usehugepages) {
+		size_t hsize = (size + (2 * 1024 * 1024) - 1) & ~((size_t)(2 * 1024 * 1024) - 1);
+
+		area = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (area != MAP_FAILED) {
+			ap->hugepages = 1;
+			ap->areasize = hsize;
+			return (unsigned char *)area;
+		}
+	}
+#endif
+	if (posix_memalign(&area, BUFFER_ALIGN, size) != 0)
+		return 0;
+	ap->areasize = size;
+	return (unsigned char *)area;
+}
+
+static void free_buffer_area(struct applinfo *ap)
+{
+	if (ap->bufferstart == 0)
+		return;
+#ifdef MAP_HUGETLB
+	if (ap->hugepages) {
+		munmap(ap->bufferstart, ap->areasize);
+		return;
+	}
+#endif
+	free(ap->bufferstart);
+}
+
 static struct applinfo *alloc_buffers(
 	unsigned MaxB3Connection,
 	unsigned MaxB3Blks,
@@ -429,15 +752,20 @@ static struct applinfo *alloc_buffers(
 	struct applinfo *ap;
 	unsigned nbufs = 2 + MaxB3Connection * (MaxB3Blks + 1);
 	size_t recvbuffersize = 128 + MaxSizeB3;
+	unsigned nbuckets = 16;
 	unsigned i;
 	size_t size;
 
 	if (recvbuffersize < 2048)
 		recvbuffersize = 2048;
+	recvbuffersize = (recvbuffersize + BUFFER_ALIGN - 1) & ~((size_t)BUFFER_ALIGN - 1);
+
+	while (nbuckets < (2 * MaxB3Connection))
+		nbuckets <<= 1;
 
 	size = sizeof(struct applinfo);
 	size += sizeof(struct recvbuffer) * nbufs;
-	size += recvbuffersize * nbufs;
+	size += sizeof(struct recvbuffer *) * nbuckets;
 
 	ap = (struct applinfo *)malloc(size);
 	if (ap == 0)
@@ -447,12 +775,20 @@ static struct applinfo *alloc_buffers(
 	ap->maxbufs = nbufs;
 	ap->recvbuffersize = recvbuffersize;
 	ap->buffers = (struct recvbuffer *)(ap+1);
+	ap->buckets = (struct recvbuffer **)(ap->buffers+nbufs);
+	ap->bucketmask = nbuckets - 1;
+	ap->bufferstart = alloc_buffer_area(ap, recvbuffersize * nbufs);
+	if (ap->bufferstart == 0) {
+		free(ap);
+		return 0;
+	}
 	ap->firstfree = ap->buffers;
-	ap->bufferstart = (unsigned char *)(ap->buffers+nbufs);
 	for (i = 0; i < ap->maxbufs; i++) {
 		ap->buffers[i].next = &ap->buffers[i+1];
+		ap->buffers[i].pprev = 0;
 		ap->buffers[i].used = 0;
 		ap->buffers[i].ncci = 0;
+		ap->buffers[i].orphan = 0;
 		ap->buffers[i].buf = ap->bufferstart+(recvbuffersize*i);
 	}
 	ap->lastfree = &ap->buffers[ap->maxbufs-1];
@@ -462,6 +798,7 @@ static struct applinfo *alloc_buffers(
 
 static void free_buffers(struct applinfo *ap)
 {
+	free_buffer_area(ap);
 	free(ap);
 }
 
@@ -473,20 +810,32 @@ static unsigned char *get_buffer(unsigned applid, size_t *sizep, unsigned *handl
 	struct recvbuffer *buf;
 
 	assert(validapplid(applid));
+	pthread_mutex_lock(&buffer_lock);
 	ap = applinfo[applid];
-	if ((buf = ap->firstfree) == 0)
+	if ((buf = ap->firstfree) == 0) {
+		ap->failures++;
+		pthread_mutex_unlock(&buffer_lock);
 		return 0;
+	}
 
 	ap->firstfree = buf->next;
+	if (ap->firstfree == 0)
+		ap->lastfree = 0;
 	buf->next = 0;
 	buf->used = 1;
 	ap->nbufs++;
+	if (ap->nbufs > ap->highwater)
+		ap->highwater = ap->nbufs;
 	*sizep = ap->recvbuffersize;
-	*handle  = (buf->buf-ap->bufferstart)/ap->recvbuffersize;
+	*handle  = buf - ap->buffers;
+	pthread_mutex_unlock(&buffer_lock);
 
 	return buf->buf;
 }
 
+/*
+ * buffer is kept for a DATA_B3_IND, link it to its connection
+ */
 static void save_datahandle(
 	unsigned char applid,
 	unsigned offset,
@@ -495,15 +844,28 @@ static void save_datahandle(
 {
 	struct applinfo *ap;
 	struct recvbuffer *buf;
+	struct recvbuffer **head;
 
 	assert(validapplid(applid));
+	pthread_mutex_lock(&buffer_lock);
 	ap = applinfo[applid];
 	assert(offset < ap->maxbufs);
 	buf = ap->buffers+offset;
 	buf->datahandle = datahandle;
 	buf->ncci = ncci;
+
+	head = &ap->buckets[plci_bucket(ap, ncci)];
+	buf->next = *head;
+	if (buf->next)
+		buf->next->pprev = &buf->next;
+	buf->pprev = head;
+	*head = buf;
+	pthread_mutex_unlock(&buffer_lock);
 }
 
+/*
+ * put a buffer back on the free list, buffer_lock must be held
+ */
 static unsigned return_buffer(unsigned char applid, unsigned offset)
 {
 	struct applinfo *ap;
@@ -514,7 +876,14 @@ static unsigned return_buffer(unsigned char applid, unsigned offset)
 	assert(offset < ap->maxbufs);
 	buf = ap->buffers+offset;
 	assert(buf->used == 1);
-	assert(buf->next == 0);
+
+	if (buf->pprev) {
+		*buf->pprev = buf->next;
+		if (buf->next)
+			buf->next->pprev = buf->pprev;
+		buf->pprev = 0;
+	}
+	buf->next = 0;
 
 	if (ap->lastfree) {
 		ap->lastfree->next = buf;
@@ -524,45 +893,104 @@ static unsigned return_buffer(unsigned char applid, unsigned offset)
 	}
 	buf->used = 0;
 	buf->ncci = 0;
+	buf->orphan = 0;
 	assert(ap->nbufs-- > 0);
 
 	return buf->datahandle;
 }
 
-static void cleanup_buffers_for_ncci(unsigned char applid, unsigned ncci)
+static void release_buffer(unsigned char applid, unsigned offset)
+{
+	pthread_mutex_lock(&buffer_lock);
+	return_buffer(applid, offset);
+	pthread_mutex_unlock(&buffer_lock);
+}
+
+/*
+ * DATA_B3_RESP for a buffer: returns 1 and the datahandle of the
+ * DATA_B3_IND if the RESP is to be sent. An orphaned buffer is freed
+ * without sending, a late RESP for a buffer not kept anymore is dropped.
+ */
+static int answer_buffer(unsigned char applid, unsigned offset, unsigned ncci,
+	unsigned *datahandle)
 {
 	struct applinfo *ap;
-	unsigned i;
-	
+	struct recvbuffer *buf;
+	int ret = 0;
+
 	assert(validapplid(applid));
+	pthread_mutex_lock(&buffer_lock);
 	ap = applinfo[applid];
-
-	for (i = 0; i < ap->maxbufs; i++) {
-		if (ap->buffers[i].used) {
-			assert(ap->buffers[i].ncci != 0);
-			if (ap->buffers[i].ncci == ncci) {
-				return_buffer(applid, i);
-			}
+	if ((offset < ap->maxbufs) && (ap->buffers[offset].used == 1)) {
+		buf = ap->buffers+offset;
+		if (buf->orphan) {
+			return_buffer(applid, offset);
+		} else if (buf->ncci == ncci) {
+			*datahandle = return_buffer(applid, offset);
+			ret = 1;
 		}
 	}
+	pthread_mutex_unlock(&buffer_lock);
+
+	return ret;
 }
 
-static void cleanup_buffers_for_plci(unsigned char applid, unsigned plci)
+/*
+ * orphan the buffers of a NCCI, or of all NCCIs of a PLCI if mask is 0xffff
+ */
+static void cleanup_buffers(unsigned char applid, unsigned id, unsigned mask)
 {
 	struct applinfo *ap;
-	unsigned i;
+	struct recvbuffer *buf, *next;
 	
 	assert(validapplid(applid));
+	pthread_mutex_lock(&buffer_lock);
 	ap = applinfo[applid];
 
-	for (i = 0; i < ap->maxbufs; i++) {
-		if (ap->buffers[i].used) {
-			assert(ap->buffers[i].ncci != 0);
-			if ((ap->buffers[i].ncci & 0xffff) == plci) {
-				return_buffer(applid, i);
-			}
+	for (buf = ap->buckets[plci_bucket(ap, id)]; buf; buf = next) {
+		next = buf->next;
+		assert(buf->ncci != 0);
+		if ((buf->ncci & mask) == id) {
+			*buf->pprev = buf->next;
+			if (buf->next)
+				buf->next->pprev = buf->pprev;
+			buf->next = 0;
+			buf->pprev = 0;
+			buf->ncci = 0;
+			buf->orphan = 1;
 		}
 	}
+	pthread_mutex_unlock(&buffer_lock);
+}
+
+static void cleanup_buffers_for_ncci(unsigned char applid, unsigned ncci)
+{
+	cleanup_buffers(applid, ncci, 0xffffffff);
+}
+
+static void cleanup_buffers_for_plci(unsigned char applid, unsigned plci)
+{
+	cleanup_buffers(applid, plci, 0xffff);
+}
+
+/*
+ * receive buffer statistics of an application
+ */
+int capi20ext_buffer_stats(unsigned ApplID, unsigned *total, unsigned *inuse,
+	unsigned *highwater, unsigned long *failures)
+{
+	struct applinfo *ap;
+
+	if (!validapplid(ApplID) || (applinfo[ApplID] == 0))
+		return -1;
+	pthread_mutex_lock(&buffer_lock);
+	ap = applinfo[ApplID];
+	*total = ap->maxbufs;
+	*inuse = ap->nbufs;
+	*highwater = ap->highwater;
+	*failures = ap->failures;
+	pthread_mutex_unlock(&buffer_lock);
+	return ap->hugepages;
 }
 
 /* 
@@ -693,29 +1121,32 @@ capi20_release (unsigned ApplID)
 	free_buffers(applinfo[ApplID]);
 	applinfo[ApplID] = 0;
 
+	/* write the trace of the last application */
+	for (ApplID = 1; ApplID < MAX_APPL; ApplID++) {
+		if (validapplid(ApplID))
+			break;
+	}
+	if (ApplID == MAX_APPL)
+		trace_stop();
+
 	return CapiNoError;
 }
 
-unsigned
-capi20_put_message (unsigned ApplID, unsigned char *Msg)
+/*
+ * copy message (and data of DATA_B3_REQ) into the send buffer,
+ * returns length of the buffer to write or 0 on error. A DATA_B3_RESP
+ * for a buffer already taken back is dropped, 0 is returned with
+ * CapiNoError then.
+ */
+static int prepare_put_message(unsigned ApplID, unsigned char *Msg,
+	unsigned char *sndbuf, unsigned *ret)
 {
-	unsigned char sndbuf[SEND_BUFSIZ], *sbuf;
-	unsigned ret;
+	unsigned char *sbuf;
 	int len = (Msg[0] | (Msg[1] << 8));
 	int cmd = Msg[4];
 	int subcmd = Msg[5];
-	int rc;
-	int fd;
 	int datareq = 0;
 
-	if (capi20_isinstalled_internal() != CapiNoError)
-		return CapiRegNotInstalled;
-
-	if (unlikely(!validapplid(ApplID)))
-		return CapiIllAppNr;
-
-	fd = applid2fd(ApplID);
-
 	sbuf = sndbuf;
 	if (remote_capi) {
 		sbuf = sndbuf + 2;
@@ -748,22 +1179,27 @@ capi20_put_message (unsigned ApplID, unsigned char *Msg)
 					dataptr = Msg + len; /* Assume data after message */
 				}
 			}
-			if (len + datalen > SEND_BUFSIZ)
-				return CapiMsgOSResourceErr;
+			if (len + datalen > SEND_BUFSIZ) {
+				*ret = CapiMsgOSResourceErr;
+				return 0;
+			}
 			memcpy(sbuf+len, dataptr, datalen);
 			len += datalen;
 		} else if (subcmd == CAPI_RESP) {
-			capimsg_setu16(sbuf, 12,
-			return_buffer(ApplID, CAPIMSG_U16(sbuf, 12)));
+			unsigned datahandle;
+
+			if (!answer_buffer(ApplID, CAPIMSG_U16(sbuf, 12), CAPIMSG_U32(sbuf, 8),
+					&datahandle)) {
+				*ret = CapiNoError;
+				return 0;
+			}
+			capimsg_setu16(sbuf, 12, datahandle);
 		}
 	}
 
 	if (cmd == CAPI_DISCONNECT_B3 && subcmd == CAPI_RESP)
 		cleanup_buffers_for_ncci(ApplID, CAPIMSG_U32(sbuf, 8));   
 
-	ret = CapiNoError;
-	errno = 0;
-
 	write_capi_trace(1, sbuf, len, datareq);
 
 	if (remote_capi) {
@@ -771,33 +1207,138 @@ capi20_put_message (unsigned ApplID, unsigned char *Msg)
 		sbuf = sndbuf;
 		put_netword(&sbuf, len);
 	}
-    if ((rc = write(fd, sndbuf, len)) != len) {
-		if (remote_capi) {
+
+	*ret = CapiNoError;
+	return len;
+}
+
+/*
+ * map errno of a failed write to capi error
+ */
+static unsigned put_message_error(int fd)
+{
+	unsigned ret;
+
+	if (remote_capi)
+		return CapiMsgOSResourceErr;
+
+	switch (errno) {
+	case EFAULT:
+	case EINVAL:
+		ret = CapiIllCmdOrSubcmdOrMsgToSmall;
+		break;
+	case EBADF:
+		ret = CapiIllAppNr;
+		break;
+	case EIO:
+		if (ioctl(fd, CAPI_GET_ERRCODE, &ioctl_data) < 0) {
 			ret = CapiMsgOSResourceErr;
 		} else {
-        	switch (errno) {
-	            case EFAULT:
-    	        case EINVAL:
-	                ret = CapiIllCmdOrSubcmdOrMsgToSmall;
-	                break;
-	            case EBADF:
-	                ret = CapiIllAppNr;
-	                break;
-	            case EIO:
-	                if (ioctl(fd, CAPI_GET_ERRCODE, &ioctl_data) < 0) {
-	                    ret = CapiMsgOSResourceErr;
-	                } else {
-						ret = (unsigned)ioctl_data.errcode;
-					}
-	                break;
-	          default:
-	                ret = CapiMsgOSResourceErr;
-	                break;
-	       }
-	    }
+			ret = (unsigned)ioctl_data.errcode;
+		}
+		break;
+	default:
+		ret = CapiMsgOSResourceErr;
+		break;
+	}
+
+	return ret;
+}
+
+unsigned
+capi20_put_message (unsigned ApplID, unsigned char *Msg)
+{
+	unsigned char sndbuf[SEND_BUFSIZ];
+	unsigned ret;
+	int len;
+	int fd;
+
+	if (capi20_isinstalled_internal() != CapiNoError)
+		return CapiRegNotInstalled;
+
+	if (unlikely(!validapplid(ApplID)))
+		return CapiIllAppNr;
+
+	fd = applid2fd(ApplID);
+
+	if ((len = prepare_put_message(ApplID, Msg, sndbuf, &ret)) == 0)
+		return ret;
+
+	errno = 0;
+	if (write(fd, sndbuf, len) != len) {
+		ret = put_message_error(fd);
+	}
+
+	return ret;
+}
+
+/*
+ * put several messages at once. The kernel CAPI device takes exactly
+ * one message per write(), so batching only saves syscalls on the
+ * remote CAPI socket, where all messages go out with one writev().
+ * Returns the number of messages sent in *sent.
+ * The send buffers are too large for the stack of the calling thread,
+ * every thread has its own set.
+ */
+static __thread unsigned char put_messages_sndbuf[CAPI20EXT_PUT_MESSAGES_MAX][SEND_BUFSIZ];
+
+unsigned
+capi20ext_put_messages (unsigned ApplID, unsigned char **Msgs, unsigned count, unsigned *sent)
+{
+	unsigned char (*sndbuf)[SEND_BUFSIZ] = put_messages_sndbuf;
+	struct iovec iov[CAPI20EXT_PUT_MESSAGES_MAX];
+	unsigned ret = CapiNoError;
+	unsigned n, k, done = 0;
+	ssize_t total = 0;
+	int len;
+	int fd;
+
+	*sent = 0;
+
+	if (capi20_isinstalled_internal() != CapiNoError)
+		return CapiRegNotInstalled;
+
+	if (unlikely(!validapplid(ApplID)))
+		return CapiIllAppNr;
+
+	fd = applid2fd(ApplID);
+
+	if (!remote_capi) {
+		for (n = 0; n < count; n++) {
+			if ((ret = capi20_put_message(ApplID, Msgs[n])) != CapiNoError)
+				break;
+			*sent = n + 1;
+		}
+		return ret;
+	}
+
+	while (done < count) {
+		for (n = 0, k = 0; (k < CAPI20EXT_PUT_MESSAGES_MAX) && (done + n < count); n++) {
+			if ((len = prepare_put_message(ApplID, Msgs[done + n], sndbuf[k], &ret)) == 0) {
+				if (ret != CapiNoError)
+					break;
+				/* dropped */
+				continue;
+			}
+			iov[k].iov_base = sndbuf[k];
+			iov[k].iov_len = len;
+			total += len;
+			k++;
+		}
+		if (k != 0) {
+			errno = 0;
+			if (writev(fd, iov, k) != total) {
+				return put_message_error(fd);
+			}
+			total = 0;
+		}
+		done += n;
+		*sent = done;
+		if (ret != CapiNoError)
+			break;
 	}
 
-    return ret;
+	return ret;
 }
 
 unsigned
@@ -867,7 +1408,7 @@ capi20_get_message (unsigned ApplID, unsigned char **Buf)
 			/* keep buffer */
 			return CapiNoError;
 		}
-		return_buffer(ApplID, offset);
+		release_buffer(ApplID, offset);
 		if ((CAPIMSG_COMMAND(rcvbuf) == CAPI_DISCONNECT) &&
 		    (CAPIMSG_SUBCOMMAND(rcvbuf) == CAPI_IND)) {
 			cleanup_buffers_for_plci(ApplID, CAPIMSG_U32(rcvbuf, 8));
@@ -875,7 +1416,7 @@ capi20_get_message (unsigned ApplID, unsigned char **Buf)
 		return CapiNoError;
 	}
 
-	return_buffer(ApplID, offset);
+	release_buffer(ApplID, offset);
 
 	if (rc == 0)
 		return CapiReceiveQueueEmpty;
@@ -1149,6 +1690,8 @@ static void exitlib(void)
 {
 	remote_capi = 0;
 
+	trace_stop();
+
     if (capi_fd >= 0) {
        close(capi_fd);
        capi_fd = -1;
@@ -65,6 +65,20 @@ char *capi20ext_get_raw_devname(
 
 int capi20ext_ncci_opencount(unsigned applid, unsigned ncci);
 
+#define CAPI20EXT_PUT_MESSAGES_MAX 16
+unsigned capi20ext_put_messages(
+	unsigned ApplID,
+	unsigned char **Msgs,
+	unsigned count,
+	unsigned *sent);
+
+#define CAPI20EXT_TRACE_STATS 1
+void capi20ext_trace_stats(unsigned long *written, unsigned long *dropped);
+
+#define CAPI20EXT_BUFFER_STATS 1
+int capi20ext_buffer_stats(unsigned ApplID, unsigned *total, unsigned *inuse,
+	unsigned *highwater, unsigned long *failures);
+
 /* end extentions functions (no standard functions) */
 
 #ifdef __cplusplus
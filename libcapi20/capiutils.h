@@ -333,6 +333,15 @@ char *capi_cmsg2str(_cmsg * cmsg);
 #define capi20_message2str capi_message2str
 char *capi_message2str(_cbyte * msg);
 
+/*
+ * reentrant versions, the string is written to the buffer of the caller
+ */
+#define capi20_cmsg2str_r	capi_cmsg2str_r
+char *capi_cmsg2str_r(_cmsg * cmsg, char *buf, size_t size);
+
+#define capi20_message2str_r capi_message2str_r
+char *capi_message2str_r(_cbyte * msg, char *buf, size_t size);
+
 /*-----------------------------------------------------------------------*/
 
 #define ALERT_REQ_PLCI(x) ((x)->adr.adrPLCI)
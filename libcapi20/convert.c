@@ -858,43 +858,58 @@ static char *pnames[] = {
 #endif
 };
 
-static char buf[8192];
-static char *p = 0;
+static char strbuf[8192];
 
 #include <stdio.h>
 #include <stdarg.h>
 
+/* output buffer of one string conversion */
+struct cdebbuf {
+	char *buf;
+	char *p;
+	size_t size;
+};
+
 /*-------------------------------------------------------*/
-static void bufprint(char *fmt,...)
+static void bufprint(struct cdebbuf *cdb, char *fmt,...)
 {
 	va_list f;
+	size_t left = cdb->size - (cdb->p - cdb->buf);
+	int n;
+
+	if (left <= 1)
+		return;
 	va_start(f, fmt);
-	vsprintf(p, fmt, f);
+	n = vsnprintf(cdb->p, left, fmt, f);
 	va_end(f);
-	p += strlen(p);
+	if (n < 0)
+		return;
+	if ((size_t)n >= left)
+		n = left - 1;
+	cdb->p += n;
 }
 
-static void printstructlen(_cbyte * m, unsigned len)
+static void printstructlen(struct cdebbuf *cdb, _cbyte * m, unsigned len)
 {
 	unsigned hex = 0;
 	for (; len; len--, m++)
 		if (isalnum(*m) || *m == ' ') {
 			if (hex)
-				bufprint(">");
-			bufprint("%c", *m);
+				bufprint(cdb, ">");
+			bufprint(cdb, "%c", *m);
 			hex = 0;
 		} else {
 			if (!hex)
-				bufprint("<%02x", *m);
+				bufprint(cdb, "<%02x", *m);
 			else
-				bufprint(" %02x", *m);
+				bufprint(cdb, " %02x", *m);
 			hex = 1;
 		}
 	if (hex)
-		bufprint(">");
+		bufprint(cdb, ">");
 }
 
-static void printstruct(_cbyte * m)
+static void printstruct(struct cdebbuf *cdb, _cbyte * m)
 {
 	unsigned len;
 	if (m[0] != 0xff) {
@@ -906,13 +921,13 @@ static void printstruct(_cbyte * m)
 		len = (unsigned)iw;
 		m += 3;
 	}
-	printstructlen(m, len);
+	printstructlen(cdb, m, len);
 }
 
 /*-------------------------------------------------------*/
 #define NAME (pnames[cmsg->par[cmsg->p]])
 
-static void protocol_message_2_pars(_cmsg * cmsg, int level)
+static void protocol_message_2_pars(struct cdebbuf *cdb, _cmsg * cmsg, int level)
 {
 	_cword iw;
 	_cdword idw;
@@ -922,38 +937,38 @@ static void protocol_message_2_pars(_cmsg * cmsg, int level)
 		int slen = 29 + 3 - level;
 		int i;
 
-		bufprint("  ");
+		bufprint(cdb, "  ");
 		for (i = 0; i < level - 1; i++)
-			bufprint(" ");
+			bufprint(cdb, " ");
 
 		switch (TYP) {
 		case _CBYTE:
-			bufprint("%-*s = 0x%x\n", slen, NAME, *(_cbyte *) (cmsg->m + cmsg->l));
+			bufprint(cdb, "%-*s = 0x%x\n", slen, NAME, *(_cbyte *) (cmsg->m + cmsg->l));
 			cmsg->l++;
 			break;
 		case _CWORD:
 			wordTLcpy(&iw, (cmsg->m + cmsg->l));
-			bufprint("%-*s = 0x%x\n", slen, NAME, iw);
+			bufprint(cdb, "%-*s = 0x%x\n", slen, NAME, iw);
 			cmsg->l += 2;
 			break;
 		case _CDWORD:
 			dwordTLcpy(&idw, (cmsg->m + cmsg->l));
-			bufprint("%-*s = 0x%lx\n", slen, NAME, idw);
+			bufprint(cdb, "%-*s = 0x%lx\n", slen, NAME, idw);
 			cmsg->l += 4;
 			break;
 		case _CQWORD:
 			qwordTLcpy(&iq, (cmsg->m + cmsg->l));
-			bufprint("%-*s = 0x%llx\n", slen, NAME, iq);
+			bufprint(cdb, "%-*s = 0x%llx\n", slen, NAME, iq);
 			cmsg->l += 4;
 			break;
 		case _CSTRUCT:
-			bufprint("%-*s = ", slen, NAME);
+			bufprint(cdb, "%-*s = ", slen, NAME);
 			if (cmsg->m[cmsg->l] == '\0') {
-				bufprint("default");
+				bufprint(cdb, "default");
 			} else {
-				printstruct(cmsg->m + cmsg->l);
+				printstruct(cdb, cmsg->m + cmsg->l);
 			}
-			bufprint("\n");
+			bufprint(cdb, "\n");
 			if (cmsg->m[cmsg->l] != 0xff) {
 				cmsg->l += 1 + cmsg->m[cmsg->l];
 			} else {
@@ -967,29 +982,36 @@ static void protocol_message_2_pars(_cmsg * cmsg, int level)
 		case _CMSTRUCT:
 /*----- Metastruktur 0 -----*/
 			if (cmsg->m[cmsg->l] == '\0') {
-				bufprint("%-*s = default\n", slen, NAME);
+				bufprint(cdb, "%-*s = default\n", slen, NAME);
 				cmsg->l++;
 				jumpcstruct(cmsg);
 			} else {
 				char *name = NAME;
 				unsigned _l = cmsg->l;
-				bufprint("%-*s\n", slen, name);
+				bufprint(cdb, "%-*s\n", slen, name);
 				cmsg->l = (cmsg->m + _l)[0] == 255 ? cmsg->l + 3 : cmsg->l + 1;
 				cmsg->p++;
-				protocol_message_2_pars(cmsg, level + 1);
+				protocol_message_2_pars(cdb, cmsg, level + 1);
 			}
 			break;
 		}
 	}
 }
 /*-------------------------------------------------------*/
-char *capi_message2str(_cbyte * msg)
+/*
+ * reentrant conversions of a message to a readable string,
+ * the result is written to buf
+ */
+char *capi_message2str_r(_cbyte * msg, char *buf, size_t size)
 {
 	_cmsg cmsg;
-	p = buf;
-	p[0] = 0;
+	struct cdebbuf cdb;
 	_cword id, msgnum, len;
 
+	cdb.buf = cdb.p = buf;
+	cdb.size = size;
+	buf[0] = 0;
+
 	cmsg.m = msg;
 	cmsg.l = 8;
 	cmsg.p = 0;
@@ -1001,20 +1023,22 @@ char *capi_message2str(_cbyte * msg)
 	wordTLcpy(&msgnum, &msg[6]);
 	wordTLcpy(&len, &msg[0]);
 
-	bufprint("%-26s ID=%03d #0x%04x LEN=%04d\n",
+	bufprint(&cdb, "%-26s ID=%03d #0x%04x LEN=%04d\n",
 		 mnames[command_2_index(cmsg.Command, cmsg.Subcommand)],
 		 id, msgnum, len);
 
-	protocol_message_2_pars(&cmsg, 1);
+	protocol_message_2_pars(&cdb, &cmsg, 1);
 	return buf;
 }
 
-char *capi_cmsg2str(_cmsg * cmsg)
+char *capi_cmsg2str_r(_cmsg * cmsg, char *buf, size_t size)
 {
+	struct cdebbuf cdb;
 	_cword id, msgnum, len;
 
-	p = buf;
-	p[0] = 0;
+	cdb.buf = cdb.p = buf;
+	cdb.size = size;
+	buf[0] = 0;
 	cmsg->l = 8;
 	cmsg->p = 0;
 
@@ -1022,10 +1046,23 @@ char *capi_cmsg2str(_cmsg * cmsg)
 	wordTLcpy(&msgnum, &cmsg->m[6]);
 	wordTLcpy(&len, &cmsg->m[0]);
 
-	bufprint("%-26s ID=%03d #0x%04x LEN=%04d\n",
+	bufprint(&cdb, "%-26s ID=%03d #0x%04x LEN=%04d\n",
 		 mnames[command_2_index(cmsg->Command, cmsg->Subcommand)],
 		 id, msgnum, len);
 
-	protocol_message_2_pars(cmsg, 1);
+	protocol_message_2_pars(&cdb, cmsg, 1);
 	return buf;
 }
+
+/*
+ * old interface, the result is in a static buffer
+ */
+char *capi_message2str(_cbyte * msg)
+{
+	return capi_message2str_r(msg, strbuf, sizeof(strbuf));
+}
+
+char *capi_cmsg2str(_cmsg * cmsg)
+{
+	return capi_cmsg2str_r(cmsg, strbuf, sizeof(strbuf));
+}
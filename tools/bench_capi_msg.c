@@ -0,0 +1,164 @@
+/*
+ * Benchmark of building the capi messages of every voice block with the
+ * format interpreter of capi_sendf() and with the fixed layout encoders
+ * of chan_capi_msg.h. Only the building is measured, not the put.
+ *
+ * Usage: bench_capi_msg [-n iterations]
+ *
+ * This program is free software and may be modified and
+ * distributed under the terms of the GNU Public License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "chan_capi_platform.h"
+#include "chan_capi20.h"
+#include "chan_capi_msg.h"
+
+unsigned capi_ApplID = 1;
+
+static unsigned long iterations = 10000000;
+static unsigned char data[160];
+static const unsigned char ncpi[] = { 4, 1, 2, 3, 4 };
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+#define SINK(m) __asm__ __volatile__("" : : "r" (m) : "memory")
+
+/* the same stack buffer as capi_sendf() */
+static int __attribute__((noinline)) sendf_encode(_cword command, _cdword Id, _cword Number,
+	char *format, ...)
+{
+	unsigned char msg[2048];
+	va_list ap;
+	int len, format_errors;
+
+	va_start(ap, format);
+	len = capi_encode_msgv(msg, sizeof(msg), command, Id, Number, format, ap, &format_errors);
+	va_end(ap);
+	SINK(msg);
+	return len;
+}
+
+static int __attribute__((noinline)) enc_data_b3_req(_cdword NCCI, _cword Number, _cword handle)
+{
+	unsigned char msg[CAPI_ENC_DATA_B3_REQ_SIZE];
+
+	capi_encode_data_b3_req(msg, NCCI, Number, data, sizeof(data), handle, 0);
+	SINK(msg);
+	return msg[0];
+}
+
+static int __attribute__((noinline)) enc_data_b3_resp(_cdword NCCI, _cword Number, _cword handle)
+{
+	unsigned char msg[CAPI_ENC_DATA_B3_RESP_SIZE];
+
+	capi_encode_data_b3_resp(msg, NCCI, Number, handle);
+	SINK(msg);
+	return msg[0];
+}
+
+static int __attribute__((noinline)) enc_connect_b3_resp(_cdword NCCI, _cword Number, _cword handle)
+{
+	unsigned char msg[CAPI_ENC_CONNECT_B3_RESP_SIZE];
+
+	capi_encode_connect_b3_resp(msg, NCCI, Number, 0, (_cstruct)ncpi);
+	SINK(msg);
+	return msg[0];
+}
+
+static int __attribute__((noinline)) enc_dtmf_req(_cdword NCCI, _cword Number, _cword handle)
+{
+	unsigned char msg[CAPI_ENC_DTMF_REQ_SIZE];
+
+	capi_encode_dtmf_req(msg, NCCI, Number, 1, 3, 40, 40, '5');
+	SINK(msg);
+	return msg[0];
+}
+
+static int sendf_data_b3_req(_cdword NCCI, _cword Number, _cword handle)
+{
+	return sendf_encode(CAPI_DATA_B3_REQ, NCCI, Number, "dwww", data, (unsigned int)sizeof(data), handle, 0);
+}
+
+static int sendf_data_b3_resp(_cdword NCCI, _cword Number, _cword handle)
+{
+	return sendf_encode(CAPI_DATA_B3_RESP, NCCI, Number, "w", handle);
+}
+
+static int sendf_connect_b3_resp(_cdword NCCI, _cword Number, _cword handle)
+{
+	return sendf_encode(CAPI_CONNECT_B3_RESP, NCCI, Number, "ws", 0, ncpi);
+}
+
+static int sendf_dtmf_req(_cdword NCCI, _cword Number, _cword handle)
+{
+	return sendf_encode(CAPI_FACILITY_REQ, NCCI, Number, "w(www(b)())", 1, 3, 40, 40, '5');
+}
+
+static double measure(int (*func)(_cdword NCCI, _cword Number, _cword handle))
+{
+	unsigned long long start;
+	unsigned long n;
+	int sum = 0;
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		sum += func(0x10101, (_cword)n, (_cword)(n >> 3));
+	}
+	SINK(&sum);
+	return (double)(now_ns() - start) / iterations;
+}
+
+static const struct {
+	const char *name;
+	int (*sendf)(_cdword NCCI, _cword Number, _cword handle);
+	int (*enc)(_cdword NCCI, _cword Number, _cword handle);
+} messages[] = {
+	{ "DATA_B3_REQ", sendf_data_b3_req, enc_data_b3_req },
+	{ "DATA_B3_RESP", sendf_data_b3_resp, enc_data_b3_resp },
+	{ "CONNECT_B3_RESP", sendf_connect_b3_resp, enc_connect_b3_resp },
+	{ "FACILITY_REQ DTMF", sendf_dtmf_req, enc_dtmf_req },
+};
+
+int main(int argc, char *argv[])
+{
+	double sendf, enc;
+	int c, m;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (iterations == 0) {
+		fprintf(stderr, "invalid argument\n");
+		return 1;
+	}
+
+	printf("ns per message, %lu iterations\n", iterations);
+	printf("%-20s %10s %10s\n", "message", "capi_sendf", "encoder");
+	for (m = 0; m < (int)(sizeof(messages) / sizeof(messages[0])); m++) {
+		sendf = measure(messages[m].sendf);
+		enc = measure(messages[m].enc);
+		printf("%-20s %10.1f %10.1f\n", messages[m].name, sendf, enc);
+	}
+
+	return 0;
+}
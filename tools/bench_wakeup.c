@@ -0,0 +1,337 @@
+/*
+ * Model of the wait loop of the CAPI device thread with Diva streams,
+ * to compare the CPU time and wakeups of the thread while idle and
+ * while streams are written.
+ *
+ *   poll:  wakeup every 5 ms, all streams are scanned for data to flush
+ *          (the behaviour before the ready queue)
+ *   event: all streams are polled every 5 ms only while streams exist,
+ *          the thread waits 500 ms otherwise. Streams with data to flush
+ *          are in a ready queue and flushed with the first poll after
+ *          their delay. A writer only wakes the thread through a pipe
+ *          if it has no poll scheduled.
+ *
+ * Writing a stream only sets its flush time here, the receive poll of
+ * real streams is modelled by the scan of all streams.
+ *
+ * Usage: bench_wakeup [-s streams] [-d flush delay ms] [-t seconds]
+ *
+ * This program is free software and may be modified and
+ * distributed under the terms of the GNU Public License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define POLL_INTERVAL  5    /* ms */
+#define IDLE_INTERVAL  500  /* ms */
+#define FRAME_INTERVAL 20   /* ms between two writes of a stream */
+
+struct stream {
+	pthread_mutex_t lock;
+	unsigned long long flush_due;  /* 0 if nothing to flush */
+	unsigned long long delay_due;  /* write time + delay, for the late time */
+	struct stream *ready_next;
+	int ready;
+};
+
+static struct stream *streams;
+static int nstreams;
+static unsigned int flush_delay;
+static int event_mode;
+static volatile int stop;
+
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream *ready_head, *ready_tail;
+static volatile unsigned long long next_poll;
+static unsigned long long rx_due;
+static int wakeup_fds[2];
+static volatile int wakeup_pending;
+
+static unsigned long wakeups, flushes, wakeup_writes;
+static unsigned long long late_sum, late_max;
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+static void flushed(unsigned long long due, unsigned long long now)
+{
+	unsigned long long late = (now > due) ? (now - due) : 0;
+
+	flushes++;
+	late_sum += late;
+	if (late > late_max)
+		late_max = late;
+}
+
+/* writer side, stream lock held */
+static void stream_write(struct stream *s, unsigned long long now)
+{
+	if (s->flush_due != 0)
+		return;
+	s->flush_due = now + (flush_delay * 1000ULL);
+	s->delay_due = s->flush_due;
+	if (!event_mode)
+		return;
+	if (next_poll != 0) {
+		/* flushed by a poll which is scheduled anyway */
+		if (s->flush_due < next_poll)
+			s->flush_due = next_poll;
+		else
+			s->flush_due = next_poll + ((s->flush_due - next_poll + (POLL_INTERVAL * 1000ULL) - 1) /
+				(POLL_INTERVAL * 1000ULL)) * (POLL_INTERVAL * 1000ULL);
+	}
+
+	pthread_mutex_lock(&ready_lock);
+	s->ready_next = NULL;
+	if (ready_tail != NULL)
+		ready_tail->ready_next = s;
+	else
+		ready_head = s;
+	ready_tail = s;
+	s->ready = 1;
+	pthread_mutex_unlock(&ready_lock);
+
+	if ((next_poll == 0) &&
+	    (__sync_lock_test_and_set(&wakeup_pending, 1) == 0)) {
+		wakeup_writes++;
+		if (write(wakeup_fds[1], "", 1) != 1)
+			perror("write");
+	}
+}
+
+static void *writer(void *arg)
+{
+	unsigned long long start = now_us(), now;
+	unsigned long long *next;
+	int n;
+
+	next = calloc(nstreams, sizeof(*next));
+	for (n = 0; n < nstreams; n++)
+		next[n] = start + ((unsigned long long)n * FRAME_INTERVAL * 1000ULL) / nstreams;
+
+	while (!stop) {
+		now = now_us();
+		for (n = 0; n < nstreams; n++) {
+			if (next[n] <= now) {
+				pthread_mutex_lock(&streams[n].lock);
+				stream_write(&streams[n], now);
+				pthread_mutex_unlock(&streams[n].lock);
+				next[n] += FRAME_INTERVAL * 1000ULL;
+			}
+		}
+		usleep(1000);
+	}
+	free(next);
+	return NULL;
+}
+
+static unsigned int wait_timeout(unsigned long long now)
+{
+	unsigned long long due;
+	unsigned int timeout;
+
+	if (!event_mode)
+		return POLL_INTERVAL;
+	if (nstreams == 0)
+		return IDLE_INTERVAL;
+
+	timeout = 0;
+	if (rx_due > now)
+		timeout = (unsigned int)((rx_due - now + 999) / 1000);
+	pthread_mutex_lock(&ready_lock);
+	if (ready_head != NULL) {
+		due = ready_head->flush_due;
+		if (due <= now)
+			timeout = 0;
+		else if ((due - now) < (timeout * 1000ULL))
+			timeout = (unsigned int)((due - now + 999) / 1000);
+	}
+	next_poll = now + (timeout * 1000ULL);
+	pthread_mutex_unlock(&ready_lock);
+
+	return timeout;
+}
+
+static void device_pass(void)
+{
+	unsigned long long now = now_us();
+	struct stream *s;
+	int n;
+
+	if (!event_mode) {
+		/* receive poll and flush of all streams */
+		for (n = 0; n < nstreams; n++) {
+			pthread_mutex_lock(&streams[n].lock);
+			if ((streams[n].flush_due != 0) && (streams[n].flush_due <= now)) {
+				flushed(streams[n].delay_due, now);
+				streams[n].flush_due = 0;
+			}
+			pthread_mutex_unlock(&streams[n].lock);
+		}
+		return;
+	}
+
+	/* receive poll of all streams, only every POLL_INTERVAL */
+	if (now >= rx_due) {
+		rx_due = now + (POLL_INTERVAL * 1000ULL);
+		for (n = 0; n < nstreams; n++) {
+			pthread_mutex_lock(&streams[n].lock);
+			pthread_mutex_unlock(&streams[n].lock);
+		}
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&ready_lock);
+		s = ready_head;
+		if ((s == NULL) || (s->flush_due > now)) {
+			pthread_mutex_unlock(&ready_lock);
+			break;
+		}
+		ready_head = s->ready_next;
+		if (ready_head == NULL)
+			ready_tail = NULL;
+		s->ready = 0;
+		pthread_mutex_unlock(&ready_lock);
+
+		pthread_mutex_lock(&s->lock);
+		if (s->flush_due != 0) {
+			flushed(s->delay_due, now);
+			s->flush_due = 0;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void *device(void *arg)
+{
+	struct pollfd pfd;
+	unsigned char dummy[16];
+	struct rusage ru;
+	double *cpu = arg;
+
+	pfd.fd = wakeup_fds[0];
+	pfd.events = POLLIN;
+
+	while (!stop) {
+		if (poll(&pfd, 1, wait_timeout(now_us())) > 0) {
+			__sync_lock_release(&wakeup_pending);
+			while (read(wakeup_fds[0], dummy, sizeof(dummy)) > 0);
+		}
+		wakeups++;
+		device_pass();
+	}
+
+	getrusage(RUSAGE_THREAD, &ru);
+	*cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+	return NULL;
+}
+
+static void run(const char *name, int mode, int nr, int seconds)
+{
+	pthread_t dev, wr;
+	double cpu = 0;
+	int n, flags;
+
+	event_mode = mode;
+	nstreams = nr;
+	stop = 0;
+	wakeups = flushes = wakeup_writes = 0;
+	late_sum = late_max = 0;
+	ready_head = ready_tail = NULL;
+	next_poll = 0;
+	rx_due = 0;
+	wakeup_pending = 0;
+
+	streams = calloc((nr != 0) ? nr : 1, sizeof(*streams));
+	for (n = 0; n < nr; n++)
+		pthread_mutex_init(&streams[n].lock, NULL);
+	if (pipe(wakeup_fds) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	for (n = 0; n < 2; n++) {
+		flags = fcntl(wakeup_fds[n], F_GETFL);
+		fcntl(wakeup_fds[n], F_SETFL, flags | O_NONBLOCK);
+	}
+
+	pthread_create(&dev, NULL, device, &cpu);
+	if (nr != 0)
+		pthread_create(&wr, NULL, writer, NULL);
+	sleep(seconds);
+	stop = 1;
+	if (nr != 0)
+		pthread_join(wr, NULL);
+	/* end a long idle wait */
+	if (write(wakeup_fds[1], "", 1) != 1)
+		perror("write");
+	pthread_join(dev, NULL);
+
+	printf("%-6s %7d %10.1f %10.1f %10lu %10.1f %10.2f %10.2f\n",
+		name, nr, (double)wakeups / seconds, cpu / seconds,
+		wakeup_writes, (double)flushes / seconds,
+		(flushes != 0) ? (late_sum / (double)flushes) / 1000.0 : 0.0,
+		late_max / 1000.0);
+
+	close(wakeup_fds[0]);
+	close(wakeup_fds[1]);
+	for (n = 0; n < nr; n++)
+		pthread_mutex_destroy(&streams[n].lock);
+	free(streams);
+}
+
+int main(int argc, char *argv[])
+{
+	int nr = 240, seconds = 5;
+	int c;
+
+	flush_delay = 2;
+	while ((c = getopt(argc, argv, "s:d:t:")) != -1) {
+		switch (c) {
+		case 's':
+			nr = atoi(optarg);
+			break;
+		case 'd':
+			flush_delay = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s streams] [-d flush delay ms] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((nr < 0) || (seconds < 1) || (flush_delay < 1)) {
+		fprintf(stderr, "invalid argument\n");
+		return 1;
+	}
+
+	printf("flush delay %u ms, %d s per run\n", flush_delay, seconds);
+	printf("%-6s %7s %10s %10s %10s %10s %10s %10s\n", "mode", "streams",
+		"wakeup/s", "cpu ms/s", "wakewrite", "flush/s", "late avg", "late max");
+	run("poll", 0, 0, seconds);
+	run("event", 1, 0, seconds);
+	run("poll", 0, nr, seconds);
+	run("event", 1, nr, seconds);
+	printf("late: ms between write + delay and flush\n");
+
+	return 0;
+}
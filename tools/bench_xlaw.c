@@ -0,0 +1,158 @@
+/*
+ * Benchmark of the bit reversal of voice data in xlaw.c, compares the
+ * table loop with the SSSE3 and AVX2 versions (where the CPU has them)
+ * and checks that all versions produce the same bytes.
+ *
+ * xlaw.c is included to reach its static functions.
+ *
+ * Usage: bench_xlaw [-n iterations]
+ *
+ * This program is free software and may be modified and
+ * distributed under the terms of the GNU Public License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "xlaw.c"
+
+typedef void (*reverse_func)(unsigned char *dst, const unsigned char *src, int len);
+
+struct version {
+	const char *name;
+	reverse_func func;
+	int supported;
+};
+
+static struct version versions[] = {
+	{ "table", capi_reverse_bits_scalar, 1 },
+#ifdef CAPI_XLAW_X86_SIMD
+	{ "ssse3", capi_reverse_bits_ssse3, 0 },
+	{ "avx2", capi_reverse_bits_avx2, 0 },
+#endif
+};
+
+#define NVERSIONS ((int)(sizeof(versions) / sizeof(versions[0])))
+
+/* short tails of the vector loops, a 20 ms frame at 8 kHz and large blocks */
+static const int lengths[] = { 1, 15, 33, 160, 1024, 2048 };
+
+#define NLENGTHS ((int)(sizeof(lengths) / sizeof(lengths[0])))
+#define MAX_LEN  2048
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int check(const struct version *v)
+{
+	unsigned char src[MAX_LEN + 1], ref[MAX_LEN + 1], dst[MAX_LEN + 1];
+	int len, off, j;
+
+	for (j = 0; j < (int)sizeof(src); j++)
+		src[j] = (unsigned char)(j * 7 + (j >> 8));
+
+	/* every length and an unaligned start */
+	for (off = 0; off < 2; off++) {
+		for (len = 0; len <= MAX_LEN - off; len++) {
+			for (j = 0; j < len; j++)
+				ref[j] = capi_reversebits[src[off + j]];
+			memset(dst, 0x55, sizeof(dst));
+			v->func(dst, src + off, len);
+			if ((memcmp(dst, ref, len) != 0) || (dst[len] != 0x55)) {
+				printf("%s: wrong result for length %d offset %d\n", v->name, len, off);
+				return -1;
+			}
+			/* in place */
+			memcpy(dst, src + off, len);
+			v->func(dst, dst, len);
+			if (memcmp(dst, ref, len) != 0) {
+				printf("%s: wrong in place result for length %d offset %d\n",
+					v->name, len, off);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static double measure(const struct version *v, int len, unsigned long iterations)
+{
+	static unsigned char buf[MAX_LEN];
+	unsigned long long start;
+	unsigned long n;
+	int j;
+
+	for (j = 0; j < len; j++)
+		buf[j] = (unsigned char)j;
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		v->func(buf, buf, len);
+		__asm__ __volatile__("" : : "r" (buf) : "memory");
+	}
+	return (double)(now_ns() - start) / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 1000000;
+	int c, i, l, errors = 0;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (iterations == 0) {
+		fprintf(stderr, "invalid argument\n");
+		return 1;
+	}
+
+#ifdef CAPI_XLAW_X86_SIMD
+	__builtin_cpu_init();
+	versions[1].supported = __builtin_cpu_supports("ssse3");
+	versions[2].supported = __builtin_cpu_supports("avx2");
+#endif
+
+	for (i = 0; i < NVERSIONS; i++) {
+		if (!versions[i].supported) {
+			printf("%s: not supported by this CPU\n", versions[i].name);
+			continue;
+		}
+		if (check(&versions[i]) != 0)
+			errors++;
+	}
+	if (errors != 0)
+		return 1;
+
+	printf("ns per block, %lu iterations\n", iterations);
+	printf("%-6s", "len");
+	for (i = 0; i < NVERSIONS; i++) {
+		if (versions[i].supported)
+			printf(" %10s", versions[i].name);
+	}
+	printf("\n");
+	for (l = 0; l < NLENGTHS; l++) {
+		printf("%-6d", lengths[l]);
+		for (i = 0; i < NVERSIONS; i++) {
+			if (versions[i].supported)
+				printf(" %10.1f", measure(&versions[i], lengths[l], iterations));
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Checks that the fixed layout encoders of chan_capi_msg.h build the same
+ * bytes as the format interpreter of capi_sendf() with the format strings
+ * they replace.
+ *
+ * This program is free software and may be modified and
+ * distributed under the terms of the GNU Public License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "chan_capi_platform.h"
+#include "chan_capi20.h"
+#include "chan_capi_msg.h"
+
+unsigned capi_ApplID;
+
+static int errors;
+static int checked;
+
+/* what capi_sendf() passes to _capi_put_msg() */
+static int sendf_encode(unsigned char *msg, _cword command, _cdword Id, _cword Number,
+	char *format, ...)
+{
+	va_list ap;
+	int len, format_errors;
+
+	va_start(ap, format);
+	len = capi_encode_msgv(msg, 2048, command, Id, Number, format, ap, &format_errors);
+	va_end(ap);
+	if ((len < 0) || (format_errors != 0)) {
+		printf("format \"%s\": error %d/%d\n", format, len, format_errors);
+		errors++;
+	}
+	return len;
+}
+
+static void compare(const char *name, const unsigned char *ref, int ref_len,
+	const unsigned char *enc, int size)
+{
+	int len = read_capi_word(enc);
+	int j;
+
+	checked++;
+	if ((len != ref_len) || (len > size) || (memcmp(ref, enc, len) != 0)) {
+		printf("%s: encoder differs from capi_sendf\n  sendf  ", name);
+		for (j = 0; j < ref_len; j++)
+			printf(" %02x", ref[j]);
+		printf("\n  encoder");
+		for (j = 0; (j < len) && (j < size); j++)
+			printf(" %02x", enc[j]);
+		printf("\n");
+		errors++;
+	}
+}
+
+int main(void)
+{
+	static const _cdword ids[] = { 0x00000000, 0x00010101, 0x12345678, 0xffffffff };
+	static const _cword words[] = { 0x0000, 0x0001, 0x00ff, 0x1234, 0xffff };
+	unsigned char ref[2048], enc[CAPI_ENC_CONNECT_B3_RESP_SIZE];
+	unsigned char ncpi[256], data[4];
+	const _cword nw = sizeof(words) / sizeof(words[0]);
+	int i, w, len;
+
+	for (i = 0; i < (int)(sizeof(ids) / sizeof(ids[0])); i++) {
+		for (w = 0; w < nw; w++) {
+			capi_ApplID = words[(w + 1) % nw];
+
+			len = sendf_encode(ref, CAPI_DATA_B3_REQ, ids[i], words[w],
+				"dwww", data, words[(w + 2) % nw], words[(w + 3) % nw], words[(w + 4) % nw]);
+			memset(enc, 0xaa, sizeof(enc));
+			capi_encode_data_b3_req(enc, ids[i], words[w],
+				data, words[(w + 2) % nw], words[(w + 3) % nw], words[(w + 4) % nw]);
+			compare("DATA_B3_REQ", ref, len, enc, CAPI_ENC_DATA_B3_REQ_SIZE);
+
+			len = sendf_encode(ref, CAPI_DATA_B3_RESP, ids[i], words[w],
+				"w", words[(w + 2) % nw]);
+			memset(enc, 0xaa, sizeof(enc));
+			capi_encode_data_b3_resp(enc, ids[i], words[w], words[(w + 2) % nw]);
+			compare("DATA_B3_RESP", ref, len, enc, CAPI_ENC_DATA_B3_RESP_SIZE);
+
+			len = sendf_encode(ref, CAPI_CONNECT_B3_RESP, ids[i], words[w],
+				"ws", words[(w + 2) % nw], NULL);
+			memset(enc, 0xaa, sizeof(enc));
+			capi_encode_connect_b3_resp(enc, ids[i], words[w], words[(w + 2) % nw], NULL);
+			compare("CONNECT_B3_RESP without NCPI", ref, len, enc, CAPI_ENC_CONNECT_B3_RESP_SIZE);
+
+			/* NCPI of 0 to 255 bytes */
+			ncpi[0] = (unsigned char)(words[w] * 37);
+			memset(&ncpi[1], 0x5a, 255);
+			len = sendf_encode(ref, CAPI_CONNECT_B3_RESP, ids[i], words[w],
+				"ws", words[(w + 2) % nw], ncpi);
+			memset(enc, 0xaa, sizeof(enc));
+			capi_encode_connect_b3_resp(enc, ids[i], words[w], words[(w + 2) % nw], ncpi);
+			compare("CONNECT_B3_RESP", ref, len, enc, CAPI_ENC_CONNECT_B3_RESP_SIZE);
+
+			len = sendf_encode(ref, CAPI_CONNECT_B3_ACTIVE_RESP, ids[i], words[w], "");
+			memset(enc, 0xaa, sizeof(enc));
+			capi_encode_connect_b3_active_resp(enc, ids[i], words[w]);
+			compare("CONNECT_B3_ACTIVE_RESP", ref, len, enc, CAPI_ENC_CONNECT_B3_ACTIVE_RESP_SIZE);
+
+			len = sendf_encode(ref, CAPI_FACILITY_REQ, ids[i], words[w],
+				"w(www()())", words[(w + 2) % nw], words[(w + 3) % nw],
+				words[(w + 4) % nw], words[w]);
+			memset(enc, 0xaa, sizeof(enc));
+			capi_encode_dtmf_req(enc, ids[i], words[w], words[(w + 2) % nw],
+				words[(w + 3) % nw], words[(w + 4) % nw], words[w], -1);
+			compare("FACILITY_REQ DTMF listen", ref, len, enc, CAPI_ENC_DTMF_REQ_SIZE);
+
+			len = sendf_encode(ref, CAPI_FACILITY_REQ, ids[i], words[w],
+				"w(www(b)())", words[(w + 2) % nw], words[(w + 3) % nw],
+				words[(w + 4) % nw], words[w], '0' + w);
+			memset(enc, 0xaa, sizeof(enc));
+			capi_encode_dtmf_req(enc, ids[i], words[w], words[(w + 2) % nw],
+				words[(w + 3) % nw], words[(w + 4) % nw], words[w], '0' + w);
+			compare("FACILITY_REQ DTMF digit", ref, len, enc, CAPI_ENC_DTMF_REQ_SIZE);
+		}
+	}
+
+	if (errors != 0) {
+		printf("%d of %d messages differ\n", errors, checked);
+		return 1;
+	}
+	printf("%d messages identical\n", checked);
+	return 0;
+}
@@ -1651,3 +1651,167 @@ const unsigned char capiINT2ALAW[8192] = {
   85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85
 };
 
+
+/*
+ * Bit reversal of voice data (CAPI transmits bytes LSB first).
+ * On x86 the SSSE3/AVX2 versions reverse both nibbles of 16/32 bytes
+ * with one table shuffle each, the CPU is checked on first use.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define CAPI_XLAW_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+static void capi_reverse_bits_scalar(unsigned char *dst, const unsigned char *src, int len)
+{
+	int j;
+
+	for (j = 0; j < len; j++) {
+		dst[j] = capi_reversebits[src[j]];
+	}
+}
+
+#ifdef CAPI_XLAW_X86_SIMD
+__attribute__((target("ssse3")))
+static void capi_reverse_bits_ssse3(unsigned char *dst, const unsigned char *src, int len)
+{
+	/* reversed low nibble as high nibble, reversed high nibble as low nibble */
+	const __m128i rev_hi = _mm_setr_epi8(0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+		0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, (char)0xf0);
+	const __m128i rev_lo = _mm_setr_epi8(0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+		0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	int j;
+
+	for (j = 0; j + 16 <= len; j += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + j));
+		__m128i lo = _mm_and_si128(v, mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+
+		v = _mm_or_si128(_mm_shuffle_epi8(rev_hi, lo), _mm_shuffle_epi8(rev_lo, hi));
+		_mm_storeu_si128((__m128i *)(dst + j), v);
+	}
+	capi_reverse_bits_scalar(dst + j, src + j, len - j);
+}
+
+__attribute__((target("avx2")))
+static void capi_reverse_bits_avx2(unsigned char *dst, const unsigned char *src, int len)
+{
+	const __m256i rev_hi = _mm256_setr_epi8(0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+		0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, (char)0xf0,
+		0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+		0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, (char)0xf0);
+	const __m256i rev_lo = _mm256_setr_epi8(0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+		0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f,
+		0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+		0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f);
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	int j;
+
+	for (j = 0; j + 32 <= len; j += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + j));
+		__m256i lo = _mm256_and_si256(v, mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+
+		v = _mm256_or_si256(_mm256_shuffle_epi8(rev_hi, lo), _mm256_shuffle_epi8(rev_lo, hi));
+		_mm256_storeu_si256((__m256i *)(dst + j), v);
+	}
+	capi_reverse_bits_ssse3(dst + j, src + j, len - j);
+}
+#endif
+
+static void capi_reverse_bits_select(unsigned char *dst, const unsigned char *src, int len);
+
+static void (*capi_reverse_bits_func)(unsigned char *dst, const unsigned char *src, int len) =
+	capi_reverse_bits_select;
+
+static void capi_reverse_bits_select(unsigned char *dst, const unsigned char *src, int len)
+{
+	void (*func)(unsigned char *dst, const unsigned char *src, int len) = capi_reverse_bits_scalar;
+
+#ifdef CAPI_XLAW_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		func = capi_reverse_bits_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		func = capi_reverse_bits_ssse3;
+	}
+#endif
+	capi_reverse_bits_func = func;
+	func(dst, src, len);
+}
+
+/*
+ * dst[j] = reversed src[j], dst may be equal to src
+ */
+void capi_reverse_bits(unsigned char *dst, const unsigned char *src, int len)
+{
+	capi_reverse_bits_func(dst, src, len);
+}
+
+/*
+ * dst[j] = table[src[j]], dst may be equal to src
+ */
+void capi_xform_bytes(unsigned char *dst, const unsigned char *src, int len,
+	const unsigned char *table)
+{
+	int j;
+
+	for (j = 0; j < len; j++) {
+		dst[j] = table[src[j]];
+	}
+}
+
+/*
+ * echo suppressor: bit reversal plus the energy of the line bytes
+ * in one pass over the frame. The energy is summed per chunk while
+ * the chunk is still in cache. Only the bit reversal is vectorized,
+ * the energy is a scalar lookup in the magnitude table of the line
+ * bytes (capi_line_magnitude).
+ */
+#define CAPI_ES_CHUNK 64
+
+static inline __attribute__((always_inline)) unsigned int capi_line_energy(
+	const unsigned char *line, int len, const unsigned short *magnitude)
+{
+	unsigned int sum = 0;
+	int j;
+
+	for (j = 0; j < len; j++) {
+		sum += magnitude[line[j]];
+	}
+	return sum;
+}
+
+unsigned int capi_es_rx(unsigned char *dst, const unsigned char *src, int len,
+	const unsigned short *magnitude)
+{
+	unsigned int sum = 0;
+	int j, n;
+
+	for (j = 0; j < len; j += n) {
+		n = len - j;
+		if (n > CAPI_ES_CHUNK)
+			n = CAPI_ES_CHUNK;
+		sum += capi_line_energy(src + j, n, magnitude);
+		capi_reverse_bits_func(dst + j, src + j, n);
+	}
+	return sum;
+}
+
+unsigned int capi_es_tx(unsigned char *dst, const unsigned char *src, int len,
+	const unsigned short *magnitude)
+{
+	unsigned int sum = 0;
+	int j, n;
+
+	for (j = 0; j < len; j += n) {
+		n = len - j;
+		if (n > CAPI_ES_CHUNK)
+			n = CAPI_ES_CHUNK;
+		capi_reverse_bits_func(dst + j, src + j, n);
+		sum += capi_line_energy(dst + j, n, magnitude);
+	}
+	return sum;
+}
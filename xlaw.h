@@ -10,5 +10,13 @@ extern const unsigned char capiINT2ULAW[16384];
 extern const short capiALAW2INT[];
 extern const unsigned char capiINT2ALAW[8192];
 
+extern void capi_reverse_bits(unsigned char *dst, const unsigned char *src, int len);
+extern void capi_xform_bytes(unsigned char *dst, const unsigned char *src, int len,
+	const unsigned char *table);
+extern unsigned int capi_es_rx(unsigned char *dst, const unsigned char *src, int len,
+	const unsigned short *magnitude);
+extern unsigned int capi_es_tx(unsigned char *dst, const unsigned char *src, int len,
+	const unsigned short *magnitude);
+
 #endif
 